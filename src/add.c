@@ -21,6 +21,7 @@
 #include <curses.h>
 
 #include "event.h"
+#include "input.h"
 #include "main.h"
 #include "output.h"
 #include "rl.h"
@@ -190,8 +191,9 @@ pal_add_get_range (GDate *date)
 
 /* reuturned string should be freed */
 static gchar *
-pal_add_get_recur (GDate *date)
+pal_add_get_recur (const PalQuery *query, GDate *date)
 {
+  PalDate day = pal_date_from_gdate (date);
   gchar *selection = NULL;
   int i;
 
@@ -207,7 +209,7 @@ pal_add_get_recur (GDate *date)
       char buffer[16] = "";
       char *descr = NULL;
 
-      descr = PalEventTypes[i].get_descr (date);
+      descr = PalEventTypes[i].get_descr (day);
       if (!descr) /* Not applicable */
         continue;
 
@@ -241,13 +243,13 @@ pal_add_get_recur (GDate *date)
           continue;
         }
 
-      if (PalEventTypes[sel].get_key (date, selkey) != TRUE)
+      if (PalEventTypes[sel].get_key (query, day, selkey) != TRUE)
         {
           rl_ding ();
           continue;
         }
 
-      descr = PalEventTypes[sel].get_descr (date);
+      descr = PalEventTypes[sel].get_descr (day);
       move (y, 0);
       pal_output_fg (BRIGHT, GREEN, "Event type: ");
       g_print ("%s\n", descr);
@@ -576,10 +578,12 @@ pal_add_write_file (gchar *filename, gchar *key, gchar *desc)
   g_print ("Wrote new event \"%s %s\" to %s.\n", key, desc, filename);
   g_free (write_line);
   fclose (file);
+
+  pal_input_file_written (filename);
 }
 
 void
-pal_add_event (GDate *selected_date)
+pal_add_event (const PalQuery *query, GDate *selected_date)
 {
   gchar *filename = NULL;
   gchar *description = NULL;
@@ -600,7 +604,7 @@ pal_add_event (GDate *selected_date)
   filename = pal_add_get_file ();
   g_print ("\n");
 
-  key = pal_add_get_recur (selected_date);
+  key = pal_add_get_recur (query, selected_date);
 
   g_print ("\n");
   pal_output_fg (BRIGHT, GREEN, "Date (in pal's format):");
@@ -23,7 +23,7 @@
 
 #include "main.h"
 
-void pal_add_event (GDate *);
+void pal_add_event (const PalQuery *, GDate *);
 gchar *pal_add_get_date_recur (void);
 void pal_add_write_file (gchar *filename, gchar *key, gchar *desc);
 #endif
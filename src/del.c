@@ -31,20 +31,23 @@
 void
 pal_del_write_file (PalEvent *dead_event)
 {
-  FILE *file = NULL;
-  gchar *filename = g_strdup (dead_event->file_name);
+  PalInputFile *in = NULL;
+  gchar *filename = g_strdup (dead_event->cold->file_name);
   FILE *out_file = NULL;
   gchar *out_filename = NULL;
   PalEvent *event_head = NULL;
+  PalQuery *query;
 
   g_strstrip (filename);
   out_filename = g_strconcat (filename, ".paltmp", NULL);
 
-  file = fopen (filename, "r");
-  if (file == NULL)
+  in = pal_input_open (filename);
+  if (in == NULL)
     {
       pal_output_error ("ERROR: Can't read file: %s\n", filename);
       pal_output_error ("       The event was NOT deleted.");
+      g_free (out_filename);
+      g_free (filename);
       return;
     }
 
@@ -53,31 +56,48 @@ pal_del_write_file (PalEvent *dead_event)
     {
       pal_output_error ("ERROR: Can't write file: %s\n", out_filename);
       pal_output_error ("       The event was NOT deleted.");
-      if (file != NULL)
-        fclose (file);
+      pal_input_close (in);
+      g_free (out_filename);
+      g_free (filename);
       return;
     }
 
-  pal_input_skip_comments (file, out_file);
-  event_head = pal_input_read_head (file, out_file, filename);
+  pal_input_skip_comments (in, out_file);
+  event_head = pal_input_read_head (in, out_file);
+  if (event_head == NULL)
+    {
+      pal_output_error ("       The event was NOT deleted.");
+      pal_input_close (in);
+      fclose (out_file);
+      remove (out_filename);
+      g_free (out_filename);
+      g_free (filename);
+      return;
+    }
+
+  query = pal_query_new (pal_date_today ());
 
   while (1)
     {
       PalEvent *pal_event = NULL;
 
-      pal_input_skip_comments (file, out_file);
+      pal_input_skip_comments (in, out_file);
 
-      pal_event = pal_input_read_event (file, out_file, filename, event_head,
+      pal_event = pal_input_read_event (query, in, out_file, event_head,
                                         dead_event);
 
       /* stop trying to delete dead_event if we just deleted it */
       if (dead_event != NULL && pal_event == dead_event)
         dead_event = NULL;
-      else if (pal_event == NULL && pal_input_eof (file))
+      else if (pal_event != NULL)
+        pal_event_free (pal_event);
+      else if (pal_input_eof (in))
         break;
     }
 
-  fclose (file);
+  pal_query_free (query);
+  pal_event_free (event_head);
+  pal_input_close (in);
   fclose (out_file);
 
   if (rename (out_filename, filename) != 0)
@@ -85,9 +105,13 @@ pal_del_write_file (PalEvent *dead_event)
       pal_output_error ("ERROR: Can't rename %s to %s\n", out_filename,
                         filename);
       pal_output_error ("       The event was NOT deleted.");
+      g_free (out_filename);
+      g_free (filename);
       return;
     }
 
+  pal_input_file_written (filename);
+
   if (dead_event == NULL)
     {
       pal_output_fg (BRIGHT, GREEN, ">>> ");
@@ -96,6 +120,7 @@ pal_del_write_file (PalEvent *dead_event)
   else
     pal_output_error ("ERROR: Couldn't find event to be deleted in %s",                       filename);
 
+  g_free (out_filename);
   g_free (filename);
 }
 
@@ -52,48 +52,43 @@ pal_edit_get_field_val (int i, PalEvent *event, GDate *d)
     case 0:
       return g_strdup (event->text);
     case 1:
-      return event->eventtype->get_descr (d);
+      return PAL_EVENT_TYPE (event)->get_descr (pal_date_from_gdate (d));
     case 2:
       buf = g_malloc (sizeof (gchar) * 128);
       snprintf (buf, 128, "%d", event->period_count);
       return buf;
     case 3:
-      if (event->start_date == NULL)
-        return g_strdup ("None");
-
-      buf = g_malloc (sizeof (gchar) * 128);
-      g_date_strftime (buf, 128, settings->date_fmt, event->start_date);
-      return buf;
-
     case 4:
-      if (event->end_date == NULL)
-        return g_strdup ("None");
-
-      buf = g_malloc (sizeof (gchar) * 128);
-      g_date_strftime (buf, 128, settings->date_fmt, event->end_date);
-      return buf;
+      {
+        guint32 day = (i == 3) ? event->start_day : event->end_day;
+        GDate date;
+
+        if (day == PAL_NO_DAY)
+          return g_strdup ("None");
+
+        pal_date_to_gdate (pal_date_from_julian (day), &date);
+        buf = g_malloc (sizeof (gchar) * 128);
+        g_date_strftime (buf, 128, settings->date_fmt, &date);
+        return buf;
+      }
     case 5:
-      if (event->start_time == NULL)
-        return g_strdup ("None");
-
-      buf = g_malloc (sizeof (gchar) * 128);
-      snprintf (buf, 128, "%02d:%02d", event->start_time->hour,
-                event->start_time->min);
-      return buf;
     case 6:
-      if (event->end_time == NULL)
-        return g_strdup ("None");
+      {
+        gint16 time = (i == 5) ? event->start_time : event->end_time;
 
-      buf = g_malloc (sizeof (gchar) * 128);
-      snprintf (buf, 128, "%02d:%02d", event->end_time->hour,
-                event->end_time->min);
-      return buf;
+        if (time == PAL_NO_TIME)
+          return g_strdup ("None");
+
+        buf = g_malloc (sizeof (gchar) * 128);
+        snprintf (buf, 128, "%02d:%02d", time / 60, time % 60);
+        return buf;
+      }
     case 7:
-      return g_strdup (event->key);
+      return pal_event_key_string (event);
     case 8:
-      return g_strdup (event->date_string);
+      return g_strdup (event->cold->date_string);
     case 9:
-      return g_strdup (event->file_name);
+      return g_strdup (event->cold->file_name);
     case 10:
       buf = g_malloc (sizeof (gchar) * 128);
       snprintf (buf, 128, "%c%c", event->start, event->end);
@@ -24,122 +24,585 @@
 #include "event.h"
 #include "main.h"
 
-static gint get_nth_day (const GDate *date);
-static gboolean last_weekday_of_month (const GDate *date);
+static gint get_nth_day (PalDate date);
+static gboolean last_weekday_of_month (PalDate date);
 
 /* Currently in add.c, should be moved at some stage */
 void pal_add_suffix (gint number, gchar *suffix, gint buf_size);
 
+/* Easter sunday for the years from PAL_EASTER_FIRST_YEAR to
+ * PAL_EASTER_LAST_YEAR, as the number of days after March 21st */
+#define PAL_EASTER_FIRST_YEAR 1900
+#define PAL_EASTER_LAST_YEAR 2199
+static const guint8 pal_easter_table[] = {
+  25, 17,  9, 22, 13, 33, 25, 10, 29, 21,  /* 1900 */
+   6, 26, 17,  2, 22, 14, 33, 18, 10, 30,  /* 1910 */
+  14,  6, 26, 11, 30, 22, 14, 27, 18, 10,  /* 1920 */
+  30, 15,  6, 26, 11, 31, 22,  7, 27, 19,  /* 1930 */
+   3, 23, 15, 35, 19, 11, 31, 16,  7, 27,  /* 1940 */
+  19,  4, 23, 15, 28, 20, 11, 31, 16,  8,  /* 1950 */
+  27, 12, 32, 24,  8, 28, 20,  5, 24, 16,  /* 1960 */
+   8, 21, 12, 32, 24,  9, 28, 20,  5, 25,  /* 1970 */
+  16, 29, 21, 13, 32, 17,  9, 29, 13,  5,  /* 1980 */
+  25, 10, 29, 21, 13, 26, 17,  9, 22, 14,  /* 1990 */
+  33, 25, 10, 30, 21,  6, 26, 18,  2, 22,  /* 2000 */
+  14, 34, 18, 10, 30, 15,  6, 26, 11, 31,  /* 2010 */
+  22, 14, 27, 19, 10, 30, 15,  7, 26, 11,  /* 2020 */
+  31, 23,  7, 27, 19,  4, 23, 15, 35, 20,  /* 2030 */
+  11, 31, 16,  8, 27, 19,  4, 24, 15, 28,  /* 2040 */
+  20, 12, 31, 16,  8, 28, 12, 32, 24,  9,  /* 2050 */
+  28, 20,  5, 25, 16,  8, 21, 13, 32, 24,  /* 2060 */
+   9, 29, 20,  5, 25, 17, 29, 21, 13, 33,  /* 2070 */
+  17,  9, 29, 14,  5, 25, 10, 30, 21, 13,  /* 2080 */
+  26, 18,  9, 22, 14, 34, 25, 10, 30, 22,  /* 2090 */
+   7, 27, 19,  4, 23, 15, 28, 20, 11, 31,  /* 2100 */
+  16,  8, 27, 12, 32, 24,  8, 28, 20,  5,  /* 2110 */
+  24, 16,  8, 21, 12, 32, 24,  9, 28, 20,  /* 2120 */
+   5, 25, 16, 29, 21, 13, 32, 17,  9, 29,  /* 2130 */
+  13,  5, 25, 10, 29, 21, 13, 26, 17,  9,  /* 2140 */
+  22, 14, 33, 25, 10, 30, 21,  6, 26, 18,  /* 2150 */
+   2, 22, 14, 34, 18, 10, 30, 15,  6, 26,  /* 2160 */
+  11, 31, 22, 14, 27, 19, 10, 30, 15,  7,  /* 2170 */
+  26, 11, 31, 23,  7, 27, 19,  4, 23, 15,  /* 2180 */
+  35, 20, 11, 31, 16,  8, 27, 19,  4, 24,  /* 2190 */
+};
+
+/* Facts about one year that the recurring event types need */
+typedef struct _PalYearFacts
+{
+  gint year;               /* 0 if this entry isn't used yet */
+  guint32 first_julian;    /* julian day of January 1st */
+  guint32 easter_julian;   /* julian day of Easter sunday */
+  guint16 month_start[13]; /* day of the year (0 = January 1st) that
+                              each month starts on, the last item is
+                              the number of days in the year */
+  guint8 first_weekday[12];    /* weekday of the 1st of each month,
+                                  1(mon) -> 7(sun) */
+  guint32 last_weekday_days[12]; /* bit n is set if day n is the last
+                                    of its weekday in the month */
+} PalYearFacts;
+
+/* years looked up recently, by year % 16.  Nothing guards it, so only
+ * the main thread may look up year facts.  Of the functions here, the
+ * threads that load files (see pal_input_load_job) only call
+ * parse_event, pal_event_once_day and the ones that make, copy and
+ * allocate events. */
+static PalYearFacts pal_year_facts_cache[16];
+
+/* weekday of a julian day: 1(mon) -> 7(sun), like g_date_get_weekday */
+static gint
+pal_event_julian_weekday (guint32 julian)
+{
+  return ((julian - 1) % 7) + 1;
+}
+
+/* PalDate conversions count days from March 1st of year 0, so the
+ * leap day is the last day of a year and the month lengths repeat in
+ * a 5 month pattern.  That turns them into plain arithmetic, without
+ * tables or branches.  January 1st of year 1 is day 306. */
+#define PAL_DATE_MARCH_OFFSET 305
+
+/* the date of a julian day (1 = January 1st, year 1, as in GDate) */
+PalDate
+pal_date_from_julian (guint32 julian)
+{
+  PalDate date;
+  guint32 z = julian + PAL_DATE_MARCH_OFFSET;
+  guint32 era = z / 146097;
+  guint32 doe = z - era * 146097; /* day of the 400 year era */
+  guint32 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  guint32 doy = doe - (365 * yoe + yoe / 4 - yoe / 100); /* from March */
+  guint32 mp = (5 * doy + 2) / 153; /* month, 0 = March */
+  guint32 month = mp + 3 - 12 * (mp >= 10);
+
+  date.julian = julian;
+  date.day = doy - (153 * mp + 2) / 5 + 1;
+  date.month = month;
+  date.year = era * 400 + yoe + (month <= 2);
+  date.weekday = pal_event_julian_weekday (julian);
+  return date;
+}
+
+/* the date of a valid day, month and year */
+PalDate
+pal_date_from_dmy (gint day, gint month, gint year)
+{
+  guint32 y = year - (month <= 2);
+  guint32 era = y / 400;
+  guint32 yoe = y - era * 400;
+  guint32 mp = (month + 9) % 12;
+  guint32 doy = (153 * mp + 2) / 5 + day - 1;
+  guint32 doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  PalDate date;
+
+  date.julian = era * 146097 + doe - PAL_DATE_MARCH_OFFSET;
+  date.day = day;
+  date.month = month;
+  date.year = year;
+  date.weekday = pal_event_julian_weekday (date.julian);
+  return date;
+}
+
+PalDate
+pal_date_from_gdate (const GDate *date)
+{
+  return pal_date_from_julian (g_date_get_julian (date));
+}
+
+/* sets gdate to date, for the glib functions that need a GDate */
+void
+pal_date_to_gdate (PalDate date, GDate *gdate)
+{
+  g_date_clear (gdate, 1);
+  g_date_set_dmy (gdate, (GDateDay)date.day, (GDateMonth)date.month,
+                  (GDateYear)date.year);
+}
+
+/* the local date now */
+PalDate
+pal_date_today (void)
+{
+  time_t now = time (NULL);
+  struct tm tm;
+
+  localtime_r (&now, &tm);
+  return pal_date_from_dmy (tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900);
+}
+
+PalDate
+pal_date_add_days (PalDate date, gint n)
+{
+  return pal_date_from_julian (date.julian + n);
+}
+
+/* day of the year that Easter sunday is on (0 = January 1st).  Uses
+ * the table where it can, otherwise computes it. */
+static gint
+pal_event_easter_day (gint year, gboolean leap)
+{
+  gint a, b, c, d, e, f, g, h, i, k, l, m, after_march_21;
+
+  if (year >= PAL_EASTER_FIRST_YEAR && year <= PAL_EASTER_LAST_YEAR)
+    after_march_21 = pal_easter_table[year - PAL_EASTER_FIRST_YEAR];
+  else
+    {
+      a = year % 19;
+      b = year / 100;
+      c = year % 100;
+      d = b / 4;
+      e = b % 4;
+      f = (b + 8) / 25;
+      g = (b - f + 1) / 3;
+      h = (19 * a + b - d - g + 15) % 30;
+      i = c / 4;
+      k = c % 4;
+      l = (32 + 2 * e + 2 * i - h - k) % 7;
+      m = (a + 11 * h + 22 * l) / 451;
+
+      /* (h + l - 7 * m + 114) is 31 * month + day - 1 */
+      after_march_21 = h + l - 7 * m + 114 - 3 * 31 + 1 - 21;
+    }
+
+  /* march 21st is day 79 of the year, or 80 in leap years */
+  return (leap ? 80 : 79) + after_march_21;
+}
+
+/* Returns the facts about "year", computing them the first time */
+static const PalYearFacts *
+pal_year_facts (gint year)
+{
+  PalYearFacts *facts = &pal_year_facts_cache[year & 15];
+  gboolean leap;
+  gint month;
+
+  if (facts->year == year)
+    return facts;
+
+  leap = g_date_is_leap_year ((GDateYear)year);
+
+  facts->year = year;
+  facts->first_julian = pal_date_from_dmy (1, G_DATE_JANUARY, year).julian;
+  facts->easter_julian
+      = facts->first_julian + pal_event_easter_day (year, leap);
+  facts->month_start[0] = 0;
+
+  for (month = 1; month <= 12; month++)
+    {
+      gint days = g_date_get_days_in_month ((GDateMonth)month,
+                                            (GDateYear)year);
+      guint32 first = facts->first_julian + facts->month_start[month - 1];
+
+      facts->month_start[month] = facts->month_start[month - 1] + days;
+      facts->first_weekday[month - 1] = pal_event_julian_weekday (first);
+
+      /* the last 7 days of the month */
+      facts->last_weekday_days[month - 1]
+          = ((1u << 7) - 1) << (days - 6);
+    }
+
+  return facts;
+}
+
+/* julian day of the given date, which must be valid */
+static guint32
+pal_event_julian (gint day, gint month, gint year)
+{
+  const PalYearFacts *facts = pal_year_facts (year);
+  return facts->first_julian + facts->month_start[month - 1] + day - 1;
+}
+
+/* number of days in the month */
+static gint
+pal_event_month_days (const PalYearFacts *facts, gint month)
+{
+  return facts->month_start[month] - facts->month_start[month - 1];
+}
+
+/* convert friendly weekday used in keys to the glib weekday
+   from: 1(sun) -> 7(sat)
+   to:   1(mon) -> 7(sun) */
+static gint
+pal_event_weekday_from_key (gint weekday)
+{
+  return (weekday == 1) ? 7 : weekday - 1;
+}
+
+/* the friendly weekday used in keys for date: 1(sun) -> 7(sat) */
+static gint
+pal_event_key_weekday (PalDate date)
+{
+  return (date.weekday % 7) + 1;
+}
+
+/* value of the two digits at s */
+static guint32
+pal_event_key_digits (const gchar *s)
+{
+  return g_ascii_digit_value (s[0]) * 10 + g_ascii_digit_value (s[1]);
+}
+
+/* julian day of the n-th weekday (1=mon ... 7=sun) in the month, or 0
+ * if the month doesn't have that many */
+static guint32
+pal_event_nth_weekday (gint n, gint weekday, gint month, gint year)
+{
+  const PalYearFacts *facts = pal_year_facts (year);
+  gint day = 1 + (weekday - facts->first_weekday[month - 1] + 7) % 7;
+
+  day += 7 * (n - 1);
+  if (day > pal_event_month_days (facts, month))
+    return 0;
+  return facts->first_julian + facts->month_start[month - 1] + day - 1;
+}
+
+/* julian day of the last weekday (1=mon ... 7=sun) in the month */
+static guint32
+pal_event_last_weekday (gint weekday, gint month, gint year)
+{
+  const PalYearFacts *facts = pal_year_facts (year);
+  guint32 last = facts->first_julian + facts->month_start[month] - 1;
+
+  return last - (pal_event_julian_weekday (last) - weekday + 7) % 7;
+}
+
+/* The monthly and yearly event types find the day of an event in
+ * one month (or year) with these, returning PAL_NO_DAY if there is
+ * none.  The steppers below do the rest. */
+typedef guint32 (*PalMonthDayFunc) (guint32 key, gint year, gint month);
+typedef guint32 (*PalYearDayFunc) (guint32 key, gint year);
+
+/* the most years stepped over looking for a day, since the calendar
+ * repeats every 400 years */
+#define PAL_STEP_MAX_YEARS 400
+
+/* Returns the nearest day after julian (or before it if dir < 0)
+ * that day_of gives, starting with the month julian is in */
+static guint32
+pal_event_step_months (PalMonthDayFunc day_of, guint32 key, guint32 julian,
+                       gint dir)
+{
+  PalDate date = pal_date_from_julian (julian);
+  gint year = date.year, month = date.month;
+  gint i;
+
+  for (i = 0; i < PAL_STEP_MAX_YEARS * 12 && year > 0; i++)
+    {
+      guint32 day = day_of (key, year, month);
+
+      if (day != PAL_NO_DAY && (dir > 0 ? day > julian : day < julian))
+        return day;
+
+      month += dir;
+      if (month > 12)
+        month = 1, year++;
+      else if (month < 1)
+        month = 12, year--;
+    }
+
+  return PAL_NO_DAY;
+}
+
+/* Returns the nearest day after julian (or before it if dir < 0)
+ * that day_of gives, starting with the year julian is in */
+static guint32
+pal_event_step_years (PalYearDayFunc day_of, guint32 key, guint32 julian,
+                      gint dir)
+{
+  gint year = pal_date_from_julian (julian).year;
+  gint i;
+
+  for (i = 0; i < PAL_STEP_MAX_YEARS && year > 0; i++, year += dir)
+    {
+      guint32 day = day_of (key, year);
+
+      if (day != PAL_NO_DAY && (dir > 0 ? day > julian : day < julian))
+        return day;
+    }
+
+  return PAL_NO_DAY;
+}
+
+/* Blocks that events, dates and times are carved from.  Bigger
+ * requests get a block of their own. */
+#define PAL_ARENA_BLOCK_SIZE 65536
+
+struct _PalEventArena
+{
+  GStringChunk *strings; /* all the strings of the file's events */
+  GSList *blocks;        /* every block, the current one first */
+  gsize used;            /* bytes used in the current block */
+};
+
+PalEventArena *
+pal_event_arena_new (void)
+{
+  PalEventArena *arena = g_malloc (sizeof (PalEventArena));
+  arena->strings = g_string_chunk_new (PAL_ARENA_BLOCK_SIZE);
+  arena->blocks = NULL;
+  arena->used = PAL_ARENA_BLOCK_SIZE;
+  return arena;
+}
+
+/* frees the arena and everything allocated from it */
+void
+pal_event_arena_free (PalEventArena *arena)
+{
+  if (arena == NULL)
+    return;
+
+  g_string_chunk_free (arena->strings);
+  g_slist_free_full (arena->blocks, g_free);
+  g_free (arena);
+}
+
+static gpointer
+pal_event_arena_alloc (PalEventArena *arena, gsize size)
+{
+  gpointer mem;
+
+  /* keep everything 8 byte aligned */
+  size = (size + 7) & ~(gsize)7;
+
+  if (size > PAL_ARENA_BLOCK_SIZE / 4)
+    {
+      /* add it behind the current block so that one stays in use */
+      mem = g_malloc (size);
+      if (arena->blocks == NULL)
+        arena->blocks = g_slist_prepend (arena->blocks, mem);
+      else
+        arena->blocks->next = g_slist_prepend (arena->blocks->next, mem);
+      return mem;
+    }
+
+  if (arena->used + size > PAL_ARENA_BLOCK_SIZE)
+    {
+      arena->blocks
+          = g_slist_prepend (arena->blocks, g_malloc (PAL_ARENA_BLOCK_SIZE));
+      arena->used = 0;
+    }
+
+  mem = (gchar *)arena->blocks->data + arena->used;
+  arena->used += size;
+  return mem;
+}
+
+/* allocates size bytes that live as long as event */
+gpointer
+pal_event_alloc (const PalEvent *event, gsize size)
+{
+  if (event->cold->arena != NULL)
+    return pal_event_arena_alloc (event->cold->arena, size);
+  return g_malloc (size);
+}
+
+/* copies s into memory that lives as long as event */
+gchar *
+pal_event_strdup (const PalEvent *event, const gchar *s)
+{
+  if (s == NULL)
+    return NULL;
+  if (event->cold->arena != NULL)
+    return g_string_chunk_insert (event->cold->arena->strings, s);
+  return g_strdup (s);
+}
+
+/* copies the n bytes at s, and a '\0', into memory that lives as long
+ * as event */
+gchar *
+pal_event_strndup (const PalEvent *event, const gchar *s, gsize n)
+{
+  if (event->cold->arena != NULL)
+    return g_string_chunk_insert_len (event->cold->arena->strings, s, n);
+  return g_strndup (s, n);
+}
+
+/* like pal_event_strdup, but each distinct string is stored only once
+ * per arena */
+static gchar *
+pal_event_intern (const PalEvent *event, const gchar *s)
+{
+  if (s == NULL)
+    return NULL;
+  if (event->cold->arena != NULL)
+    return g_string_chunk_insert_const (event->cold->arena->strings, s);
+  return g_strdup (s);
+}
+
 PalEvent *
 pal_event_init (void)
 {
   PalEvent *event = g_malloc (sizeof (PalEvent));
+  event->cold = g_malloc (sizeof (PalEventCold));
   event->text = NULL;
-  event->type = NULL;
-  event->start_date = NULL;
-  event->end_date = NULL;
-  event->date_string = NULL;
-  event->start_time = NULL;
-  event->end_time = NULL;
-  event->file_name = NULL;
-  event->key = NULL;
-  event->eventtype = NULL;
+  event->start = 0;
+  event->end = 0;
+  event->hide = FALSE;
+  event->color = -1;
+  event->file_num = 0;
+  event->cold->type = NULL;
+  event->start_day = PAL_NO_DAY;
+  event->end_day = PAL_NO_DAY;
+  event->cold->date_string = NULL;
+  event->start_time = PAL_NO_TIME;
+  event->end_time = PAL_NO_TIME;
+  event->cold->file_name = NULL;
+  event->key = PAL_KEY_NONE;
   event->period_count = 1;
+  event->phase = 0;
+  event->sort_key = 0;
+  event->cold->global = FALSE;
+  event->cold->arena = NULL;
+  event->cold->text_template = NULL;
   return event;
 }
 
+/* Copies orig into arena, or with g_malloc if arena is NULL.  The
+ * type and file name are interned, so all the events copied from one
+ * file's head into its arena share them. */
 PalEvent *
-pal_event_copy (PalEvent *orig)
+pal_event_copy_to (PalEventArena *arena, const PalEvent *orig)
 {
-  PalEvent *new = g_malloc (sizeof (PalEvent));
-  new->text = g_strdup (orig->text);
-  new->start = orig->start;
-  new->end = orig->end;
-  new->hide = orig->hide;
-  new->type = g_strdup (orig->type);
-  new->file_num = orig->file_num;
-  new->file_name = g_strdup (orig->file_name);
-  new->color = orig->color;
+  PalEvent *new;
 
-  if (orig->start_date == NULL)
-    new->start_date = NULL;
-  else
+  if (arena != NULL)
     {
-      new->start_date = g_malloc (sizeof (GDate));
-      memcpy (new->start_date, orig->start_date, sizeof (GDate));
+      new = pal_event_arena_alloc (arena, sizeof (PalEvent));
+      new->cold = pal_event_arena_alloc (arena, sizeof (PalEventCold));
     }
-
-  if (orig->end_date == NULL)
-    new->end_date = NULL;
   else
     {
-      new->end_date = g_malloc (sizeof (GDate));
-      memcpy (new->end_date, orig->end_date, sizeof (GDate));
+      new = g_malloc (sizeof (PalEvent));
+      new->cold = g_malloc (sizeof (PalEventCold));
     }
 
-  if (orig->start_time == NULL)
-    new->start_time = NULL;
-  else
+  new->cold->arena = arena;
+  new->cold->text_template = NULL;
+  new->text = pal_event_strdup (new, orig->text);
+  new->start = orig->start;
+  new->end = orig->end;
+  new->hide = orig->hide;
+  new->file_num = orig->file_num;
+  new->color = orig->color;
+
+  /* strings already in this arena are interned */
+  if (arena != NULL && orig->cold->arena == arena)
     {
-      new->start_time = g_malloc (sizeof (PalTime));
-      memcpy (new->start_time, orig->start_time, sizeof (PalTime));
+      new->cold->type = orig->cold->type;
+      new->cold->file_name = orig->cold->file_name;
     }
-
-  if (orig->end_time == NULL)
-    new->end_time = NULL;
   else
     {
-      new->end_time = g_malloc (sizeof (PalTime));
-      memcpy (new->end_time, orig->end_time, sizeof (PalTime));
+      new->cold->type = pal_event_intern (new, orig->cold->type);
+      new->cold->file_name = pal_event_intern (new, orig->cold->file_name);
     }
 
-  new->date_string = g_strdup (orig->date_string);
-  new->key = g_strdup (orig->key);
-  new->eventtype = orig->eventtype;
+  new->start_day = orig->start_day;
+  new->end_day = orig->end_day;
+  new->start_time = orig->start_time;
+  new->end_time = orig->end_time;
+  new->cold->date_string = pal_event_strdup (new, orig->cold->date_string);
+  new->key = orig->key;
   new->period_count = orig->period_count;
-  new->global = orig->global;
+  new->phase = orig->phase;
+  new->sort_key = orig->sort_key;
+  new->cold->global = orig->cold->global;
   return new;
 }
 
+/* Copies orig, into the same arena if it is in one */
+PalEvent *
+pal_event_copy (PalEvent *orig)
+{
+  return pal_event_copy_to (orig->cold->arena, orig);
+}
+
+/* Frees an event that isn't in an arena.  Events in an arena are
+ * freed with it. */
 void
 pal_event_free (PalEvent *event)
 {
-  if (event == NULL)
+  if (event == NULL || event->cold->arena != NULL)
     return;
 
   if (event->text != NULL)
     g_free (event->text);
 
-  if (event->type != NULL)
-    g_free (event->type);
-
-  if (event->start_date != NULL)
-    g_date_free (event->start_date);
-
-  if (event->end_date != NULL)
-    g_date_free (event->end_date);
+  if (event->cold->type != NULL)
+    g_free (event->cold->type);
 
-  if (event->date_string != NULL)
-    g_free (event->date_string);
+  if (event->cold->date_string != NULL)
+    g_free (event->cold->date_string);
 
-  if (event->start_time != NULL)
-    g_free (event->start_time);
-
-  if (event->end_time != NULL)
-    g_free (event->end_time);
-
-  if (event->file_name != NULL)
-    g_free (event->file_name);
-
-  if (event->key != NULL)
-    g_free (event->key);
+  if (event->cold->file_name != NULL)
+    g_free (event->cold->file_name);
 
+  g_free (event->cold->text_template);
+  g_free (event->cold);
   g_free (event);
 
   event = NULL;
   return;
 }
 
+/* Returns the key of the event as it was written in its file, like
+ * "DAILY" for "DAILY/2:20250101".  The string should be freed. */
+gchar *
+pal_event_key_string (const PalEvent *event)
+{
+  gchar *key;
+  gchar *ptr;
+
+  if (event->cold->date_string == NULL)
+    return NULL;
+
+  key = g_strdup (event->cold->date_string);
+  if ((ptr = strchr (key, ':')) != NULL)
+    *ptr = '\0';
+  if ((ptr = strrchr (key, '/')) != NULL)
+    *ptr = '\0';
+  return key;
+}
+
 static gboolean
 is_valid_todo (const gchar *date_string)
 {
@@ -149,23 +612,45 @@ is_valid_todo (const gchar *date_string)
 }
 
 static gboolean
-get_key_todo (const GDate *date, gchar *buffer)
+get_key_todo (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  GDate *today = g_date_new ();
-  g_date_set_time_t (today, time (NULL));
-  if (g_date_days_between (today, date) != 0)
-    {
-      g_date_free (today);
-      return FALSE;
-    }
+  if (date.julian != query->today.julian)
+    return FALSE;
 
-  g_date_free (today);
   strcpy (buffer, "TODO");
   return TRUE;
 }
 
+static guint32
+pack_key_todo (const gchar *key)
+{
+  (void)key; /* Avoid unused warning */
+  return 0;
+}
+
+static gint
+get_days_todo (const PalQuery *query, guint32 key, gint year, guint32 *days)
+{
+  (void)key; /* Avoid unused warning */
+  if (query->today.year != year)
+    return 0;
+
+  days[0] = query->today.julian;
+  return 1;
+}
+
+static guint32
+step_day_todo (const PalQuery *query, guint32 key, guint32 julian,
+               gint dir)
+{
+  (void)key; /* Avoid unused warning */
+  if (dir > 0 ? query->today.julian > julian : query->today.julian < julian)
+    return query->today.julian;
+  return PAL_NO_DAY;
+}
+
 static gchar *
-get_descr_todo (const GDate *date)
+get_descr_todo (PalDate date)
 {
   (void)date; /* Avoid unused warning */
   return g_strdup ("TODO event");
@@ -180,15 +665,46 @@ is_valid_daily (const gchar *date_string)
 }
 
 static gboolean
-get_key_daily (const GDate *date, gchar *buffer)
+get_key_daily (const PalQuery *query, PalDate date, gchar *buffer)
 {
+  (void)query; /* Avoid unused warning */
   (void)date; /* Avoid unused warning */
   strcpy (buffer, "DAILY");
   return TRUE;
 }
 
+static guint32
+pack_key_daily (const gchar *key)
+{
+  (void)key; /* Avoid unused warning */
+  return 0;
+}
+
+static gint
+get_days_daily (const PalQuery *query, guint32 key, gint year, guint32 *days)
+{
+  const PalYearFacts *facts = pal_year_facts (year);
+  gint n = facts->month_start[12];
+  gint i;
+
+  (void)query; /* Avoid unused warning */
+  (void)key; /* Avoid unused warning */
+  for (i = 0; i < n; i++)
+    days[i] = facts->first_julian + i;
+  return n;
+}
+
+static guint32
+step_day_daily (const PalQuery *query, guint32 key, guint32 julian,
+                gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  (void)key; /* Avoid unused warning */
+  return (dir > 0) ? julian + 1 : julian - 1;
+}
+
 static gchar *
-get_descr_daily (const GDate *date)
+get_descr_daily (PalDate date)
 {
   (void)date; /* Avoid unused warning */
   return g_strdup ("Daily");
@@ -232,20 +748,70 @@ is_valid_yyyymmdd (const gchar *date_string)
 }
 
 static gboolean
-get_key_yyyymmdd (const GDate *date, gchar *buffer)
+get_key_yyyymmdd (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  snprintf (buffer, 12, "%04d%02d%02d", g_date_get_year (date),
-            g_date_get_month (date), g_date_get_day (date));
+  (void)query; /* Avoid unused warning */
+  snprintf (buffer, 12, "%04d%02d%02d", date.year,
+            date.month, date.day);
   return TRUE;
 }
 
+/* packed as year << 9 | month << 5 | day */
+static guint32
+pack_key_yyyymmdd (const gchar *key)
+{
+  guint32 year
+      = pal_event_key_digits (key) * 100 + pal_event_key_digits (key + 2);
+
+  return year << 9 | pal_event_key_digits (key + 4) << 5
+         | pal_event_key_digits (key + 6);
+}
+
+static gint
+get_days_yyyymmdd (const PalQuery *query, guint32 key, gint year,
+                   guint32 *days)
+{
+  gint month = (key >> 5) & 0xF;
+  gint day = key & 0x1F;
+
+  (void)query; /* Avoid unused warning */
+  if ((gint)(key >> 9) != year
+      || !g_date_valid_dmy ((GDateDay)day, (GDateMonth)month, (GDateYear)year))
+    return 0;
+
+  days[0] = pal_event_julian (day, month, year);
+  return 1;
+}
+
+static guint32
+step_day_yyyymmdd (const PalQuery *query, guint32 key, guint32 julian,
+                   gint dir)
+{
+  gint month = (key >> 5) & 0xF;
+  gint day = key & 0x1F;
+  guint32 once;
+
+  (void)query; /* Avoid unused warning */
+  if (!g_date_valid_dmy ((GDateDay)day, (GDateMonth)month,
+                         (GDateYear)(key >> 9)))
+    return PAL_NO_DAY;
+
+  once = pal_event_julian (day, month, key >> 9);
+  if (dir > 0 ? once > julian : once < julian)
+    return once;
+  return PAL_NO_DAY;
+}
+
 static gchar *
-get_descr_yyyymmdd (const GDate *date)
+get_descr_yyyymmdd (PalDate date)
 {
+  GDate gdate;
   char buf[128];
   char *ptr;
+
+  pal_date_to_gdate (date, &gdate);
   ptr = strcpy (buf, "Only on ");
-  g_date_strftime (ptr, 100, settings->date_fmt, date);
+  g_date_strftime (ptr, 100, settings->date_fmt, &gdate);
   return g_strdup (buf);
 }
 
@@ -271,17 +837,70 @@ is_valid_weekly (const gchar *date_string)
 }
 
 static gboolean
-get_key_weekly (const GDate *date, gchar *buffer)
+get_key_weekly (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  strcpy (buffer, day_names[g_date_get_weekday (date)]);
+  (void)query; /* Avoid unused warning */
+  strcpy (buffer, day_names[date.weekday]);
   return TRUE;
 }
 
+/* packed as the weekday, 1(mon) -> 7(sun) */
+static guint32
+pack_key_weekly (const gchar *key)
+{
+  guint32 weekday;
+
+  /* if it isn't one of the first six, it is SUN */
+  for (weekday = 1; weekday < 7; weekday++)
+    if (strcmp (key, day_names[weekday]) == 0)
+      break;
+  return weekday;
+}
+
+static gint
+get_days_weekly (const PalQuery *query, guint32 key, gint year, guint32 *days)
+{
+  const PalYearFacts *facts = pal_year_facts (year);
+  guint32 end = facts->first_julian + facts->month_start[12];
+  guint32 julian;
+  gint n = 0;
+
+  (void)query; /* Avoid unused warning */
+  julian = facts->first_julian + (key - facts->first_weekday[0] + 7) % 7;
+  for (; julian < end; julian += 7)
+    days[n++] = julian;
+  return n;
+}
+
+static guint32
+step_day_weekly (const PalQuery *query, guint32 key, guint32 julian,
+                 gint dir)
+{
+  guint32 back;
+
+  (void)query; /* Avoid unused warning */
+  if (dir > 0)
+    {
+      julian++;
+      return julian + (key - pal_event_julian_weekday (julian) + 7) % 7;
+    }
+
+  if (julian <= 1)
+    return PAL_NO_DAY;
+
+  julian--;
+  back = (pal_event_julian_weekday (julian) - key + 7) % 7;
+  return (julian > back) ? julian - back : PAL_NO_DAY;
+}
+
 static gchar *
-get_descr_weekly (const GDate *date)
+get_descr_weekly (PalDate date)
 {
+  GDate gdate;
   char buf[128];
-  g_date_strftime (buf, 128, "Weekly: Every %A", date);
+
+  pal_date_to_gdate (date, &gdate);
+  g_date_strftime (buf, 128, "Weekly: Every %A", &gdate);
   return g_strdup (buf);
 }
 
@@ -304,17 +923,54 @@ is_valid_000000dd (const gchar *date_string)
 }
 
 static gboolean
-get_key_000000dd (const GDate *date, gchar *buffer)
+get_key_000000dd (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  snprintf (buffer, MAX_KEYLEN, "000000%02d", g_date_get_day (date));
+  (void)query; /* Avoid unused warning */
+  snprintf (buffer, MAX_KEYLEN, "000000%02d", date.day);
   return TRUE;
 }
 
+/* packed as the day */
+static guint32
+pack_key_000000dd (const gchar *key)
+{
+  return pal_event_key_digits (key + 6);
+}
+
+static guint32
+pal_event_day_000000dd (guint32 key, gint year, gint month)
+{
+  if ((gint)key > pal_event_month_days (pal_year_facts (year), month))
+    return PAL_NO_DAY;
+  return pal_event_julian (key, month, year);
+}
+
+static gint
+get_days_000000dd (const PalQuery *query, guint32 key, gint year,
+                   guint32 *days)
+{
+  gint month, n = 0;
+
+  (void)query; /* Avoid unused warning */
+  for (month = 1; month <= 12; month++)
+    if ((days[n] = pal_event_day_000000dd (key, year, month)) != PAL_NO_DAY)
+      n++;
+  return n;
+}
+
+static guint32
+step_day_000000dd (const PalQuery *query, guint32 key, guint32 julian,
+                   gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  return pal_event_step_months (pal_event_day_000000dd, key, julian, dir);
+}
+
 static gchar *
-get_descr_000000dd (const GDate *date)
+get_descr_000000dd (PalDate date)
 {
   char buf[128];
-  snprintf (buf, 128, "Monthly: Day %d of every month", g_date_get_day (date));
+  snprintf (buf, 128, "Monthly: Day %d of every month", date.day);
   return g_strdup (buf);
 }
 
@@ -350,34 +1006,73 @@ is_valid_0000mmdd (const gchar *date_string)
 }
 
 static gboolean
-get_key_0000mmdd (const GDate *date, gchar *buffer)
+get_key_0000mmdd (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  snprintf (buffer, MAX_KEYLEN, "0000%02d%02d", g_date_get_month (date),
-            g_date_get_day (date));
+  (void)query; /* Avoid unused warning */
+  snprintf (buffer, MAX_KEYLEN, "0000%02d%02d", date.month,
+            date.day);
   return TRUE;
 }
 
-static gchar *
-get_descr_0000mmdd (const GDate *date)
+/* packed as month << 5 | day */
+static guint32
+pack_key_0000mmdd (const gchar *key)
 {
-  char buf1[128];
-  char buf2[142];
-  g_date_strftime (buf1, 128, "%B", date);
-  snprintf (buf2, 142, "Annually: %d %s", g_date_get_day (date), buf1);
-  return g_strdup (buf2);
+  return pal_event_key_digits (key + 4) << 5 | pal_event_key_digits (key + 6);
 }
 
-static gboolean
-is_valid_star_00nd (const gchar *date_string)
+static guint32
+pal_event_day_0000mmdd (guint32 key, gint year)
 {
-  gint d[2];
-  if (sscanf (date_string, "*00%1d%1d", &d[0], &d[1])
-      == 2) /* nth weekday of month  */
-    {
-      gint n, weekday;
+  gint month = key >> 5;
+  gint day = key & 0x1F;
 
-      n = d[0];
-      weekday = d[1];
+  if (!g_date_valid_dmy ((GDateDay)day, (GDateMonth)month, (GDateYear)year))
+    return PAL_NO_DAY;
+  return pal_event_julian (day, month, year);
+}
+
+static gint
+get_days_0000mmdd (const PalQuery *query, guint32 key, gint year,
+                   guint32 *days)
+{
+  (void)query; /* Avoid unused warning */
+  days[0] = pal_event_day_0000mmdd (key, year);
+  return (days[0] != PAL_NO_DAY) ? 1 : 0;
+}
+
+static guint32
+step_day_0000mmdd (const PalQuery *query, guint32 key, guint32 julian,
+                   gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  return pal_event_step_years (pal_event_day_0000mmdd, key, julian, dir);
+}
+
+static gchar *
+get_descr_0000mmdd (PalDate date)
+{
+  GDate gdate;
+  char buf1[128];
+  char buf2[142];
+
+  pal_date_to_gdate (date, &gdate);
+  g_date_strftime (buf1, 128, "%B", &gdate);
+  snprintf (buf2, 142, "Annually: %d %s", date.day, buf1);
+  return g_strdup (buf2);
+}
+
+static gboolean
+is_valid_star_00nd (const gchar *date_string)
+{
+  gint d[2];
+  if (sscanf (date_string, "*00%1d%1d", &d[0], &d[1])
+      == 2) /* nth weekday of month  */
+    {
+      gint n, weekday;
+
+      n = d[0];
+      weekday = d[1];
 
       if (weekday > 0 && weekday < 8 && n > 0
           && n < 6) /* no more than 5 weeks in a month */
@@ -391,24 +1086,62 @@ is_valid_star_00nd (const gchar *date_string)
 }
 
 static gboolean
-get_key_star_00nd (const GDate *date, gchar *buffer)
+get_key_star_00nd (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  /* convert weekday to friendly weekday
-     from: 1(mon) -> 7(sun)
-     to:   1(sun) -> 7(sat) */
-  int weekday = (g_date_get_weekday (date) % 7) + 1;
+  int weekday = pal_event_key_weekday (date);
+
+  (void)query; /* Avoid unused warning */
   snprintf (buffer, MAX_KEYLEN, "*00%d%d", get_nth_day (date), weekday);
   return TRUE;
 }
 
+/* packed as n << 3 | weekday, with the weekday as written in the key */
+static guint32
+pack_key_star_00nd (const gchar *key)
+{
+  return g_ascii_digit_value (key[3]) << 3 | g_ascii_digit_value (key[4]);
+}
+
+static guint32
+pal_event_day_star_00nd (guint32 key, gint year, gint month)
+{
+  return pal_event_nth_weekday (key >> 3,
+                                pal_event_weekday_from_key (key & 0x7), month,
+                                year);
+}
+
+static gint
+get_days_star_00nd (const PalQuery *query, guint32 key, gint year,
+                    guint32 *days)
+{
+  gint month, n = 0;
+
+  (void)query; /* Avoid unused warning */
+  for (month = 1; month <= 12; month++)
+    if ((days[n] = pal_event_day_star_00nd (key, year, month)) != PAL_NO_DAY)
+      n++;
+  return n;
+}
+
+static guint32
+step_day_star_00nd (const PalQuery *query, guint32 key, guint32 julian,
+                    gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  return pal_event_step_months (pal_event_day_star_00nd, key, julian, dir);
+}
+
 static gchar *
-get_descr_star_00nd (const GDate *date)
+get_descr_star_00nd (PalDate date)
 {
+  GDate gdate;
   char suffix[16];
   char buf1[128];
   char buf2[172];
+
+  pal_date_to_gdate (date, &gdate);
   pal_add_suffix (get_nth_day (date), suffix, 16);
-  g_date_strftime (buf1, 128, "%A", date);
+  g_date_strftime (buf1, 128, "%A", &gdate);
   snprintf (buf2, 172, "Monthly: The %s %s of every month", suffix, buf1);
   return g_strdup (buf2);
 }
@@ -438,27 +1171,63 @@ is_valid_star_mmnd (const gchar *date_string)
 }
 
 static gboolean
-get_key_star_mmnd (const GDate *date, gchar *buffer)
+get_key_star_mmnd (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  /* convert weekday to friendly weekday
-     from: 1(mon) -> 7(sun)
-     to:   1(sun) -> 7(sat) */
-  int weekday = (g_date_get_weekday (date) % 7) + 1;
-  snprintf (buffer, MAX_KEYLEN, "*%02d%d%d", g_date_get_month (date),
+  int weekday = pal_event_key_weekday (date);
+
+  (void)query; /* Avoid unused warning */
+  snprintf (buffer, MAX_KEYLEN, "*%02d%d%d", date.month,
             get_nth_day (date), weekday);
   return TRUE;
 }
 
+/* packed as month << 6 | n << 3 | weekday, with the weekday as
+ * written in the key */
+static guint32
+pack_key_star_mmnd (const gchar *key)
+{
+  return pal_event_key_digits (key + 1) << 6
+         | g_ascii_digit_value (key[3]) << 3 | g_ascii_digit_value (key[4]);
+}
+
+static guint32
+pal_event_day_star_mmnd (guint32 key, gint year)
+{
+  return pal_event_nth_weekday ((key >> 3) & 0x7,
+                                pal_event_weekday_from_key (key & 0x7),
+                                key >> 6, year);
+}
+
+static gint
+get_days_star_mmnd (const PalQuery *query, guint32 key, gint year,
+                    guint32 *days)
+{
+  (void)query; /* Avoid unused warning */
+  days[0] = pal_event_day_star_mmnd (key, year);
+  return (days[0] != PAL_NO_DAY) ? 1 : 0;
+}
+
+static guint32
+step_day_star_mmnd (const PalQuery *query, guint32 key, guint32 julian,
+                    gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  return pal_event_step_years (pal_event_day_star_mmnd, key, julian, dir);
+}
+
 static gchar *
-get_descr_star_mmnd (const GDate *date)
+get_descr_star_mmnd (PalDate date)
 {
+  GDate gdate;
   char suffix[16];
   char buf1[128];
   char buf2[128];
   char buf3[295];
+
+  pal_date_to_gdate (date, &gdate);
   pal_add_suffix (get_nth_day (date), suffix, 16);
-  g_date_strftime (buf1, 128, "%A", date);
-  g_date_strftime (buf2, 128, "%B", date);
+  g_date_strftime (buf1, 128, "%A", &gdate);
+  g_date_strftime (buf2, 128, "%B", &gdate);
   snprintf (buf3, 295, "Annually: The %s %s of every %s", suffix, buf1, buf2);
   return g_strdup (buf3);
 }
@@ -483,31 +1252,66 @@ is_valid_star_00Ld (const gchar *date_string)
 }
 
 static gboolean
-get_key_star_00Ld (const GDate *date, gchar *buffer)
+get_key_star_00Ld (const PalQuery *query, PalDate date, gchar *buffer)
 {
   int weekday;
 
+  (void)query; /* Avoid unused warning */
   if (!last_weekday_of_month (date))
     return FALSE;
 
-  /* convert weekday to friendly weekday
-     from: 1(mon) -> 7(sun)
-     to:   1(sun) -> 7(sat) */
-  weekday = (g_date_get_weekday (date) % 7) + 1;
+  weekday = pal_event_key_weekday (date);
 
   snprintf (buffer, MAX_KEYLEN, "*00L%d", weekday);
   return TRUE;
 }
 
+/* packed as the weekday as written in the key */
+static guint32
+pack_key_star_00Ld (const gchar *key)
+{
+  return g_ascii_digit_value (key[4]);
+}
+
+static guint32
+pal_event_day_star_00Ld (guint32 key, gint year, gint month)
+{
+  return pal_event_last_weekday (pal_event_weekday_from_key (key), month,
+                                 year);
+}
+
+static gint
+get_days_star_00Ld (const PalQuery *query, guint32 key, gint year,
+                    guint32 *days)
+{
+  gint month;
+
+  (void)query; /* Avoid unused warning */
+  for (month = 1; month <= 12; month++)
+    days[month - 1] = pal_event_day_star_00Ld (key, year, month);
+  return 12;
+}
+
+static guint32
+step_day_star_00Ld (const PalQuery *query, guint32 key, guint32 julian,
+                    gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  return pal_event_step_months (pal_event_day_star_00Ld, key, julian, dir);
+}
+
 static gchar *
-get_descr_star_00Ld (const GDate *date)
+get_descr_star_00Ld (PalDate date)
 {
+  GDate gdate;
   char buf1[128];
   char buf2[161];
+
   if (!last_weekday_of_month (date))
     return NULL;
 
-  g_date_strftime (buf1, 128, "%A", date);
+  pal_date_to_gdate (date, &gdate);
+  g_date_strftime (buf1, 128, "%A", &gdate);
   snprintf (buf2, 161, "Monthly: The last %s of every month", buf1);
   return g_strdup (buf2);
 }
@@ -535,32 +1339,65 @@ is_valid_star_mmLd (const gchar *date_string)
 }
 
 static gboolean
-get_key_star_mmLd (const GDate *date, gchar *buffer)
+get_key_star_mmLd (const PalQuery *query, PalDate date, gchar *buffer)
 {
   int weekday;
 
+  (void)query; /* Avoid unused warning */
   if (!last_weekday_of_month (date))
     return FALSE;
 
-  /* convert weekday to friendly weekday
-     from: 1(mon) -> 7(sun)
-     to:   1(sun) -> 7(sat) */
-  weekday = (g_date_get_weekday (date) % 7) + 1;
-  snprintf (buffer, MAX_KEYLEN, "*%02dL%d", g_date_get_month (date), weekday);
+  weekday = pal_event_key_weekday (date);
+  snprintf (buffer, MAX_KEYLEN, "*%02dL%d", date.month, weekday);
   return TRUE;
 }
 
+/* packed as month << 3 | weekday, with the weekday as written in the
+ * key */
+static guint32
+pack_key_star_mmLd (const gchar *key)
+{
+  return pal_event_key_digits (key + 1) << 3 | g_ascii_digit_value (key[4]);
+}
+
+static guint32
+pal_event_day_star_mmLd (guint32 key, gint year)
+{
+  return pal_event_last_weekday (pal_event_weekday_from_key (key & 0x7),
+                                 key >> 3, year);
+}
+
+static gint
+get_days_star_mmLd (const PalQuery *query, guint32 key, gint year,
+                    guint32 *days)
+{
+  (void)query; /* Avoid unused warning */
+  days[0] = pal_event_day_star_mmLd (key, year);
+  return 1;
+}
+
+static guint32
+step_day_star_mmLd (const PalQuery *query, guint32 key, guint32 julian,
+                    gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  return pal_event_step_years (pal_event_day_star_mmLd, key, julian, dir);
+}
+
 static gchar *
-get_descr_star_mmLd (const GDate *date)
+get_descr_star_mmLd (PalDate date)
 {
+  GDate gdate;
   char buf1[128];
   char buf2[128];
   char buf3[284];
+
   if (!last_weekday_of_month (date))
     return NULL;
 
-  g_date_strftime (buf1, 128, "%A", date);
-  g_date_strftime (buf2, 128, "%B", date);
+  pal_date_to_gdate (date, &gdate);
+  g_date_strftime (buf1, 128, "%A", &gdate);
+  g_date_strftime (buf2, 128, "%B", &gdate);
   snprintf (buf3, 284, "Annually: The last %s of every %s", buf1, buf2);
   return g_strdup (buf3);
 }
@@ -590,105 +1427,263 @@ is_valid_EASTER (const gchar *date_string)
   return FALSE;
 }
 
-/* checks if date_string is a valid date string.  Before calling this
- * function, g_strstrip needs to be called on date_string!  g_ascii_strup
- * should also be called on the date_string. */
-gboolean
-parse_event (PalEvent *event, const gchar *date_string)
+/* Returns the julian day of a one-time (yyyymmdd) event, or
+ * PAL_NO_DAY if it is a recurring event or its date doesn't exist.
+ * The load threads call this, so it doesn't use the year facts. */
+guint32
+pal_event_once_day (const PalEvent *event)
 {
-  gchar **s;
-  gchar *ptr;
+  guint32 data = PAL_KEY_DATA (event->key);
+  gint year = data >> 9;
+  gint month = (data >> 5) & 0xF;
+  gint day = data & 0x1F;
+
+  if (event->key == PAL_KEY_NONE
+      || PAL_EVENT_TYPE (event)->get_days != get_days_yyyymmdd
+      || !g_date_valid_dmy ((GDateDay)day, (GDateMonth)month,
+                            (GDateYear)year))
+    return PAL_NO_DAY;
+
+  return pal_date_from_dmy (day, month, year).julian;
+}
 
-  int count = 1;
-  int i;
+/* the index of each type in PalEventTypes */
+enum
+{
+  PAL_TYPE_TODO,
+  PAL_TYPE_YYYYMMDD,
+  PAL_TYPE_DAILY,
+  PAL_TYPE_WEEKLY,
+  PAL_TYPE_000000DD,
+  PAL_TYPE_STAR_00ND,
+  PAL_TYPE_0000MMDD,
+  PAL_TYPE_STAR_MMND,
+  PAL_TYPE_STAR_00LD,
+  PAL_TYPE_STAR_MMLD,
+  PAL_TYPE_EASTER
+};
 
-  if (date_string[0] == '\0') return FALSE;
+/* Reads the len bytes at s as 8 digits yyyymmdd.  Returns FALSE if
+ * they aren't, or if the month and day can't go together.  Like
+ * is_valid_yyyymmdd, the 29th of February is fine in any year and
+ * the year isn't checked. */
+static gboolean
+pal_event_read_ymd (const gchar *s, gsize len, gint *year, gint *month,
+                    gint *day)
+{
+  gint d[8];
+  gint i;
 
-  s = g_strsplit (date_string, ":", 3);
+  if (len != 8)
+    return FALSE;
 
-  do
-    { /* Loop to break out of for failure so we can clean up */
-      if (s[1] && !is_valid_yyyymmdd (s[1])) /* start date */
-        break;
+  for (i = 0; i < 8; i++)
+    {
+      if (!g_ascii_isdigit (s[i]))
+        return FALSE;
+      d[i] = s[i] - '0';
+    }
 
-      /* Need to check both, if s[1] is NULL, s[2] isn't valid */
-      if (s[1] && s[2] && !is_valid_yyyymmdd (s[2])) /* end date */
-        break;
+  *year = d[0] * 1000 + d[1] * 100 + d[2] * 10 + d[3];
+  *month = d[4] * 10 + d[5];
+  *day = d[6] * 10 + d[7];
 
-      if ((ptr = strrchr (s[0], '/')) != NULL) /* Repeat counter */
-        {
-          if (sscanf (ptr + 1, "%d%*s", &count) != 1
-              || count < 1) /* Invalid count */
-            break;
+  if (*day < 1 || *day > 31 || *month < 1 || *month > 12)
+    return FALSE;
+  if (*month == 2 && *day > 29)
+    return FALSE;
+  if ((*month == 4 || *month == 6 || *month == 9 || *month == 11)
+      && *day > 30)
+    return FALSE;
+  return TRUE;
+}
 
-          *ptr = '\0';
-        }
+/* Reads the start or end date of a date string, the len bytes at s,
+ * into julian.  Returns FALSE if is_valid_yyyymmdd wouldn't take it.
+ * A valid date that doesn't exist (the 29th of February in a year
+ * without one) is PAL_NO_DAY. */
+static gboolean
+pal_event_read_day (const gchar *s, gsize len, guint32 *julian)
+{
+  gint year, month, day;
 
-      for (i = 0; i < PAL_NUM_EVENTTYPES; i++)
-        {
-          if (PalEventTypes[i].valid_string (s[0]))
-            {
-              break;
-            }
-        }
+  if (!pal_event_read_ymd (s, len, &year, &month, &day) || year < 1)
+    return FALSE;
 
-      if (i == PAL_NUM_EVENTTYPES)
-        break; /* Fail */
+  if (g_date_valid_dmy ((GDateDay)day, (GDateMonth)month, (GDateYear)year))
+    *julian = pal_date_from_dmy (day, month, year).julian;
+  else
+    *julian = PAL_NO_DAY;
+  return TRUE;
+}
 
-      /* We now know the string is valid */
+/* Returns the packed key of the len bytes at key, like "20250101" or
+ * "*00L3" without a count or dates after it, or PAL_KEY_NONE if it
+ * isn't one.  This takes the same keys as the first of
+ * PalEventTypes whose valid_string does, and packs them the same as
+ * its pack_key, but it looks at each byte once. */
+static guint32
+pal_event_classify (const gchar *key, gsize len)
+{
+  gint year, month, day, n, weekday;
 
-      if (s[1])
+  switch (key[0])
+    {
+    case '*':
+      /* *mmnd, *mmLd, *00nd or *00Ld */
+      if (len != 5 || !g_ascii_isdigit (key[1]) || !g_ascii_isdigit (key[2])
+          || !g_ascii_isdigit (key[4]))
+        return PAL_KEY_NONE;
+
+      month = pal_event_key_digits (key + 1);
+      weekday = key[4] - '0';
+      if (month > 12 || weekday < 1 || weekday > 7)
+        return PAL_KEY_NONE;
+
+      if (key[3] == 'L')
+        return (month == 0)
+                   ? PAL_KEY (PAL_TYPE_STAR_00LD, weekday)
+                   : PAL_KEY (PAL_TYPE_STAR_MMLD, month << 3 | weekday);
+
+      n = key[3] - '0';
+      if (!g_ascii_isdigit (key[3]) || n < 1 || n > 5)
+        return PAL_KEY_NONE;
+
+      return (month == 0)
+                 ? PAL_KEY (PAL_TYPE_STAR_00ND, n << 3 | weekday)
+                 : PAL_KEY (PAL_TYPE_STAR_MMND,
+                            month << 6 | n << 3 | weekday);
+
+    case 'D':
+      if (len == 5 && strncmp (key, "DAILY", 5) == 0)
+        return PAL_KEY (PAL_TYPE_DAILY, 0);
+      return PAL_KEY_NONE;
+
+    case 'E':
+      if (len < 6 || strncmp (key, "EASTER", 6) != 0)
+        return PAL_KEY_NONE;
+      if (len == 6)
+        return PAL_KEY (PAL_TYPE_EASTER, 0);
+
+      /* EASTER+nnn or EASTER-nnn, always three digits */
+      if (len != 10 || (key[6] != '+' && key[6] != '-')
+          || !g_ascii_isdigit (key[7]) || !g_ascii_isdigit (key[8])
+          || !g_ascii_isdigit (key[9]))
+        return PAL_KEY_NONE;
+      return PAL_KEY (PAL_TYPE_EASTER,
+                      (key[6] == '+' ? 1 << 10 : 1 << 11)
+                          | ((key[7] - '0') * 100
+                             + pal_event_key_digits (key + 8)));
+
+    case 'T':
+      if (len == 4 && strncmp (key, "TODO", 4) == 0)
+        return PAL_KEY (PAL_TYPE_TODO, 0);
+      /* fall through - TUE, THU */
+    case 'M':
+    case 'W':
+    case 'F':
+    case 'S':
+      if (len != 3)
+        return PAL_KEY_NONE;
+      for (weekday = 1; weekday <= 7; weekday++)
+        if (strncmp (key, day_names[weekday], 3) == 0)
+          return PAL_KEY (PAL_TYPE_WEEKLY, weekday);
+      return PAL_KEY_NONE;
+
+    default:
+      /* yyyymmdd, then 0000mmdd and 000000dd with the year 0 */
+      if (!g_ascii_isdigit (key[0]))
+        return PAL_KEY_NONE;
+
+      if (pal_event_read_ymd (key, len, &year, &month, &day))
         {
-          event->start_date = get_date (s[1]);
+          if (year > 0)
+            return PAL_KEY (PAL_TYPE_YYYYMMDD,
+                            (guint32)year << 9 | month << 5 | day);
+          return PAL_KEY (PAL_TYPE_0000MMDD, month << 5 | day);
+        }
 
-          if (s[2])
-            event->end_date = get_date (s[2]);
-          else
-            event->end_date = g_date_new_dmy (1, 1, 3000);
+      /* the month was 00 */
+      if (len == 8 && strncmp (key, "000000", 6) == 0
+          && g_ascii_isdigit (key[6]) && g_ascii_isdigit (key[7]))
+        {
+          day = pal_event_key_digits (key + 6);
+          if (day >= 1 && day <= 31)
+            return PAL_KEY (PAL_TYPE_000000DD, day);
         }
-      event->period_count = count;
-      event->eventtype = &PalEventTypes[i];
-      event->key = g_strdup (s[0]);
-      g_strfreev (s);
-      return TRUE;
+      return PAL_KEY_NONE;
     }
-  while (0);
-
-  g_strfreev (s);
-  return FALSE;
 }
 
-static GDate *
-find_easter (gint year)
+/* Checks if date_string is a valid date string: a key, then maybe
+ * "/count", then maybe ":start" and ":end" dates, and fills in event
+ * from it if it is.  Before calling this function, g_strstrip needs
+ * to be called on date_string!  g_ascii_strup should also be called
+ * on the date_string. */
+gboolean
+parse_event (PalEvent *event, const gchar *date_string)
 {
-  gint a, b, c, d, e, f, g, h, i, k, l, m, p, month, day;
+  const gchar *start, *end = NULL;
+  guint32 key, start_day = PAL_NO_DAY, end_day = PAL_NO_DAY;
+  gsize len, i;
+  gint count = 1;
+
+  start = strchr (date_string, ':');
+  len = (start != NULL) ? (gsize)(start - date_string) : strlen (date_string);
+
+  if (start != NULL)
+    {
+      start++;
+      end = strchr (start, ':');
+      if (!pal_event_read_day (start,
+                               (end != NULL) ? (gsize)(end - start)
+                                             : strlen (start),
+                               &start_day))
+        return FALSE;
+
+      /* anything after the end date makes it invalid */
+      if (end != NULL && !pal_event_read_day (end + 1, strlen (end + 1),
+                                              &end_day))
+        return FALSE;
+      if (end == NULL)
+        end_day = pal_date_from_dmy (1, 1, 3000).julian;
+    }
+
+  /* the repeat count is after the last '/' of the key, and like
+   * sscanf's %d it can be followed by anything */
+  for (i = len; i > 0 && date_string[i - 1] != '/'; i--)
+    ;
+  if (i > 0)
+    {
+      gchar *rest;
+
+      count = (gint)strtol (date_string + i, &rest, 10);
+      if (rest == date_string + i || count < 1)
+        return FALSE;
+      len = i - 1;
+    }
 
-  a = year % 19;
-  b = year / 100;
-  c = year % 100;
-  d = b / 4;
-  e = b % 4;
-  f = (b + 8) / 25;
-  g = (b - f + 1) / 3;
-  h = (19 * a + b - d - g + 15) % 30;
-  i = c / 4;
-  k = c % 4;
-  l = (32 + 2 * e + 2 * i - h - k) % 7;
-  m = (a + 11 * h + 22 * l) / 451;
-  month = (h + l - 7 * m + 114) / 31;
-  p = (h + l - 7 * m + 114) % 31;
-  day = p + 1;
+  key = pal_event_classify (date_string, len);
+  if (key == PAL_KEY_NONE)
+    return FALSE;
 
-  return g_date_new_dmy ((GDateDay)day, (GDateMonth)month, (GDateYear)year);
+  if (start != NULL)
+    {
+      event->start_day = start_day;
+      event->end_day = end_day;
+    }
+  event->period_count = count;
+  event->key = key;
+  return TRUE;
 }
 
 static gboolean
-get_key_EASTER (const GDate *date, gchar *buffer)
+get_key_EASTER (const PalQuery *query, PalDate date, gchar *buffer)
 {
-  GDate *easter = find_easter (g_date_get_year (date));
-  gint diff = g_date_days_between (date, easter);
-  g_date_free (easter);
+  const PalYearFacts *facts = pal_year_facts (date.year);
+  gint diff = facts->easter_julian - date.julian;
 
+  (void)query; /* Avoid unused warning */
   if (diff != 0)
     snprintf (buffer, 18, "EASTER%c%03d", (diff > 0) ? '-' : '+',
               (diff > 0) ? diff : -diff);
@@ -698,13 +1693,62 @@ get_key_EASTER (const GDate *date, gchar *buffer)
   return TRUE;
 }
 
+/* packed as the number of days from easter, with bit 10 set for "+"
+ * and bit 11 set for "-".  "EASTER" is 0. */
+static guint32
+pack_key_EASTER (const gchar *key)
+{
+  if (key[6] == '\0')
+    return 0;
+
+  return (key[6] == '+' ? 1 << 10 : 1 << 11)
+         | (g_ascii_digit_value (key[7]) * 100
+            + pal_event_key_digits (key + 8));
+}
+
+static guint32
+pal_event_day_EASTER (guint32 key, gint year)
+{
+  const PalYearFacts *facts = pal_year_facts (year);
+  gint offset = key & 0x3FF;
+  guint32 julian;
+
+  /* get_key_EASTER never makes "EASTER+000" or "EASTER-000" */
+  if (key != 0 && offset == 0)
+    return PAL_NO_DAY;
+  if (key & 1 << 11)
+    offset = -offset;
+
+  julian = facts->easter_julian + offset;
+  if (julian < facts->first_julian
+      || julian >= facts->first_julian + facts->month_start[12])
+    return PAL_NO_DAY;
+
+  return julian;
+}
+
+static gint
+get_days_EASTER (const PalQuery *query, guint32 key, gint year, guint32 *days)
+{
+  (void)query; /* Avoid unused warning */
+  days[0] = pal_event_day_EASTER (key, year);
+  return (days[0] != PAL_NO_DAY) ? 1 : 0;
+}
+
+static guint32
+step_day_EASTER (const PalQuery *query, guint32 key, guint32 julian,
+                 gint dir)
+{
+  (void)query; /* Avoid unused warning */
+  return pal_event_step_years (pal_event_day_EASTER, key, julian, dir);
+}
+
 static gchar *
-get_descr_EASTER (const GDate *date)
+get_descr_EASTER (PalDate date)
 {
   char buf[128];
-  GDate *easter = find_easter (g_date_get_year (date));
-  gint diff = g_date_days_between (date, easter);
-  g_date_free (easter);
+  const PalYearFacts *facts = pal_year_facts (date.year);
+  gint diff = facts->easter_julian - date.julian;
 
   if (diff != 0)
     snprintf (buf, 128, "%d days %s Easter", (diff > 0) ? diff : -diff,
@@ -719,11 +1763,17 @@ get_descr_EASTER (const GDate *date)
  * should be freed. */
 gchar *
 get_key (const GDate *date)
+{
+  return pal_date_key (pal_date_from_gdate (date));
+}
+
+/* like get_key, for a PalDate */
+gchar *
+pal_date_key (PalDate date)
 {
   gchar *key = g_malloc (sizeof (gchar) * 9);
 
-  snprintf (key, 20, "%04d%02d%02d", g_date_get_year (date),
-            g_date_get_month (date), g_date_get_day (date));
+  snprintf (key, 20, "%04d%02d%02d", date.year, date.month, date.day);
   return key;
 }
 
@@ -745,270 +1795,1338 @@ get_date (const gchar *key)
 }
 
 static gboolean
-last_weekday_of_month (const GDate *date)
+last_weekday_of_month (PalDate date)
 {
-  GDate *local = g_memdup2 (date, sizeof (GDate));
-
-  g_date_add_days (local, 7);
-  if (g_date_get_month (local) != g_date_get_month (date))
-    {
-      g_date_free (local);
-      return TRUE;
-    }
-  g_date_free (local);
+  const PalYearFacts *facts = pal_year_facts (date.year);
 
-  return FALSE;
+  return (facts->last_weekday_days[date.month - 1] >> date.day) & 1;
 }
 
 /* Returns n from date --- as in: "date" is the "n"th
  * sunday/monday/... of the month */
 static gint
-get_nth_day (const GDate *date)
+get_nth_day (PalDate date)
 {
-  int i = (g_date_get_day (date) / 7) + 1;
-  if (g_date_get_day (date) % 7 == 0)
-    i--;
-  return i;
+  return (date.day - 1) / 7 + 1;
 }
 
-/* removes events from the list whose range that are does not include
- * "date".  Also remove recurring events that should be skipped for
- * the given date.
- *
- * Returns the beginning of the new list (it might have changed) */
-static GList *
-inspect_range (GList *list, const GDate *date)
+/* Returns the number of the day, week, month or year (depending on
+ * period) that julian is in, counted from a fixed point.  A period
+ * count is a modulus of these. */
+static gint
+pal_event_period_number (PalPeriodic period, guint32 julian)
 {
-  GList *item = list;
+  PalDate date;
 
-  if (list == NULL)
-    return list;
-
-  while (g_list_length (item) > 0)
+  switch (period)
     {
-      gboolean remove = FALSE;
-      PalEvent *event = (PalEvent *)item->data;
-      if (event->start_date != NULL && event->end_date != NULL)
-        {
+    case PAL_DAILY:
+      return julian;
+    case PAL_WEEKLY:
+      return julian / 7;
+    case PAL_MONTHLY:
+      date = pal_date_from_julian (julian);
+      return date.year * 12 + date.month - 1;
+    case PAL_YEARLY:
+      return pal_date_from_julian (julian).year;
+    default:
+      return 0;
+    }
+}
 
-          if (g_date_days_between (date, event->start_date) > 0
-              || g_date_days_between (date, event->end_date) < 0)
-            remove = TRUE;
-          else if (event->period_count != 1)
-            {
-              int event_count
-                  = 0; /* Number of times event has happened since start */
-
-              switch (event->eventtype->period)
-                {
-                case PAL_ONCEONLY:
-                  event_count = 1;
-                  break;
-                case PAL_DAILY:
-                  event_count = g_date_days_between (event->start_date, date);
-                  break;
-                case PAL_WEEKLY:
-                  event_count
-                      = g_date_days_between (event->start_date, date) / 7;
-                  break;
-                case PAL_MONTHLY:
-                  {
-                    int month_start
-                        = g_date_get_month (event->start_date)
-                          + 12 * g_date_get_year (event->start_date);
-                    int month_cur = g_date_get_month (date)
-                                    + 12 * g_date_get_year (date);
-                    event_count = month_cur - month_start;
-                    break;
-                  }
-                case PAL_YEARLY:
-                  {
-                    event_count = g_date_get_year (date)
-                                  - g_date_get_year (event->start_date);
-                    break;
-                  }
-                }
-              if ((event_count % event->period_count) != 0)
-                remove = TRUE;
-            }
+/* Returns the phase of an event with a start and end date: the
+ * period number of its start modulo its period count.  The weeks of a
+ * weekly event are counted from the first of its weekdays in the
+ * range, it is only ever checked on its weekday and those are a
+ * whole number of weeks apart. */
+static gint
+pal_event_phase (const PalEvent *event)
+{
+  const PalEventType *type = PAL_EVENT_TYPE (event);
+  guint32 first = event->start_day;
 
-          if (remove)
-            {
-              /* if not on last item */
-              if (g_list_length (item) > 1)
-                {
-                  /* save reference to next data item */
-                  gpointer n = g_list_next (item)->data;
-
-                  /* remove this list element */
-                  list = g_list_remove (list, item->data);
-
-                  /* find what we need to look at next */
-                  item = g_list_find (list, n);
-                }
-              else /* we're on last item */
-                {
-                  list = g_list_remove (list, item->data);
-                  item = g_list_last (list);
-                }
-            }
-          else
-            item = g_list_next (item);
-        }
-      else
-        item = g_list_next (item);
-    }
+  if (type->period == PAL_WEEKLY)
+    first = type->step_day (NULL, PAL_KEY_DATA (event->key), first - 1, 1);
 
-  return list;
+  return pal_event_period_number (type->period, first)
+         % event->period_count;
 }
 
-static gint
-pal_event_sort_fn (gconstpointer x, gconstpointer y)
-{
-  PalEvent *a = (PalEvent *)x;
-  PalEvent *b = (PalEvent *)y;
-
-  /* Put events with start times before events without start times */
-  if (a->start_time != NULL && b->start_time == NULL)
-    return 1;
-  if (a->start_time == NULL && b->start_time != NULL)
-    return -1;
-
-  /* if both events have start times, sort by start time */
-  if (a->start_time != NULL && b->start_time != NULL)
-    {
-      if (a->start_time->hour < b->start_time->hour)
-        return -1;
-      if (a->start_time->hour > b->start_time->hour)
-        return 1;
-
-      /* if we get here, the hours are the same */
-      if (a->start_time->min < b->start_time->min)
-        return -1;
-      if (a->start_time->min > b->start_time->min)
-        return 1;
-      return 0;
-    }
+/* checks if an event with a start and end date includes the julian
+ * day in its range.  Also checks if a recurring event should be
+ * skipped on that day because of its period count. */
+static gboolean
+pal_event_in_range (const PalEvent *event, guint32 julian)
+{
+  PalPeriodic period;
 
-  /* if neither event has start times, sort by order in pal.conf */
-  if (a->file_num == b->file_num)
-    return 0;
-  if (a->file_num < b->file_num)
-    return -1;
-  else
-    return 1;
+  if (event->start_day == PAL_NO_DAY || event->end_day == PAL_NO_DAY)
+    return TRUE;
+
+  if (julian < event->start_day || julian > event->end_day)
+    return FALSE;
+
+  if (event->period_count == 1)
+    return TRUE;
+
+  /* a one time event has happened once, so it only occurs when
+   * every occurrence counts */
+  period = PAL_EVENT_TYPE (event)->period;
+  if (period == PAL_ONCEONLY)
+    return FALSE;
+
+  return pal_event_period_number (period, julian) % event->period_count
+         == event->phase;
 }
 
-static GList *
-pal_event_sort_events (GList *events)
+/* Events on a day are listed in the order of this key: events
+ * without a start time first, in the order of their files in
+ * pal.conf, then the others by start time.  That place is the top
+ * half of the key, the bottom half is the number of the event in the
+ * order events were added, which keeps ties in the order they were
+ * loaded in. */
+static guint64
+pal_event_sort_key (const PalEvent *event, guint seq)
 {
-  if (events == NULL)
-    return NULL;
+  guint32 place = (event->start_time == PAL_NO_TIME)
+                      ? (guint32)event->file_num
+                      : (guint32)1 << 31 | event->start_time;
 
-  return g_list_sort (events, pal_event_sort_fn);
+  return (guint64)place << 32 | seq;
 }
 
-/* Returns a list of events on the given date.
-   The returned list is sorted. */
-GList *
-get_events (const GDate *date)
+/* the place on its day of an event with this sort key */
+#define PAL_SORT_PLACE(sort_key) ((sort_key) >> 32)
+
+/* Returns the packed key for a key string like "20250101" or
+ * "*00L3", or PAL_KEY_NONE if it isn't a valid key. */
+guint32
+pal_event_key_pack (const gchar *key)
 {
-  GList *list = NULL;
-  GList *days_events = NULL;
-  gchar eventkey[MAX_KEYLEN];
-  int i;
+  return pal_event_classify (key, strlen (key));
+}
 
-  for (i = 0; i < PAL_NUM_EVENTTYPES; i++)
-    {
-      if (PalEventTypes[i].get_key (date, eventkey) == FALSE)
-        continue;
+static guint
+pal_event_key_hash (guint32 key)
+{
+  key ^= key >> 16;
+  key *= 0x85EBCA6B;
+  key ^= key >> 13;
+  key *= 0xC2B2AE35;
+  key ^= key >> 16;
+  return key;
+}
+
+/* Returns the bucket for key, or the unused bucket where it would go */
+static PalEventBucket *
+pal_event_table_find (const PalEventTable *table, guint32 key)
+{
+  guint mask = table->n_buckets - 1;
+  guint i = pal_event_key_hash (key) & mask;
+
+  while (table->buckets[i].key != key && table->buckets[i].key != PAL_KEY_NONE)
+    i = (i + 1) & mask;
+
+  return &table->buckets[i];
+}
+
+static void
+pal_event_table_alloc (PalEventTable *table, guint n_buckets)
+{
+  guint i;
 
-      days_events = g_hash_table_lookup (ht, eventkey);
+  table->n_buckets = n_buckets;
+  table->buckets = g_malloc0 (sizeof (PalEventBucket) * n_buckets);
+  for (i = 0; i < n_buckets; i++)
+    table->buckets[i].key = PAL_KEY_NONE;
+}
+
+PalEventTable *
+pal_event_table_new (void)
+{
+  PalEventTable *table = g_malloc (sizeof (PalEventTable));
+
+  pal_event_table_alloc (table, 64);
+  table->n_keys = 0;
+  table->type_mask = 0;
+  table->arenas = g_ptr_array_new_with_free_func (
+      (GDestroyNotify)pal_event_arena_free);
+  table->n_loose = 0;
+  table->n_events = 0;
+  table->ranged = NULL;
+  table->n_ranged = 0;
+  table->ranged_size = 0;
+  table->ranged_sorted = TRUE;
+  table->reach_year = NULL;
+  table->reached_year = G_MAXINT;
+  table->load_hidden = NULL;
+  return table;
+}
+
+/* frees the table and all the events in it */
+void
+pal_event_table_free (PalEventTable *table)
+{
+  guint i, j;
+
+  if (table == NULL)
+    return;
+
+  for (i = 0; i < table->n_buckets; i++)
+    {
+      PalEventBucket *bucket = &table->buckets[i];
 
-      if (days_events != NULL)
-        list = g_list_concat (list, g_list_copy (days_events));
+      /* events in arenas go with their arena */
+      for (j = 0; table->n_loose > 0 && j < bucket->n_events; j++)
+        if (bucket->events[j]->cold->arena == NULL)
+          pal_event_free (bucket->events[j]);
+      g_free (bucket->events);
     }
 
-  list = inspect_range (list, date);
-  list = pal_event_sort_events (list);
+  for (j = 0; table->n_loose > 0 && j < table->n_ranged; j++)
+    if (table->ranged[j]->cold->arena == NULL)
+      pal_event_free (table->ranged[j]);
+  g_free (table->ranged);
 
-  return list;
+  g_ptr_array_free (table->arenas, TRUE);
+  g_free (table->buckets);
+  g_free (table);
 }
 
-/* Some places only need to know the number of events on a day. They should
- * use this instead to avoid leaking memory when doing
- * g_list_length(get_events) */
-gint
-pal_get_event_count (GDate *date)
+/* doubles the number of buckets */
+static void
+pal_event_table_grow (PalEventTable *table)
 {
-  GList *events = get_events (date);
-  gint count = g_list_length (events);
-  g_list_free (events);
-  return count;
+  PalEventBucket *old = table->buckets;
+  guint n_old = table->n_buckets;
+  guint i;
+
+  pal_event_table_alloc (table, n_old * 2);
+  for (i = 0; i < n_old; i++)
+    if (old[i].key != PAL_KEY_NONE)
+      *pal_event_table_find (table, old[i].key) = old[i];
+
+  g_free (old);
 }
 
-/* the returned string should be freed */
-gchar *
-pal_event_escape (const PalEvent *event, const GDate *today)
+/* Adds an event with a start and end date to table->ranged */
+static void
+pal_event_table_add_ranged (PalEventTable *table, PalEvent *event)
 {
-  gchar *in = event->text;
-  gchar *out_string = g_malloc (sizeof (gchar) * strlen (event->text) * 2);
-  gchar *out = out_string;
+  event->phase = pal_event_phase (event);
+
+  if (table->n_ranged > 0
+      && event->end_day < table->ranged[table->n_ranged - 1]->end_day)
+    table->ranged_sorted = FALSE;
 
-  while (*in != '\0')
+  if (table->n_ranged == table->ranged_size)
     {
-      if (*in == '!' && strlen (in) > 5 && g_ascii_isdigit (*(in + 1))
-          && g_ascii_isdigit (*(in + 2)) && g_ascii_isdigit (*(in + 3))
-          && g_ascii_isdigit (*(in + 4)) && *(in + 5) == '!')
-        {
-          int diff;
-          int now = g_date_get_year (today);
-          int event = g_ascii_digit_value (*(in + 1));
-          event *= 10;
-          event += g_ascii_digit_value (*(in + 2));
-          event *= 10;
-          event += g_ascii_digit_value (*(in + 3));
-          event *= 10;
-          event += g_ascii_digit_value (*(in + 4));
-          diff = now - event;
-          out += sprintf (out, "%i", diff);
-          in += 6;
-        }
-      else
-        {
-          *out = *in;
-          out++;
-          in++;
-        }
+      table->ranged_size
+          = (table->ranged_size == 0) ? 16 : table->ranged_size * 2;
+      table->ranged = g_realloc (table->ranged,
+                                 sizeof (PalEvent *) * table->ranged_size);
     }
 
-  *out = '\0';
-  return out_string;
+  table->ranged[table->n_ranged++] = event;
+}
+
+/* Adds the event to the end of the bucket for its key, or to the
+ * ranged events if it has a start and end date.  The event belongs
+ * to the table afterwards. */
+void
+pal_event_table_add (PalEventTable *table, PalEvent *event)
+{
+  PalEventBucket *bucket;
+  guint32 key = event->key;
+
+  if (key == PAL_KEY_NONE)
+    {
+      pal_event_free (event);
+      return;
+    }
+
+  if (event->cold->arena == NULL)
+    table->n_loose++;
+
+  table->type_mask |= 1 << PAL_KEY_TYPE (key);
+  event->sort_key = pal_event_sort_key (event, table->n_events++);
+
+  if (event->start_day != PAL_NO_DAY && event->end_day != PAL_NO_DAY)
+    {
+      pal_event_table_add_ranged (table, event);
+      return;
+    }
+
+  /* keep at least half of the buckets unused */
+  if ((table->n_keys + 1) * 2 > table->n_buckets)
+    pal_event_table_grow (table);
+
+  bucket = pal_event_table_find (table, key);
+  if (bucket->key == PAL_KEY_NONE)
+    {
+      bucket->key = key;
+      bucket->sorted = TRUE;
+      table->n_keys++;
+    }
+
+  /* the bucket is sorted before it is used, if this upset its order */
+  if (bucket->n_events > 0
+      && event->sort_key < bucket->events[bucket->n_events - 1]->sort_key)
+    bucket->sorted = FALSE;
+
+  if (bucket->n_events == bucket->size)
+    {
+      bucket->size = (bucket->size == 0) ? 1 : bucket->size * 2;
+      bucket->events
+          = g_realloc (bucket->events, sizeof (PalEvent *) * bucket->size);
+    }
+
+  bucket->events[bucket->n_events++] = event;
+}
+
+/* The table takes over the arena and frees it with the table */
+void
+pal_event_table_add_arena (PalEventTable *table, PalEventArena *arena)
+{
+  g_ptr_array_add (table->arenas, arena);
+}
+
+/* Removes the events in arena from the table and frees the arena
+ * with them.  The events left keep their order. */
+void
+pal_event_table_remove_arena (PalEventTable *table, PalEventArena *arena)
+{
+  guint i, j, n;
+
+  for (i = 0; i < table->n_buckets; i++)
+    {
+      PalEventBucket *bucket = &table->buckets[i];
+
+      for (j = 0, n = 0; j < bucket->n_events; j++)
+        if (bucket->events[j]->cold->arena != arena)
+          bucket->events[n++] = bucket->events[j];
+      bucket->n_events = n;
+    }
+
+  for (j = 0, n = 0; j < table->n_ranged; j++)
+    if (table->ranged[j]->cold->arena != arena)
+      table->ranged[n++] = table->ranged[j];
+  table->n_ranged = n;
+
+  g_ptr_array_remove (table->arenas, arena);
+}
+
+static gint
+pal_event_load_order_cmp (gconstpointer x, gconstpointer y)
+{
+  const PalEvent *a = *(PalEvent *const *)x;
+  const PalEvent *b = *(PalEvent *const *)y;
+  guint32 a_seq = (guint32)a->sort_key;
+  guint32 b_seq = (guint32)b->sort_key;
+
+  if (a->file_num != b->file_num)
+    return (a->file_num < b->file_num) ? -1 : 1;
+  if (a_seq != b_seq)
+    return (a_seq < b_seq) ? -1 : 1;
+  return 0;
+}
+
+/* Numbers the events again as if they had been added one file at a
+ * time, in the order of their file_num.  The events of a file that
+ * was loaded again after pal_event_table_remove_arena are added last,
+ * so this puts them back where they were among the others. */
+void
+pal_event_table_renumber (PalEventTable *table)
+{
+  GPtrArray *events = g_ptr_array_new ();
+  guint i, j;
+
+  for (i = 0; i < table->n_buckets; i++)
+    {
+      PalEventBucket *bucket = &table->buckets[i];
+
+      for (j = 0; j < bucket->n_events; j++)
+        g_ptr_array_add (events, bucket->events[j]);
+      bucket->sorted = (bucket->n_events < 2);
+    }
+
+  for (j = 0; j < table->n_ranged; j++)
+    g_ptr_array_add (events, table->ranged[j]);
+
+  g_ptr_array_sort (events, pal_event_load_order_cmp);
+  for (i = 0; i < events->len; i++)
+    {
+      PalEvent *event = g_ptr_array_index (events, i);
+      event->sort_key = pal_event_sort_key (event, i);
+    }
+
+  table->n_events = events->len;
+  g_ptr_array_free (events, TRUE);
+}
+
+/* Returns the bucket of events without a start and end date for key,
+ * or NULL if there are none */
+const PalEventBucket *
+pal_event_table_lookup (const PalEventTable *table, guint32 key)
+{
+  const PalEventBucket *bucket;
+
+  if (table == NULL || !(table->type_mask & 1 << PAL_KEY_TYPE (key)))
+    return NULL;
+
+  bucket = pal_event_table_find (table, key);
+  return (bucket->key == key) ? bucket : NULL;
+}
+
+static gint
+pal_event_end_day_cmp (gconstpointer x, gconstpointer y, gpointer data)
+{
+  const PalEvent *a = *(PalEvent *const *)x;
+  const PalEvent *b = *(PalEvent *const *)y;
+
+  (void)data; /* Avoid unused warning */
+  if (a->end_day != b->end_day)
+    return (a->end_day < b->end_day) ? -1 : 1;
+  return 0;
+}
+
+/* Returns the index in table->ranged of the first event that ends on
+ * or after julian.  The events before it are over by then. */
+static guint
+pal_event_ranged_from (PalEventTable *table, guint32 julian)
+{
+  guint lo = 0, hi = table->n_ranged;
+
+  if (!table->ranged_sorted)
+    {
+      g_qsort_with_data (table->ranged, table->n_ranged, sizeof (PalEvent *),
+                         pal_event_end_day_cmp, NULL);
+      table->ranged_sorted = TRUE;
+    }
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (table->ranged[mid]->end_day < julian)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* The events occurring in one year, expanded once and stored flat.
+ * The events on the i-th day of the year (i = 0 is January 1st) are
+ * events[day_start[i]] up to (but not including)
+ * events[day_start[i + 1]], already sorted. */
+typedef struct _PalYearIndex
+{
+  guint32 first_julian; /* julian day of January 1st */
+  gint n_days;          /* 365 or 366 */
+  guint *day_start;     /* n_days + 1 offsets into events */
+  PalEvent **events;
+} PalYearIndex;
+
+static GHashTable *pal_event_years = NULL; /* year -> PalYearIndex */
+static gint pal_event_last_year = 0;       /* last year looked up */
+static PalYearIndex *pal_event_last_index = NULL;
+static guint32 pal_event_index_today = PAL_NO_DAY; /* day TODOs are on */
+
+static void
+pal_event_year_index_free (gpointer data)
+{
+  PalYearIndex *index = (PalYearIndex *)data;
+
+  g_free (index->day_start);
+  g_free (index->events);
+  g_free (index);
+}
+
+/* Forget all materialized years.  This must be called whenever the
+ * events in ht change. */
+void
+pal_event_index_clear (void)
+{
+  if (pal_event_years != NULL)
+    {
+      g_hash_table_destroy (pal_event_years);
+      pal_event_years = NULL;
+    }
+  pal_event_last_year = 0;
+  pal_event_last_index = NULL;
+}
+
+/* One occurrence of an event, used while building a year index */
+typedef struct _PalYearEntry
+{
+  guint32 julian; /* day the event occurs on */
+  gint type;      /* index of the event's type in PalEventTypes */
+  PalEvent *event;
+} PalYearEntry;
+
+/* Returns a new query answered as if it were "today".  Free it with
+ * pal_query_free. */
+PalQuery *
+pal_query_new (PalDate today)
+{
+  PalQuery *query = g_malloc (sizeof (PalQuery));
+
+  query->today = today;
+  query->settings = settings;
+  query->scratch = g_array_new (FALSE, FALSE, sizeof (PalYearEntry));
+  return query;
+}
+
+void
+pal_query_free (PalQuery *query)
+{
+  if (query == NULL)
+    return;
+
+  g_array_free (query->scratch, TRUE);
+  g_free (query);
+}
+
+static gint
+pal_event_bucket_cmp (gconstpointer x, gconstpointer y, gpointer data)
+{
+  const PalEvent *a = *(PalEvent *const *)x;
+  const PalEvent *b = *(PalEvent *const *)y;
+
+  (void)data; /* Avoid unused warning */
+  if (a->sort_key != b->sort_key)
+    return (a->sort_key < b->sort_key) ? -1 : 1;
+  return 0;
+}
+
+/* TRUE if event a of type index a_type is listed before event b of
+ * type index b_type on a day they share */
+static gboolean
+pal_event_sort_before (const PalEvent *a, guint a_type, const PalEvent *b,
+                       guint b_type)
+{
+  if (PAL_SORT_PLACE (a->sort_key) != PAL_SORT_PLACE (b->sort_key))
+    return PAL_SORT_PLACE (a->sort_key) < PAL_SORT_PLACE (b->sort_key);
+  if (a_type != b_type)
+    return a_type < b_type;
+  return a->sort_key < b->sort_key;
+}
+
+/* Merges the n entries on one day into out.  The entries come in
+ * sorted runs of one event type each, at most two per type (the
+ * type's bucket for the day and its ranged events), so this is a
+ * merge of the runs.  Ties go to the event type that comes first in
+ * PalEventTypes. */
+static void
+pal_event_merge_day (const PalYearEntry *entries, guint n, PalEvent **out)
+{
+  guint run_end[32]; /* there are fewer than 16 event types */
+  guint head[32];
+  guint k = 0, i, r;
+
+  for (i = 0; i < n; i++)
+    {
+      if (i == 0 || entries[i].type != entries[i - 1].type
+          || entries[i].event->sort_key < entries[i - 1].event->sort_key)
+        head[k++] = i;
+      run_end[k - 1] = i + 1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      guint best = k;
+
+      for (r = 0; r < k; r++)
+        {
+          const PalYearEntry *a, *b;
+
+          if (head[r] == run_end[r])
+            continue;
+          if (best == k)
+            {
+              best = r;
+              continue;
+            }
+
+          a = &entries[head[r]];
+          b = &entries[head[best]];
+          if (pal_event_sort_before (a->event, a->type, b->event, b->type))
+            best = r;
+        }
+
+      out[i] = entries[head[best]++].event;
+    }
+}
+
+static gint
+pal_event_key_order_cmp (gconstpointer x, gconstpointer y, gpointer data)
+{
+  const PalEvent *a = *(PalEvent *const *)x;
+  const PalEvent *b = *(PalEvent *const *)y;
+
+  (void)data; /* Avoid unused warning */
+  if (a->key != b->key)
+    return (a->key < b->key) ? -1 : 1;
+  if (a->sort_key != b->sort_key)
+    return (a->sort_key < b->sort_key) ? -1 : 1;
+  return 0;
+}
+
+/* Appends the days of "year" that the events with a start and end
+ * date occur on to entries.  The events that ended before the year
+ * aren't looked at.  The others are grouped by key, so the days of
+ * each key and their period numbers are worked out once, and kept in
+ * sort_key order within a key. */
+static void
+pal_event_year_index_add_ranged (PalQuery *query, gint year,
+                                 GArray *entries)
+{
+  guint32 first_julian = pal_year_facts (year)->first_julian;
+  guint32 last_julian = first_julian + pal_year_facts (year)->month_start[12]
+                        - 1;
+  guint32 days[366];
+  gint periods[366];
+  PalEvent **live;
+  guint n_live = 0, i, e;
+  gint n = 0;
+
+  i = pal_event_ranged_from (ht, first_julian);
+  live = g_malloc (sizeof (PalEvent *) * (ht->n_ranged - i + 1));
+  for (; i < ht->n_ranged; i++)
+    if (ht->ranged[i]->start_day <= last_julian)
+      live[n_live++] = ht->ranged[i];
+
+  g_qsort_with_data (live, n_live, sizeof (PalEvent *),
+                     pal_event_key_order_cmp, NULL);
+
+  for (e = 0; e < n_live; e++)
+    {
+      PalEvent *event = live[e];
+      const PalEventType *type = PAL_EVENT_TYPE (event);
+      gint j;
+
+      if (e == 0 || event->key != live[e - 1]->key)
+        {
+          n = type->get_days (query, PAL_KEY_DATA (event->key), year, days);
+          for (j = 0; j < n; j++)
+            periods[j] = pal_event_period_number (type->period, days[j]);
+        }
+
+      for (j = 0; j < n; j++)
+        {
+          PalYearEntry entry;
+
+          if (days[j] < event->start_day || days[j] > event->end_day)
+            continue;
+          /* see pal_event_in_range */
+          if (event->period_count != 1
+              && (type->period == PAL_ONCEONLY
+                  || periods[j] % event->period_count != event->phase))
+            continue;
+
+          entry.julian = days[j];
+          entry.type = PAL_KEY_TYPE (event->key);
+          entry.event = event;
+          g_array_append_val (entries, entry);
+        }
+    }
+
+  g_free (live);
+}
+
+/* Expands every event in ht into the days of "year" it occurs on. */
+static PalYearIndex *
+pal_event_year_index_build (PalQuery *query, gint year)
+{
+  PalYearIndex *index = g_malloc (sizeof (PalYearIndex));
+  GArray *entries = query->scratch;
+  PalYearEntry *by_day;
+  guint *next;
+  guint32 days[366];
+  guint i, day;
+
+  index->first_julian = pal_year_facts (year)->first_julian;
+  index->n_days = pal_year_facts (year)->month_start[12];
+
+  for (i = 0; ht != NULL && ht->type_mask != 0 && i < ht->n_buckets; i++)
+    {
+      PalEventBucket *bucket = &ht->buckets[i];
+      gint type = PAL_KEY_TYPE (bucket->key);
+      gint n;
+      guint e;
+
+      if (bucket->key == PAL_KEY_NONE)
+        continue;
+
+      if (!bucket->sorted)
+        {
+          g_qsort_with_data (bucket->events, bucket->n_events,
+                             sizeof (PalEvent *), pal_event_bucket_cmp,
+                             NULL);
+          bucket->sorted = TRUE;
+        }
+
+      n = PalEventTypes[type].get_days (query, PAL_KEY_DATA (bucket->key),
+                                        year, days);
+
+      for (e = 0; e < bucket->n_events; e++)
+        {
+          gint j;
+
+          for (j = 0; j < n; j++)
+            {
+              PalYearEntry entry;
+
+              entry.julian = days[j];
+              entry.type = type;
+              entry.event = bucket->events[e];
+              g_array_append_val (entries, entry);
+            }
+        }
+    }
+
+  if (ht != NULL && ht->n_ranged > 0)
+    pal_event_year_index_add_ranged (query, year, entries);
+
+  /* Counting sort of the entries by day.  It is stable, so each
+   * bucket's entries on a day stay together and in order. */
+  index->day_start = g_malloc0 (sizeof (guint) * (index->n_days + 1));
+  for (i = 0; i < entries->len; i++)
+    index->day_start[g_array_index (entries, PalYearEntry, i).julian
+                     - index->first_julian + 1]++;
+  for (day = 1; day <= (guint)index->n_days; day++)
+    index->day_start[day] += index->day_start[day - 1];
+
+  next = g_memdup2 (index->day_start, sizeof (guint) * index->n_days);
+  by_day = g_malloc (sizeof (PalYearEntry) * entries->len);
+  for (i = 0; i < entries->len; i++)
+    {
+      PalYearEntry *entry = &g_array_index (entries, PalYearEntry, i);
+      by_day[next[entry->julian - index->first_julian]++] = *entry;
+    }
+
+  index->events = g_malloc (sizeof (PalEvent *) * entries->len);
+  for (day = 0; day < (guint)index->n_days; day++)
+    pal_event_merge_day (by_day + index->day_start[day],
+                         index->day_start[day + 1] - index->day_start[day],
+                         index->events + index->day_start[day]);
+
+  g_free (by_day);
+  g_free (next);
+  g_array_set_size (entries, 0);
+  return index;
+}
+
+/* Lets ht add the events it kept back that can occur in year or
+ * later, before they are looked for.  The years already indexed are
+ * after the ones reached before, so they stay as they are. */
+static void
+pal_event_table_reach (PalQuery *query, gint year)
+{
+  if (ht == NULL || ht->reach_year == NULL || year >= ht->reached_year)
+    return;
+
+  ht->reached_year = year;
+  ht->reach_year (query, year);
+}
+
+/* Lets ht add the hidden events it kept back, before events are
+ * looked at for anything but calendar markers.  The years already
+ * indexed are built again with them. */
+static void
+pal_event_table_need_hidden (PalQuery *query)
+{
+  void (*load_hidden) (const PalQuery *query);
+
+  if (ht == NULL || ht->load_hidden == NULL)
+    return;
+
+  load_hidden = ht->load_hidden;
+  ht->load_hidden = NULL;
+  load_hidden (query);
+  pal_event_index_clear ();
+}
+
+/* Returns the index of the given year, building it first if needed */
+static PalYearIndex *
+pal_event_year_index (PalQuery *query, gint year)
+{
+  PalYearIndex *index;
+
+  /* TODO events are placed on the query's today, so the years
+   * already built are stale if they were built for another day.
+   * PalEventTypes[0] is todo. */
+  if (pal_event_years != NULL && pal_event_index_today != query->today.julian
+      && ht != NULL && ht->type_mask & 1 << 0)
+    pal_event_index_clear ();
+
+  if (year == pal_event_last_year && pal_event_last_index != NULL)
+    return pal_event_last_index;
+
+  if (pal_event_years == NULL)
+    {
+      pal_event_years = g_hash_table_new_full (
+          g_direct_hash, g_direct_equal, NULL, pal_event_year_index_free);
+      pal_event_index_today = query->today.julian;
+    }
+
+  index = g_hash_table_lookup (pal_event_years, GINT_TO_POINTER (year));
+  if (index == NULL)
+    {
+      pal_event_table_reach (query, year);
+      index = pal_event_year_index_build (query, year);
+      g_hash_table_insert (pal_event_years, GINT_TO_POINTER (year), index);
+    }
+
+  pal_event_last_year = year;
+  pal_event_last_index = index;
+  return index;
+}
+
+/* Returns the sorted events on the given date as a slice of the year
+ * index.  The returned array belongs to the index and must not be
+ * freed. */
+static PalEvent **
+pal_event_day_slice (PalQuery *query, PalDate date, gint *n)
+{
+  PalYearIndex *index = pal_event_year_index (query, date.year);
+  gint day = date.julian - index->first_julian;
+
+  *n = index->day_start[day + 1] - index->day_start[day];
+  return index->events + index->day_start[day];
+}
+
+/* Returns a list of events on the given date.
+   The returned list is sorted. */
+GList *
+get_events (PalQuery *query, const GDate *date)
+{
+  GList *list = NULL;
+  PalEvent **events;
+  gint n;
+
+  pal_event_table_need_hidden (query);
+  events = pal_event_day_slice (query, pal_date_from_gdate (date), &n);
+  while (n > 0)
+    list = g_list_prepend (list, events[--n]);
+
+  return list;
+}
+
+/* Returns every event occurring from start to end (inclusive) as an
+ * array of PalOccurrence, sorted by date and then in the same order
+ * as get_events.  Free it with g_array_free (array, TRUE). */
+GArray *
+get_events_range (PalQuery *query, PalDate start, PalDate end)
+{
+  GArray *occurrences = g_array_new (FALSE, FALSE, sizeof (PalOccurrence));
+  guint32 julian = start.julian;
+  guint32 last = end.julian;
+
+  pal_event_table_need_hidden (query);
+
+  while (julian <= last)
+    {
+      PalOccurrence occurrence;
+      PalYearIndex *index;
+      guint32 year_end;
+      guint i;
+
+      index = pal_event_year_index (query,
+                                    pal_date_from_julian (julian).year);
+      year_end = MIN (last, index->first_julian + index->n_days - 1);
+
+      for (; julian <= year_end; julian++)
+        {
+          guint first = index->day_start[julian - index->first_julian];
+          guint after = index->day_start[julian - index->first_julian + 1];
+
+          if (first == after)
+            continue;
+
+          occurrence.date = pal_date_from_julian (julian);
+
+          for (i = first; i < after; i++)
+            {
+              occurrence.event = index->events[i];
+              g_array_append_val (occurrences, occurrence);
+            }
+        }
+    }
+
+  return occurrences;
+}
+
+/* Some places only need to know the number of events on a day. They should
+ * use this instead to avoid leaking memory when doing
+ * g_list_length(get_events) */
+gint
+pal_get_event_count (PalQuery *query, GDate *date)
+{
+  return pal_get_day_count (query, pal_date_from_gdate (date));
+}
+
+/* Returns the number of events on date */
+gint
+pal_get_day_count (PalQuery *query, PalDate date)
+{
+  gint count;
+
+  pal_event_table_need_hidden (query);
+  pal_event_day_slice (query, date, &count);
+  return count;
+}
+
+/* Copies up to max of the events on date into events, in the same
+ * order as get_events, starting with the first-th one (0 is the
+ * first event).  Returns the number of events on date in all. */
+gint
+pal_get_day_events (PalQuery *query, PalDate date, gint first,
+                    PalEvent **events, gint max)
+{
+  gint count, i;
+  PalEvent **slice;
+
+  pal_event_table_need_hidden (query);
+  slice = pal_event_day_slice (query, date, &count);
+
+  for (i = 0; i < max && first + i < count; i++)
+    events[i] = slice[first + i];
+
+  return count;
+}
+
+/* Fills in the calendar marker for date from the events on it that
+ * aren't hidden: their start and end characters if they all have
+ * the same ones (otherwise '*'), and their color if they all have
+ * the same one (otherwise -1).  Returns FALSE, leaving marker alone,
+ * if there are no such events.  This is all the calendar needs, so
+ * unlike the others it doesn't make ht load the hidden events. */
+gboolean
+pal_get_day_marker (PalQuery *query, PalDate date, PalMarker *marker)
+{
+  gint count, i;
+  PalEvent **slice = pal_event_day_slice (query, date, &count);
+  gboolean found = FALSE;
+
+  for (i = 0; i < count; i++)
+    {
+      const PalEvent *event = slice[i];
+
+      if (event->hide)
+        continue;
+
+      if (!found)
+        {
+          marker->start = event->start;
+          marker->end = event->end;
+          marker->color = event->color;
+          found = TRUE;
+          continue;
+        }
+
+      if (event->start != marker->start || event->end != marker->end)
+        marker->start = marker->end = '*';
+      if (event->color != marker->color)
+        marker->color = -1;
+    }
+
+  return found;
+}
+
+/* Returns the nearest day after julian (or before it if dir < 0)
+ * that event occurs on, honouring its start and end dates and its
+ * period count, or PAL_NO_DAY if there is none. */
+static guint32
+pal_event_step (const PalQuery *query, const PalEvent *event, guint32 julian,
+                gint dir)
+{
+  const PalEventType *type;
+  guint32 data;
+  guint32 unit = 0; /* days in a period of a daily or weekly event */
+
+  if (event->key == PAL_KEY_NONE)
+    return PAL_NO_DAY;
+
+  type = PAL_EVENT_TYPE (event);
+  data = PAL_KEY_DATA (event->key);
+
+  if (event->start_day == PAL_NO_DAY || event->end_day == PAL_NO_DAY)
+    return type->step_day (query, data, julian, dir);
+
+  /* start looking at the edge of the range */
+  if (dir > 0 && julian < event->start_day)
+    julian = event->start_day - 1;
+  else if (dir < 0 && julian > event->end_day)
+    julian = event->end_day + 1;
+
+  if (type->period == PAL_DAILY)
+    unit = 1;
+  else if (type->period == PAL_WEEKLY)
+    unit = 7;
+
+  for (;;)
+    {
+      julian = type->step_day (query, data, julian, dir);
+      if (julian == PAL_NO_DAY || julian < event->start_day
+          || julian > event->end_day)
+        return PAL_NO_DAY;
+
+      /* daily and weekly events go straight to the next day in their
+       * period, the others are checked one at a time */
+      if (unit != 0 && event->period_count > 1)
+        {
+          guint32 skipped = (julian - event->start_day) / unit
+                            % event->period_count;
+
+          if (skipped != 0)
+            julian = (dir > 0)
+                         ? julian + unit * (event->period_count - skipped)
+                         : julian - unit * skipped;
+
+          if (julian < event->start_day || julian > event->end_day)
+            return PAL_NO_DAY;
+        }
+
+      if (pal_event_in_range (event, julian))
+        return julian;
+    }
+}
+
+/* Returns the first day after "after" that event occurs on, or
+ * PAL_NO_DAY if it doesn't occur again */
+guint32
+pal_event_next_occurrence (const PalQuery *query, const PalEvent *event,
+                           guint32 after)
+{
+  return pal_event_step (query, event, after, 1);
+}
+
+/* Returns the last day before "before" that event occurs on, or
+ * PAL_NO_DAY if it didn't occur before it */
+guint32
+pal_event_prev_occurrence (const PalQuery *query, const PalEvent *event,
+                           guint32 before)
+{
+  return pal_event_step (query, event, before, -1);
+}
+
+/* Returns the nearest day after julian (or before it if dir < 0) with
+ * an event that "match" accepts, or PAL_NO_DAY if there is none.  A
+ * NULL match accepts every event. */
+guint32
+pal_get_next_day (PalQuery *query, guint32 julian, gint dir,
+                  PalEventMatch match, gpointer data)
+{
+  guint32 best = PAL_NO_DAY;
+  guint i, e;
+
+  pal_event_table_need_hidden (query);
+
+  /* looking back, any year can have the nearest day */
+  pal_event_table_reach (query, (dir > 0)
+                                    ? pal_date_from_julian (julian).year
+                                    : 1);
+
+  for (i = 0; ht != NULL && i < ht->n_buckets; i++)
+    {
+      const PalEventBucket *bucket = &ht->buckets[i];
+      guint32 day;
+
+      if (bucket->key == PAL_KEY_NONE)
+        continue;
+
+      /* the events in a bucket share their key, so they share their
+       * days too */
+      for (e = 0; e < bucket->n_events; e++)
+        if (match == NULL || match (bucket->events[e], data))
+          break;
+      if (e == bucket->n_events)
+        continue;
+
+      day = pal_event_step (query, bucket->events[e], julian, dir);
+      if (day != PAL_NO_DAY
+          && (best == PAL_NO_DAY || (dir > 0 ? day < best : day > best)))
+        best = day;
+    }
+
+  /* looking forward, the ranged events that are over are skipped */
+  for (i = (ht != NULL && dir > 0) ? pal_event_ranged_from (ht, julian + 1)
+                                   : 0;
+       ht != NULL && i < ht->n_ranged; i++)
+    {
+      const PalEvent *event = ht->ranged[i];
+      guint32 day;
+
+      if (dir < 0 && event->start_day >= julian)
+        continue;
+      if (match != NULL && !match (event, data))
+        continue;
+
+      day = pal_event_step (query, event, julian, dir);
+      if (day != PAL_NO_DAY
+          && (best == PAL_NO_DAY || (dir > 0 ? day < best : day > best)))
+        best = day;
+    }
+
+  return best;
+}
+
+/* one event waiting in the pal_get_next_events heap */
+typedef struct _PalNextEntry
+{
+  guint32 julian; /* the next day the event occurs on */
+  guint type;     /* index of the event's type in PalEventTypes */
+  const PalEvent *event;
+} PalNextEntry;
+
+/* orders the heap like get_events_range orders its occurrences */
+static gboolean
+pal_next_entry_less (const PalNextEntry *a, const PalNextEntry *b)
+{
+  if (a->julian != b->julian)
+    return a->julian < b->julian;
+  return pal_event_sort_before (a->event, a->type, b->event, b->type);
+}
+
+static void
+pal_next_heap_down (PalNextEntry *heap, guint n, guint i)
+{
+  PalNextEntry entry = heap[i];
+
+  for (;;)
+    {
+      guint child = 2 * i + 1;
+
+      if (child >= n)
+        break;
+      if (child + 1 < n
+          && pal_next_entry_less (&heap[child + 1], &heap[child]))
+        child++;
+      if (!pal_next_entry_less (&heap[child], &entry))
+        break;
+      heap[i] = heap[child];
+      i = child;
+    }
+
+  heap[i] = entry;
+}
+
+/* Returns an array of PalOccurrence with the first n occurrences
+ * after the day "after", in the order get_events_range would list
+ * them.  Each event sits in a heap keyed by its next day and is
+ * stepped forward when it is taken, so the work depends on n and the
+ * number of events rather than on how far away the occurrences are. */
+GArray *
+pal_get_next_events (PalQuery *query, guint32 after, gint n)
+{
+  GArray *occurrences = g_array_new (FALSE, FALSE, sizeof (PalOccurrence));
+  GArray *entries = g_array_new (FALSE, FALSE, sizeof (PalNextEntry));
+  PalNextEntry *heap;
+  guint len, i, e;
+
+  pal_event_table_need_hidden (query);
+  pal_event_table_reach (query, pal_date_from_julian (after).year);
+
+  for (i = 0; ht != NULL && i < ht->n_buckets; i++)
+    {
+      const PalEventBucket *bucket = &ht->buckets[i];
+      guint32 day;
+
+      if (bucket->key == PAL_KEY_NONE || bucket->n_events == 0)
+        continue;
+
+      /* the events in a bucket share their key, so they share their
+       * days too */
+      day = pal_event_next_occurrence (query, bucket->events[0], after);
+      for (e = 0; day != PAL_NO_DAY && e < bucket->n_events; e++)
+        {
+          PalNextEntry entry;
+
+          entry.julian = day;
+          entry.type = PAL_KEY_TYPE (bucket->key);
+          entry.event = bucket->events[e];
+          g_array_append_val (entries, entry);
+        }
+    }
+
+  /* the ranged events that are over by then are skipped */
+  for (i = (ht != NULL) ? pal_event_ranged_from (ht, after + 1) : 0;
+       ht != NULL && i < ht->n_ranged; i++)
+    {
+      PalNextEntry entry;
+
+      entry.event = ht->ranged[i];
+      entry.type = PAL_KEY_TYPE (entry.event->key);
+      entry.julian = pal_event_next_occurrence (query, entry.event, after);
+      if (entry.julian != PAL_NO_DAY)
+        g_array_append_val (entries, entry);
+    }
+
+  heap = (PalNextEntry *)entries->data;
+  len = entries->len;
+  for (i = len / 2; i > 0; i--)
+    pal_next_heap_down (heap, len, i - 1);
+
+  while (len > 0 && (gint)occurrences->len < n)
+    {
+      PalOccurrence occurrence;
+
+      occurrence.date = pal_date_from_julian (heap[0].julian);
+      occurrence.event = (PalEvent *)heap[0].event;
+      g_array_append_val (occurrences, occurrence);
+
+      heap[0].julian = pal_event_next_occurrence (query, heap[0].event,
+                                                  heap[0].julian);
+      if (heap[0].julian == PAL_NO_DAY)
+        heap[0] = heap[--len];
+      if (len > 0)
+        pal_next_heap_down (heap, len, 0);
+    }
+
+  g_array_free (entries, TRUE);
+  return occurrences;
+}
+
+/* TRUE if s starts with !yyyy!, s must have at least 6 bytes */
+static gboolean
+pal_event_is_age (const gchar *s)
+{
+  return s[0] == '!' && g_ascii_isdigit (s[1]) && g_ascii_isdigit (s[2])
+         && g_ascii_isdigit (s[3]) && g_ascii_isdigit (s[4]) && s[5] == '!';
+}
+
+/* Returns the template of the text of event, making it the first
+ * time it is needed.  The !yyyy!s are found from left to right, so
+ * the '!' at the end of one doesn't start another. */
+static const PalEventTemplate *
+pal_event_template (const PalEvent *event)
+{
+  PalEventTemplate *template;
+  const gchar *text = event->text;
+  gsize len, i;
+  guint n = 0;
+
+  if (event->cold->text_template != NULL)
+    return event->cold->text_template;
+
+  len = strlen (text);
+  for (i = 0; i + 5 < len; i++)
+    if (pal_event_is_age (text + i))
+      {
+        n++;
+        i += 5;
+      }
+
+  template = pal_event_alloc (event, sizeof (PalEventTemplate)
+                                         + n * sizeof (template->ages[0]));
+  template->len = len;
+  template->n_ages = 0;
+  for (i = 0; i + 5 < len; i++)
+    if (pal_event_is_age (text + i))
+      {
+        template->ages[template->n_ages].offset = i;
+        template->ages[template->n_ages].year
+            = g_ascii_digit_value (text[i + 1]) * 1000
+              + g_ascii_digit_value (text[i + 2]) * 100
+              + g_ascii_digit_value (text[i + 3]) * 10
+              + g_ascii_digit_value (text[i + 4]);
+        template->n_ages++;
+        i += 5;
+      }
+
+  event->cold->text_template = template;
+  return template;
+}
+
+/* Appends the text of event to out, with each !yyyy! in it replaced
+ * by the number of years from yyyy to the year of today */
+void
+pal_event_escape_to (GString *out, const PalEvent *event, PalDate today)
+{
+  const PalEventTemplate *template = pal_event_template (event);
+  gsize done = 0;
+  guint i;
+
+  for (i = 0; i < template->n_ages; i++)
+    {
+      gint age = today.year - template->ages[i].year;
+      gchar number[16];
+      gchar *p = number + sizeof (number);
+
+      g_string_append_len (out, event->text + done,
+                           template->ages[i].offset - done);
+
+      /* like "%i", written from the last digit back */
+      do
+        *--p = '0' + ABS (age % 10);
+      while ((age /= 10) != 0);
+      if (today.year < template->ages[i].year)
+        *--p = '-';
+      g_string_append_len (out, p, number + sizeof (number) - p);
+
+      done = template->ages[i].offset + 6;
+    }
+  g_string_append_len (out, event->text + done, template->len - done);
+}
+
+/* the returned string should be freed */
+gchar *
+pal_event_escape (const PalEvent *event, PalDate today)
+{
+  GString *out = g_string_sized_new (strlen (event->text) + 8);
+
+  pal_event_escape_to (out, event, today);
+  return g_string_free (out, FALSE);
 }
 
 PalEventType PalEventTypes[] = {
   /* todo */
-  { PAL_ONCEONLY, is_valid_todo, get_key_todo, get_descr_todo },
+  { PAL_ONCEONLY, is_valid_todo, get_key_todo, get_descr_todo,
+    pack_key_todo, get_days_todo,
+    step_day_todo },
   /* single day event */
-  { PAL_ONCEONLY, is_valid_yyyymmdd, get_key_yyyymmdd, get_descr_yyyymmdd },
+  { PAL_ONCEONLY, is_valid_yyyymmdd, get_key_yyyymmdd, get_descr_yyyymmdd,
+    pack_key_yyyymmdd, get_days_yyyymmdd,
+    step_day_yyyymmdd },
   /* daily event */
-  { PAL_DAILY, is_valid_daily, get_key_daily, get_descr_daily },
+  { PAL_DAILY, is_valid_daily, get_key_daily, get_descr_daily,
+    pack_key_daily, get_days_daily,
+    step_day_daily },
   /* weekly event */
-  { PAL_WEEKLY, is_valid_weekly, get_key_weekly, get_descr_weekly },
+  { PAL_WEEKLY, is_valid_weekly, get_key_weekly, get_descr_weekly,
+    pack_key_weekly, get_days_weekly,
+    step_day_weekly },
   /* monthly event */
-  { PAL_MONTHLY, is_valid_000000dd, get_key_000000dd, get_descr_000000dd },
+  { PAL_MONTHLY, is_valid_000000dd, get_key_000000dd, get_descr_000000dd,
+    pack_key_000000dd, get_days_000000dd,
+    step_day_000000dd },
   /* monthly event Nth something-day */
-  { PAL_MONTHLY, is_valid_star_00nd, get_key_star_00nd, get_descr_star_00nd },
+  { PAL_MONTHLY, is_valid_star_00nd, get_key_star_00nd, get_descr_star_00nd,
+    pack_key_star_00nd, get_days_star_00nd,
+    step_day_star_00nd },
   /* yearly event */
-  { PAL_YEARLY, is_valid_0000mmdd, get_key_0000mmdd, get_descr_0000mmdd },
+  { PAL_YEARLY, is_valid_0000mmdd, get_key_0000mmdd, get_descr_0000mmdd,
+    pack_key_0000mmdd, get_days_0000mmdd,
+    step_day_0000mmdd },
   /* yearly event on Nth something-day of a certain month */
-  { PAL_YEARLY, is_valid_star_mmnd, get_key_star_mmnd, get_descr_star_mmnd },
+  { PAL_YEARLY, is_valid_star_mmnd, get_key_star_mmnd, get_descr_star_mmnd,
+    pack_key_star_mmnd, get_days_star_mmnd,
+    step_day_star_mmnd },
   /* monthly event on the last something-day */
-  { PAL_MONTHLY, is_valid_star_00Ld, get_key_star_00Ld, get_descr_star_00Ld },
+  { PAL_MONTHLY, is_valid_star_00Ld, get_key_star_00Ld, get_descr_star_00Ld,
+    pack_key_star_00Ld, get_days_star_00Ld,
+    step_day_star_00Ld },
   /* yearly event on the last something-day */
-  { PAL_YEARLY, is_valid_star_mmLd, get_key_star_mmLd, get_descr_star_mmLd },
+  { PAL_YEARLY, is_valid_star_mmLd, get_key_star_mmLd, get_descr_star_mmLd,
+    pack_key_star_mmLd, get_days_star_mmLd,
+    step_day_star_mmLd },
   /* easter */
-  { PAL_YEARLY, is_valid_EASTER, get_key_EASTER, get_descr_EASTER }
+  { PAL_YEARLY, is_valid_EASTER, get_key_EASTER, get_descr_EASTER,
+    pack_key_EASTER, get_days_EASTER,
+    step_day_EASTER }
 };
 
 const gint PAL_NUM_EVENTTYPES
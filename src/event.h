@@ -23,10 +23,72 @@
 
 #include "main.h"
 
+/* one event on one date, as returned by get_events_range */
+typedef struct _PalOccurrence
+{
+  PalDate date;
+  PalEvent *event;
+} PalOccurrence;
+
+PalQuery *pal_query_new (PalDate today);
+void pal_query_free (PalQuery *query);
+
+/* how a day with events is marked in the calendar */
+typedef struct _PalMarker
+{
+  gunichar start;
+  gunichar end;
+  gint color; /* -1 for the default color */
+} PalMarker;
+
+/* returns TRUE for the events wanted by pal_get_next_day */
+typedef gboolean (*PalEventMatch) (const PalEvent *event, gpointer data);
+
 /* returns a list of events on the givent date */
-GList *get_events (const GDate *date);
+GList *get_events (PalQuery *query, const GDate *date);
+/* returns an array of PalOccurrence for the dates from start to end,
+ * sorted by date */
+GArray *get_events_range (PalQuery *query, PalDate start, PalDate end);
 /* Return just the count */
-gint pal_get_event_count (GDate *date);
+gint pal_get_event_count (PalQuery *query, GDate *date);
+/* these look at the events on one date without allocating anything */
+gint pal_get_day_count (PalQuery *query, PalDate date);
+gint pal_get_day_events (PalQuery *query, PalDate date, gint first,
+                         PalEvent **events, gint max);
+gboolean pal_get_day_marker (PalQuery *query, PalDate date,
+                             PalMarker *marker);
+/* the nearest day after julian (before it if dir < 0) with events */
+guint32 pal_get_next_day (PalQuery *query, guint32 julian, gint dir,
+                          PalEventMatch match, gpointer data);
+/* the first n occurrences after the day "after", as PalOccurrence */
+GArray *pal_get_next_events (PalQuery *query, guint32 after, gint n);
+/* forget the cached per-year occurrences, call after changing ht */
+void pal_event_index_clear (void);
+
+PalDate pal_date_from_julian (guint32 julian);
+PalDate pal_date_from_dmy (gint day, gint month, gint year);
+PalDate pal_date_from_gdate (const GDate *date);
+void pal_date_to_gdate (PalDate date, GDate *gdate);
+PalDate pal_date_today (void);
+PalDate pal_date_add_days (PalDate date, gint n);
+gchar *pal_date_key (PalDate date);
+
+PalEventTable *pal_event_table_new (void);
+void pal_event_table_free (PalEventTable *table);
+void pal_event_table_add (PalEventTable *table, PalEvent *event);
+void pal_event_table_add_arena (PalEventTable *table, PalEventArena *arena);
+void pal_event_table_remove_arena (PalEventTable *table,
+                                   PalEventArena *arena);
+void pal_event_table_renumber (PalEventTable *table);
+const PalEventBucket *pal_event_table_lookup (const PalEventTable *table,
+                                              guint32 key);
+guint32 pal_event_key_pack (const gchar *key);
+
+PalEventArena *pal_event_arena_new (void);
+void pal_event_arena_free (PalEventArena *arena);
+gpointer pal_event_alloc (const PalEvent *event, gsize size);
+gchar *pal_event_strdup (const PalEvent *event, const gchar *s);
+gchar *pal_event_strndup (const PalEvent *event, const gchar *s, gsize n);
 
 PalEvent *pal_event_init (void);
 void pal_event_free (PalEvent *event);
@@ -35,6 +97,15 @@ gboolean parse_event (PalEvent *event, const gchar *date_string);
 gchar *get_key (const GDate *date);
 GDate *get_date (const gchar *key);
 gchar *pal_event_date_string_to_key (const gchar *date_string);
+gchar *pal_event_key_string (const PalEvent *event);
+guint32 pal_event_once_day (const PalEvent *event);
+guint32 pal_event_next_occurrence (const PalQuery *query,
+                                   const PalEvent *event, guint32 after);
+guint32 pal_event_prev_occurrence (const PalQuery *query,
+                                   const PalEvent *event, guint32 before);
 PalEvent *pal_event_copy (PalEvent *orig);
-gchar *pal_event_escape (const PalEvent *event, const GDate *today);
+PalEvent *pal_event_copy_to (PalEventArena *arena, const PalEvent *orig);
+gchar *pal_event_escape (const PalEvent *event, PalDate today);
+void pal_event_escape_to (GString *out, const PalEvent *event,
+                          PalDate today);
 #endif
@@ -18,6 +18,7 @@
  *
  */
 
+#include <string.h>
 #include <time.h>
 
 #include "colorize.h"
@@ -49,13 +50,18 @@ pal_html_escape_print (gchar *s)
 
 /* finishes with date on the first day of the next month */
 static void
-pal_html_month (GDate *date, gboolean force_month_label, const GDate *today)
+pal_html_month (PalQuery *query, GDate *date, gboolean force_month_label,
+                const GDate *today)
 {
   gint orig_month = g_date_get_month (date);
   int i;
   gchar buf[1024] = "";
   gchar start[64] = "<td class='pal-dayname' align='center'>";
   gchar end[64] = "</td>";
+  PalDate month_start;
+  GArray *occurrences;
+  guint next = 0;
+  GString *event_text = g_string_new (NULL); /* reused for each event */
 
   fputs ("<table class='pal-cal' cellspacing='0' cellpadding='1'>\n", stdout);
 
@@ -107,14 +113,17 @@ pal_html_month (GDate *date, gboolean force_month_label, const GDate *today)
         }
     }
 
+  month_start = pal_date_from_gdate (date);
+  occurrences = get_events_range (
+      query, month_start,
+      pal_date_add_days (month_start,
+                         g_date_get_days_in_month (g_date_get_month (date),
+                                                   g_date_get_year (date))
+                             - 1));
+
   while (g_date_get_month (date) == orig_month)
     {
 
-      GList *events = get_events (date);
-      gint num_events = g_list_length (events);
-      gint num_events_printed = 0;
-      GList *item = NULL;
-
       if ((settings->week_start_monday && g_date_get_weekday (date) == 1)
           || (!settings->week_start_monday && g_date_get_weekday (date) == 7))
         fputs ("<tr>\n", stdout);
@@ -160,22 +169,24 @@ pal_html_month (GDate *date, gboolean force_month_label, const GDate *today)
             }
         }
 
-      item = g_list_first (events);
-
-      /* while there are more events to be displayed */
-      while (num_events > num_events_printed)
+      /* while there are more events to be displayed on this day */
+      while (next < occurrences->len
+             && g_array_index (occurrences, PalOccurrence, next).date.julian
+                    == g_date_get_julian (date))
         {
-          gchar *event_text
-              = pal_event_escape ((PalEvent *)(item->data), date);
+          PalOccurrence *occurrence
+              = &g_array_index (occurrences, PalOccurrence, next);
+          PalEvent *event = occurrence->event;
+
+          g_string_truncate (event_text, 0);
+          pal_event_escape_to (event_text, event, occurrence->date);
           g_print ("<span class='pal-event-%s'>\n",
-                   string_color_of (((PalEvent *)(item->data))->color));
+                   string_color_of (event->color));
           fputs ("<b>*</b> ", stdout);
-          pal_html_escape_print (event_text);
+          pal_html_escape_print (event_text->str);
           fputs ("<br />\n", stdout);
           fputs ("</span>\n", stdout);
-          num_events_printed++;
-          item = g_list_next (item);
-          g_free (event_text);
+          next++;
         }
 
       g_print ("</td>\n");
@@ -185,9 +196,11 @@ pal_html_month (GDate *date, gboolean force_month_label, const GDate *today)
         fputs ("</tr>\n", stdout);
 
       g_date_add_days (date, 1);
-      g_list_free (events);
     }
 
+  g_array_free (occurrences, TRUE);
+  g_string_free (event_text, TRUE);
+
   /* we are on the first day of the next month, go back to the last
    * day */
   g_date_subtract_days (date, 1);
@@ -216,7 +229,7 @@ pal_html_month (GDate *date, gboolean force_month_label, const GDate *today)
 }
 
 void
-pal_html_out (void)
+pal_html_out (PalQuery *query)
 {
   gint on_month = 0;
   GDate *today = g_date_new ();
@@ -224,8 +237,8 @@ pal_html_out (void)
 
   if (settings->query_date == NULL)
     {
-      g_date_set_time_t (today, time (NULL));
-      g_date_set_time_t (date, time (NULL));
+      pal_date_to_gdate (query->today, today);
+      pal_date_to_gdate (query->today, date);
     }
   else
     {
@@ -243,7 +256,7 @@ pal_html_out (void)
   g_print ("%s %s %s", "<!-- Generated with pal", PAL_VERSION, "-->\n");
 
   for (on_month = 0; on_month < settings->cal_lines; on_month++)
-    pal_html_month (date, TRUE, today);
+    pal_html_month (query, date, TRUE, today);
 
   g_print ("<div class='pal-tagline'><p><i>%s</i></p></div>\n",
            "Calendar created with <a "
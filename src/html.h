@@ -21,6 +21,6 @@
  *
  */
 
-void pal_html_out (void);
+void pal_html_out (PalQuery *query);
 
 #endif
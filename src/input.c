@@ -18,12 +18,26 @@
  *
  */
 
+#include <errno.h>
+#include <stdarg.h>
 #include <string.h>
 #include <time.h>
 
-/* mkdir */
+/* mkdir, stat and truncate */
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+/* watching the files for changes */
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+/* scanning event text a block at a time */
+#include <immintrin.h>
+#endif
 
 #include "event.h"
 #include "input.h"
@@ -31,67 +45,58 @@
 #include "output.h"
 
 static gboolean pal_input_file_is_global (const gchar *filename);
+static void pal_input_error (const PalInputFile *in, const gchar *format,
+                             ...) G_GNUC_PRINTF (2, 3);
+static void pal_input_note (const PalInputFile *in, const gchar *format,
+                            ...) G_GNUC_PRINTF (2, 3);
+static void pal_input_conf_error (const gchar *format, ...)
+    G_GNUC_PRINTF (1, 2);
+static void pal_input_conf_note (const gchar *format, ...)
+    G_GNUC_PRINTF (1, 2);
 
 /* checks if events in the format yyyymmdd can be expunged */
 static gboolean
-should_be_expunged (const PalEvent *pal_event)
+should_be_expunged (const PalQuery *query, const PalEvent *pal_event)
 {
-  GDate *today = NULL;
-  GDate *event_day = NULL;
+  gint expunge = query->settings->expunge;
+  guint32 today = query->today.julian;
+  guint32 event_day;
 
-  if (settings->expunge < 1)
+  if (expunge < 1)
     return FALSE;
 
-  today = g_date_new ();
-  event_day = get_date (pal_event->date_string);
-  g_date_set_time_t (today, time (NULL));
+  event_day = pal_event_once_day (pal_event);
 
   /* if not a yyyymmdd (ie, not recurring) */
-  if (event_day == NULL)
+  if (event_day == PAL_NO_DAY)
     {
       /* recurring event with end_date */
-      if (pal_event->end_date != NULL
-          && g_date_days_between (today, pal_event->end_date)
-                 <= -1 * settings->expunge)
-        {
-          g_date_free (today);
-          return TRUE;
-        }
-
-      g_date_free (today);
-      return FALSE;
+      return pal_event->end_day != PAL_NO_DAY
+             && (gint)pal_event->end_day - (gint)today <= -1 * expunge;
     }
 
   /* if it is a yyyymmdd event (ie one-time event) */
-  if (g_date_days_between (today, event_day) <= -1 * settings->expunge)
-    {
-      g_date_free (today);
-      g_date_free (event_day);
-      return TRUE;
-    }
-
-  g_date_free (today);
-  g_date_free (event_day);
-  return FALSE;
+  return (gint)event_day - (gint)today <= -1 * expunge;
 }
 
 /* Returns the n'th time of the format h:mm or hh:mm that occurs in
- * the string s.  Returns NULL if no time exists in the string */
-static PalTime *
+ * the string s, in minutes since midnight.  Returns PAL_NO_TIME if
+ * no time exists in the string */
+static gint16
 pal_input_get_time (gchar *s, gint n)
 {
   gchar *s_start = s;
   gchar *h1, *h2, *m1, *m2;
 
   if (n < 1 || s == NULL)
-    return NULL;
+    return PAL_NO_TIME;
 
   while (1)
     {
       s = g_utf8_find_next_char (s, NULL);
 
       if (*s == '\0')
-        return NULL;
+        return PAL_NO_TIME;
 
       if (*s == ':')
         {
@@ -102,7 +107,7 @@ pal_input_get_time (gchar *s, gint n)
           /* get the minutes digits */
           m2 = g_utf8_find_next_char (s, NULL);
           if (*m2 == '\0')
-            return NULL; /* hit end of line, done */
+            return PAL_NO_TIME; /* hit end of line, done */
           m1 = g_utf8_find_next_char (m2, NULL);
 
           /* check for digits surrounding the : */
@@ -126,12 +131,7 @@ pal_input_get_time (gchar *s, gint n)
                   /* we just found a VALID date, if it is the nth
                    * one, return it */
                   if (n == 1)
-                    {
-                      PalTime *time = g_malloc (sizeof (PalTime));
-                      time->hour = hour;
-                      time->min = min;
-                      return time;
-                    }
+                    return hour * 60 + min;
                   else
                     n--;
                 }
@@ -140,307 +140,1519 @@ pal_input_get_time (gchar *s, gint n)
     }
 }
 
-/* reads file stream until a non-commented, non-emtpy line is
- * encountered */
-void
-pal_input_skip_comments (FILE *file, FILE *out_file)
+/* If the ':' at text[p] is between the digits of a h:mm or hh:mm
+ * time that pal_input_get_time would accept, returns the time in
+ * minutes since midnight, otherwise PAL_NO_TIME.  text is len bytes
+ * of UTF-8, so a byte that is an ASCII digit is a whole character. */
+static gint16
+pal_input_time_at (const gchar *text, gsize len, gsize p)
 {
-  long start_of_line;
-  gchar s[2048];
+  gint hour, min;
+
+  /* pal_input_get_time starts looking after the first character */
+  if (p == 0 || p + 2 >= len || !g_ascii_isdigit (text[p - 1])
+      || !g_ascii_isdigit (text[p + 1]) || !g_ascii_isdigit (text[p + 2]))
+    return PAL_NO_TIME;
+
+  hour = g_ascii_digit_value (text[p - 1]);
+  if (p >= 2 && g_ascii_isdigit (text[p - 2]))
+    hour += 10 * g_ascii_digit_value (text[p - 2]);
+  min = 10 * g_ascii_digit_value (text[p + 1])
+        + g_ascii_digit_value (text[p + 2]);
+
+  if (min < 60 && hour < 24)
+    return hour * 60 + min;
+  return PAL_NO_TIME;
+}
 
-  do
+/* Number of bytes pal_input_scan_block looks at */
+#if defined(__AVX2__)
+#define PAL_INPUT_BLOCK 32
+#elif defined(__SSE2__)
+#define PAL_INPUT_BLOCK 16
+#else
+#define PAL_INPUT_BLOCK 8
+#endif
+
+/* Sets bit i of *colons if s[i] is ':' and of *other if s[i] is NUL or
+ * not ASCII, for the PAL_INPUT_BLOCK bytes at s */
+static inline void
+pal_input_scan_block (const gchar *s, guint32 *colons, guint32 *other)
+{
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256 ((const __m256i *)s);
+
+  *colons = (guint32)_mm256_movemask_epi8 (
+      _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (':')));
+  *other = (guint32)_mm256_movemask_epi8 (
+      _mm256_or_si256 (v, _mm256_cmpeq_epi8 (v, _mm256_setzero_si256 ())));
+#elif defined(__SSE2__)
+  __m128i v = _mm_loadu_si128 ((const __m128i *)s);
+
+  *colons = (guint32)_mm_movemask_epi8 (
+      _mm_cmpeq_epi8 (v, _mm_set1_epi8 (':')));
+  *other = (guint32)_mm_movemask_epi8 (
+      _mm_or_si128 (v, _mm_cmpeq_epi8 (v, _mm_setzero_si128 ())));
+#else
+  gint i;
+
+  *colons = 0;
+  *other = 0;
+  for (i = 0; i < PAL_INPUT_BLOCK; i++)
     {
-      gchar *orig_string = NULL;
+      guchar c = (guchar)s[i];
 
-      start_of_line = ftell (file);
-      if (fgets (s, 2048, file) == NULL)
-        return;
+      *colons |= (guint32)(c == ':') << i;
+      *other |= (guint32)(c == '\0' || c >= 0x80) << i;
+    }
+#endif
+}
 
-      orig_string = g_strdup (s);
-      g_strstrip (s);
+/* Checks that the len bytes at text are UTF-8, like g_utf8_validate,
+ * and if they are, fills in the first and second time in them, like
+ * pal_input_get_time with n = 1 and 2 would on a copy of the text.
+ * The text is looked at a block at a time for ':'s and for the bytes
+ * g_utf8_validate has to look at more closely.  Text that is all
+ * ASCII, as most event text is, is only looked at once.  Returns
+ * FALSE, leaving the times alone, if the text isn't UTF-8. */
+static gboolean
+pal_input_scan_text (const gchar *text, gsize len, gint16 *start_time,
+                     gint16 *end_time)
+{
+  gint16 times[2] = { PAL_NO_TIME, PAL_NO_TIME };
+  gint n_times = 0;
+  gboolean checked = FALSE; /* TRUE once the text is known to be UTF-8 */
+  gsize i = 0;
+
+  while (i < len)
+    {
+      guint32 colons, other;
+      gsize n = MIN (len - i, PAL_INPUT_BLOCK);
+      gsize j;
+
+      if (n == PAL_INPUT_BLOCK)
+        pal_input_scan_block (text + i, &colons, &other);
+      else
+        {
+          /* the end of the text, the block would read past it */
+          gchar tail[PAL_INPUT_BLOCK];
+
+          memset (tail, 'x', sizeof (tail));
+          memcpy (tail, text + i, n);
+          pal_input_scan_block (tail, &colons, &other);
+        }
+
+      /* everything before text + i is ASCII, so if the rest is UTF-8,
+       * so is all of it */
+      if (other != 0 && !checked)
+        {
+          if (!g_utf8_validate (text + i, len - i, NULL))
+            return FALSE;
+          checked = TRUE;
+        }
 
-      /* write the line out only if we aren't going to seek back later */
-      if (out_file != NULL && (*s == '#' || *s == '\0'))
-        fputs (orig_string, out_file);
+      for (j = i; colons != 0 && n_times < 2; j++, colons >>= 1)
+        if (colons & 1)
+          {
+            gint16 time = pal_input_time_at (text, len, j);
 
-      g_free (orig_string);
+            if (time != PAL_NO_TIME)
+              times[n_times++] = time;
+          }
+
+      if (n_times == 2 && checked)
+        break;
+      i += n;
     }
-  while (*s == '#' || *s == '\0');
 
-  /* now we are on the next non-comment, non-emtpy line. */
-  /* jump back in stream so the next line read is not a comment */
-  fseek (file, start_of_line, SEEK_SET);
+  *start_time = times[0];
+  *end_time = times[1];
+  return TRUE;
+}
+
+/* Prints a message, with pal_output_error if kind is 'E' and
+ * g_printerr otherwise.  If messages isn't NULL, the message is kept
+ * in it instead, to be printed later by pal_input_print_messages. */
+static void
+pal_input_vmessage (GPtrArray *messages, gchar kind, const gchar *format,
+                    va_list args)
+{
+  gchar *text = g_strdup_vprintf (format, args);
+
+  if (messages != NULL)
+    g_ptr_array_add (messages, g_strdup_printf ("%c%s", kind, text));
+  else if (kind == 'E')
+    pal_output_error ("%s", text);
+  else
+    g_printerr ("%s", text);
+
+  g_free (text);
+}
+
+/* prints the messages kept by pal_input_vmessage, in order */
+static void
+pal_input_print_messages (GPtrArray *messages)
+{
+  guint i;
+
+  for (i = 0; i < messages->len; i++)
+    {
+      const gchar *message = g_ptr_array_index (messages, i);
+
+      if (message[0] == 'E')
+        pal_output_error ("%s", message + 1);
+      else
+        g_printerr ("%s", message + 1);
+    }
+}
+
+/* an error from reading in, see PalInputFile's messages */
+static void
+pal_input_error (const PalInputFile *in, const gchar *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  pal_input_vmessage (in->messages, 'E', format, args);
+  va_end (args);
+}
+
+/* a message for -v from reading in */
+static void
+pal_input_note (const PalInputFile *in, const gchar *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  pal_input_vmessage (in->messages, 'N', format, args);
+  va_end (args);
+}
+
+/* Opens a .pal file for reading with pal_input_skip_comments,
+ * pal_input_read_head and pal_input_read_event.  The file is mapped
+ * into memory and read in place.  Returns NULL if it can't be read.
+ * Free the result with pal_input_close. */
+PalInputFile *
+pal_input_open (const gchar *filename)
+{
+  GMappedFile *map = g_mapped_file_new (filename, FALSE, NULL);
+  PalInputFile *in;
+
+  if (map == NULL)
+    return NULL;
+
+  in = g_malloc (sizeof (PalInputFile));
+  in->filename = g_strdup (filename);
+  in->map = map;
+  in->data = g_mapped_file_get_contents (map);
+  in->length = g_mapped_file_get_length (map);
+  in->pos = 0;
+  in->messages = NULL;
+  return in;
+}
+
+void
+pal_input_close (PalInputFile *in)
+{
+  if (in == NULL)
+    return;
+
+  g_mapped_file_unref (in->map);
+  g_free (in->filename);
+  g_free (in);
+}
+
+/* Points line at the next line of in, without reading past it, and
+ * sets len to its length (counting its '\n' if it has one).  Returns
+ * FALSE at the end of the file. */
+static gboolean
+pal_input_peek_line (const PalInputFile *in, const gchar **line, gsize *len)
+{
+  const gchar *newline;
+
+  if (in->pos >= in->length)
+    return FALSE;
+
+  *line = in->data + in->pos;
+  newline = memchr (*line, '\n', in->length - in->pos);
+  if (newline != NULL)
+    *len = newline - *line + 1;
+  else
+    *len = in->length - in->pos;
+
+  return TRUE;
+}
+
+/* trims white space from both ends of the len bytes at s, like
+ * g_strstrip does to a string */
+static void
+pal_input_strip (const gchar **s, gsize *len)
+{
+  while (*len > 0 && g_ascii_isspace (**s))
+    {
+      (*s)++;
+      (*len)--;
+    }
+
+  while (*len > 0 && g_ascii_isspace ((*s)[*len - 1]))
+    (*len)--;
+}
+
+/* copies a line, as it was in the file, to out_file */
+static void
+pal_input_copy_line (FILE *out_file, const gchar *line, gsize len)
+{
+  if (out_file != NULL)
+    fwrite (line, 1, len, out_file);
+}
+
+/* Returns the character at *p and moves *p past it, or returns 0 if
+ * *p is at end */
+static gunichar
+pal_input_next_char (const gchar **p, const gchar *end)
+{
+  gunichar c;
+
+  if (*p >= end)
+    return 0;
+
+  c = g_utf8_get_char (*p);
+  *p = g_utf8_next_char (*p);
+  if (*p > end)
+    *p = end;
+
+  return c;
+}
+
+/* skips the comments and empty lines in front of the next line,
+ * copying them to out_file if it isn't NULL */
+void
+pal_input_skip_comments (PalInputFile *in, FILE *out_file)
+{
+  const gchar *line;
+  gsize len;
+
+  while (pal_input_peek_line (in, &line, &len))
+    {
+      const gchar *s = line;
+      gsize n = len;
+
+      pal_input_strip (&s, &n);
+      if (n > 0 && *s != '#')
+        return;
+
+      pal_input_copy_line (out_file, line, len);
+      in->pos += len;
+    }
 }
 
 /* reads in the 'first' line of the .pal file (two marker characters
  * and calendar title) */
 PalEvent *
-pal_input_read_head (FILE *file, FILE *out_file, gchar *filename)
+pal_input_read_head (PalInputFile *in, FILE *out_file)
 {
-  gchar s[2048];
-  gchar c;
+  const gchar *line, *s, *end, *type;
+  gsize len, n;
+  gunichar c;
   PalEvent *event_head = NULL;
 
-  if (fgets (s, 2048, file) == NULL)
+  if (!pal_input_peek_line (in, &line, &len))
     {
-      pal_output_error ("WARNING: File is missing 2 character marker and "
-                           "event type: %s\n",                         filename);
+      pal_input_error (in,
+                       "WARNING: File is missing 2 character marker and "
+                       "event type: %s\n",
+                       in->filename);
       return NULL;
     }
 
-  if (out_file != NULL)
-    fputs (s, out_file);
+  in->pos += len;
+  pal_input_copy_line (out_file, line, len);
+
+  s = line;
+  n = len;
+  pal_input_strip (&s, &n);
+  end = s + n;
 
   event_head = pal_event_init ();
 
-  g_strstrip (s);
-  event_head->start = g_utf8_get_char (s);
-  event_head->end = g_utf8_get_char (g_utf8_offset_to_pointer (s, 1));
-  c = g_utf8_get_char (g_utf8_offset_to_pointer (s, 2));
-  event_head->type = g_strdup (g_utf8_offset_to_pointer (s, 3));
-  event_head->file_name = g_strdup (filename);
-  event_head->global = pal_input_file_is_global (filename);
+  type = s;
+  event_head->start = pal_input_next_char (&type, end);
+  event_head->end = pal_input_next_char (&type, end);
+  c = pal_input_next_char (&type, end);
 
   if (c != ' ' && c != '\t') /* there should be white space here */
     {
-      gchar *file = g_path_get_basename (filename);
-      pal_output_error ("ERROR: First line is improperly formatted.\n");
-      pal_output_error ("       %s: %s\n", "FILE", file);
+      gchar *file = g_path_get_basename (in->filename);
+      pal_input_error (in,
+                       "ERROR: First line is improperly formatted.\n");
+      pal_input_error (in, "       %s: %s\n", "FILE", file);
       g_free (file);
-      pal_output_error ("       %s: %s\n", "LINE", s);
+      pal_input_error (in, "       %s: %.*s\n", "LINE", (int)n, s);
       pal_event_free (event_head);
       return NULL;
     }
 
   /* check if text if UTF-8 */
-  if (!g_utf8_validate (event_head->type, -1, NULL))
-    pal_output_error ("ERROR: First line is not ASCII or UTF-8 in %s.\n",                       filename);
+  if (!g_utf8_validate (type, end - type, NULL))
+    pal_input_error (in,
+                     "ERROR: First line is not ASCII or UTF-8 in %s.\n",
+                     in->filename);
 
-  g_strstrip (event_head->type);
+  n = end - type;
+  pal_input_strip (&type, &n);
+  event_head->cold->type = g_strndup (type, n);
+  event_head->cold->file_name = g_strdup (in->filename);
+  event_head->cold->global = pal_input_file_is_global (in->filename);
 
   return event_head;
 }
 
+/* TRUE if every line of in has been read */
 gboolean
-pal_input_eof (FILE *file)
+pal_input_eof (PalInputFile *in)
 {
-  if (feof (file) != 0)
-    return TRUE;
-  return FALSE;
+  return in->pos >= in->length;
 }
 
 /* Returns:    The PalEvent for the next event in the file (or del_event if
- * del_event was deleted). file:       File stream to read from. out_file:
- * Print the expunged output to out_file if it isn't NULL filename:   Name of
- * the file corresponding to the "file" stream event_head: Default to these
- * values for the returned PalEvent. del_event:  If this event is encountered
- * in the file, do not print it to out_file */
+ * del_event was deleted). in:         File to read from. out_file:
+ * Print the expunged output to out_file if it isn't NULL event_head:
+ * Default to these values for the returned PalEvent. del_event:  If this
+ * event is encountered in the file, do not print it to out_file query:
+ * Expunge relative to the query's today */
 PalEvent *
-pal_input_read_event (FILE *file, FILE *out_file, gchar *filename,
-                      PalEvent *event_head, PalEvent *del_event)
+pal_input_read_event (const PalQuery *query, PalInputFile *in,
+                      FILE *out_file, PalEvent *event_head,
+                      PalEvent *del_event)
 {
-  gchar s[2048];
-
   gchar date_string[128];
-  gchar *text_string = NULL;
-  gchar *tmp = NULL;
+  const gchar *line, *end, *word, *text;
+  gsize len, text_len, i;
   PalEvent *pal_event = NULL;
 
-  if (fgets (s, 2048, file) == NULL)
+  if (!pal_input_peek_line (in, &line, &len))
     return NULL;
 
-  /* first word is the date string */
-  sscanf (s, "%s", date_string);
-
-  /* the rest is the descriptive text */
-  text_string = g_strdup (s + strlen (date_string));
-
-  /* a roundabout way of making date_string uppercase.  The keys
-     in hashtable must be uppercase, but pal's .pal files are
-     case insensitive. */
-  g_strstrip (date_string);
-  tmp = g_ascii_strup (date_string, -1);
-  sscanf (tmp, "%s", date_string);
-  g_free (tmp);
+  in->pos += len;
+  end = line + len;
+
+  /* first word is the date string, the rest is the descriptive text */
+  word = line;
+  while (word < end && g_ascii_isspace (*word))
+    word++;
+  text = word;
+  while (text < end && !g_ascii_isspace (*text))
+    text++;
+
+  /* The keys in hashtable must be uppercase, but pal's .pal files are
+     case insensitive.  A date string too long for the buffer isn't
+     valid anyway. */
+  date_string[0] = '\0';
+  if ((gsize)(text - word) < sizeof (date_string))
+    {
+      for (i = 0; word + i < text; i++)
+        date_string[i] = g_ascii_toupper (word[i]);
+      date_string[i] = '\0';
+    }
 
-  g_strstrip (text_string);
+  text_len = end - text;
+  pal_input_strip (&text, &text_len);
 
   pal_event = pal_event_copy (event_head);
   /* check for a valid date_string */
   if (!parse_event (pal_event, date_string))
     {
-      gchar *file = g_path_get_basename (filename);
-      pal_output_error ("ERROR: Invalid date string.\n");
-      pal_output_error ("       %s: %s\n", "FILE", file);
-      pal_output_error ("       %s: %s\n", "LINE", s);
+      gchar *file = g_path_get_basename (in->filename);
+      pal_input_error (in, "ERROR: Invalid date string.\n");
+      pal_input_error (in, "       %s: %s\n", "FILE", file);
+      pal_input_error (in, "       %s: %.*s\n", "LINE", (int)len, line);
       g_free (file);
 
       /* copy bad line */
-      if (out_file != NULL)
-        fputs (s, out_file);
+      pal_input_copy_line (out_file, line, len);
 
-      g_free (text_string);
       pal_event_free (pal_event);
       return NULL;
     }
 
   /* require a description for a event */
-  if (strlen (text_string) == 0)
+  if (text_len == 0)
     {
-      gchar *file = g_path_get_basename (filename);
-      pal_output_error ("ERROR: Event description missing.\n");
-      pal_output_error ("       %s: %s\n", "FILE", file);
-      pal_output_error ("       %s: %s\n", "LINE", s);
+      gchar *file = g_path_get_basename (in->filename);
+      pal_input_error (in, "ERROR: Event description missing.\n");
+      pal_input_error (in, "       %s: %s\n", "FILE", file);
+      pal_input_error (in, "       %s: %.*s\n", "LINE", (int)len, line);
       g_free (file);
 
       /* copy bad line */
-      if (out_file != NULL)
-        fputs (s, out_file);
+      pal_input_copy_line (out_file, line, len);
+
+      pal_event_free (pal_event);
+      return NULL;
+    }
+
+  pal_event->text = pal_event_strndup (pal_event, text, text_len);
+
+  /* check if text if UTF-8, and find the times in it */
+  if (!pal_input_scan_text (text, text_len, &pal_event->start_time,
+                            &pal_event->end_time))
+    {
+      pal_input_error (
+          in, "ERROR: Event text '%s' is not ASCII or UTF-8 in file %s.\n",
+          pal_event->text, in->filename);
+      pal_event->start_time = pal_input_get_time (pal_event->text, 1);
+      pal_event->end_time = pal_input_get_time (pal_event->text, 2);
+    }
+
+  /* Sanity checks */
+  if (pal_event->period_count != 1 && pal_event->start_day == PAL_NO_DAY)
+    {
+      gchar *file = g_path_get_basename (in->filename);
+
+      pal_event->start_day = query->today.julian;
+      pal_event->end_day = pal_date_from_dmy (1, 1, 3000).julian;
+
+      pal_input_error (in,
+                       "ERROR: Event with count has no start date\n");
+      pal_input_error (in, "       %s: %s\n", "FILE", file);
+      pal_input_error (in, "       %s: %.*s\n", "LINE", (int)len, line);
+      g_free (file);
+    }
+  pal_event->cold->date_string = pal_event_strdup (pal_event, date_string);
+
+  if (out_file != NULL)
+    {
+      /* don't print to out_file if event should be expunged */
+      if (should_be_expunged (query, pal_event))
+        {
+          if (settings->verbose)
+            pal_input_note (in, "%s: %.*s", "Expunged", (int)len,
+                            line);
+
+          pal_event_free (pal_event);
+          return NULL;
+        }
+
+      /* don't print to out_file if event should be deleted */
+      else if (del_event != NULL
+               && strcmp (pal_event->cold->date_string,
+                         del_event->cold->date_string)
+                      == 0
+               && strcmp (pal_event->text, del_event->text) == 0)
+        {
+          pal_event_free (pal_event);
+          return del_event;
+        }
+      else /* otherwise, print to out_file */
+        pal_input_copy_line (out_file, line, len);
+    }
+
+  return pal_event;
+}
+
+/* checks if file is a global */
+static gboolean
+pal_input_file_is_global (const gchar *filename)
+{
+  if (strncmp (filename, PREFIX "/share/pal", strlen (PREFIX "/share/pal"))
+      == 0)
+    return TRUE;
+  return FALSE;
+}
+
+/* One step of load_files: a .pal file to parse on the load thread
+ * pool, and what parsing it produced.  Steps are finished in the
+ * order they were made, so the events go into ht in file_num order
+ * and the messages come out in the order they would have without
+ * the threads. */
+typedef struct _PalLoadJob
+{
+  PalInputFile *in;    /* NULL if the step only has messages */
+  gint filecount;
+  gboolean hide;
+  gint color;
+  PalEventArena *arena;
+  GPtrArray *events;   /* the file's events, in the order they were read */
+  GPtrArray *messages; /* kept by pal_input_vmessage */
+  gint64 mtime;        /* of the file before it was read, or -1 */
+  gboolean archive;    /* the file is an archive of the file_num-th */
+} PalLoadJob;
+
+/* A file whose events are in ht, so pal_input_reload can tell when
+ * it needs to be read again */
+typedef struct _PalLoadedFile
+{
+  gchar *filename;
+  gint file_num;
+  gboolean hide;
+  gint color;
+  PalEventArena *arena; /* its events, NULL if it couldn't be read */
+  gint64 mtime;         /* mtime and size when it was read, or -1 */
+  gint64 size;
+  gboolean written;     /* pal wrote to it after it was read */
+  PalInputFile *hidden; /* a hidden file that isn't read until it's
+                           needed, see pal_input_load_hidden */
+} PalLoadedFile;
+
+static GThreadPool *pal_input_pool = NULL; /* while load_files runs */
+static GPtrArray *pal_input_jobs = NULL;
+
+/* the files loaded into ht, or kept to load later if they are
+ * hidden, and the pal.conf that named them */
+static GPtrArray *pal_input_loaded = NULL;
+static gint64 pal_input_conf_mtime = -1;
+static gint64 pal_input_conf_size = -1;
+static gboolean pal_input_all_loaded = FALSE; /* every file could be read */
+/* the archives of the loaded files that were loaded into ht so far */
+static GPtrArray *pal_input_archives = NULL;
+/* if pal_input_windowed, events that can't occur from pal_input_first
+ * to pal_input_last aren't loaded, see pal_main_window */
+static gboolean pal_input_windowed = FALSE;
+static guint32 pal_input_first = 0;
+static guint32 pal_input_last = 0;
+
+static void pal_input_watch_files (void);
+static void pal_input_watch_drain (void);
+
+/* Snapshot of the events parsed from one .pal file, kept in
+ * ~/.pal/cache/ so the file doesn't have to be parsed again while it
+ * is unchanged.  A snapshot is a PalCacheHeader, n_events
+ * PalCacheEvents and then strings_len bytes of '\0' terminated
+ * strings that the header and events point into by offset.  It is
+ * written in the machine's byte order and is only used by a pal with
+ * the same PAL_CACHE_VERSION, which changes whenever these structs or
+ * what the parser makes of a file does. */
+#define PAL_CACHE_MAGIC "PALCACHE"
+#define PAL_CACHE_VERSION 1
+
+typedef struct _PalCacheHeader
+{
+  gchar magic[8];      /* PAL_CACHE_MAGIC, without a '\0' */
+  guint32 version;     /* PAL_CACHE_VERSION */
+  guint32 n_events;
+  gint64 mtime;        /* of the .pal file when it was parsed */
+  guint64 size;        /* of the .pal file */
+  guint64 hash;        /* of the .pal file's contents */
+  guint32 strings_len;
+  gunichar start;      /* marker characters from the file's first line */
+  gunichar end;
+  guint32 type;        /* event type from the file's first line */
+  guint32 file_name;   /* the .pal file, as load_files named it */
+  guint32 padding;
+} PalCacheHeader;
+
+typedef struct _PalCacheEvent
+{
+  guint32 key;
+  guint32 start_day;
+  guint32 end_day;
+  gint32 period_count;
+  gint16 start_time;
+  gint16 end_time;
+  guint32 text;
+  guint32 date_string;
+} PalCacheEvent;
+
+/* 64 bit FNV-1a hash of the length bytes at data */
+static guint64
+pal_input_hash (const gchar *data, gsize length)
+{
+  guint64 hash = G_GUINT64_CONSTANT (14695981039346656037);
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    {
+      hash ^= (guchar)data[i];
+      hash *= G_GUINT64_CONSTANT (1099511628211);
+    }
+
+  return hash;
+}
+
+/* Returns the path of the snapshot of the .pal file filename.  Free
+ * it with g_free. */
+static gchar *
+pal_input_cache_path (const gchar *filename)
+{
+  gchar *path, *sum, *name;
+
+  if (g_path_is_absolute (filename))
+    path = g_strdup (filename);
+  else
+    {
+      gchar *dir = g_get_current_dir ();
+      path = g_build_filename (dir, filename, NULL);
+      g_free (dir);
+    }
+
+  sum = g_compute_checksum_for_data (G_CHECKSUM_SHA1, (const guchar *)path,
+                                     strlen (path));
+  name = g_strconcat (sum, ".cache", NULL);
+  g_free (path);
+  path = g_build_filename (g_get_home_dir (), ".pal", "cache", name, NULL);
+
+  g_free (name);
+  g_free (sum);
+  return path;
+}
+
+/* Sets mtime and size to the modification time and size of filename.
+ * They are set to -1, and FALSE is returned, if it can't be found. */
+static gboolean
+pal_input_stat (const gchar *filename, gint64 *mtime, gint64 *size)
+{
+  struct stat buf;
+
+  if (stat (filename, &buf) != 0)
+    {
+      *mtime = -1;
+      *size = -1;
+      return FALSE;
+    }
+
+  *mtime = buf.st_mtime;
+  *size = buf.st_size;
+  return TRUE;
+}
+
+/* Fills in the events of job from the snapshot at cache_path if it
+ * was made from the file job is reading as it is now.  Returns FALSE,
+ * without changing job, if it wasn't. */
+static gboolean
+pal_input_read_cache (PalLoadJob *job, const gchar *cache_path,
+                      gint64 mtime)
+{
+  PalInputFile *in = job->in;
+  GMappedFile *map;
+  const PalCacheHeader *header;
+  const PalCacheEvent *records;
+  const gchar *data, *strings;
+  gsize length;
+  PalEvent *event_head, *head;
+  gchar *arena_strings;
+  guint32 i;
+
+  if (mtime < 0)
+    return FALSE;
+
+  map = g_mapped_file_new (cache_path, FALSE, NULL);
+  if (map == NULL)
+    return FALSE;
+
+  data = g_mapped_file_get_contents (map);
+  length = g_mapped_file_get_length (map);
+  header = (const PalCacheHeader *)data;
+
+  if (length < sizeof (PalCacheHeader)
+      || memcmp (header->magic, PAL_CACHE_MAGIC, 8) != 0
+      || header->version != PAL_CACHE_VERSION || header->mtime != mtime
+      || header->size != in->length
+      || (length - sizeof (PalCacheHeader)) / sizeof (PalCacheEvent)
+             < header->n_events
+      || length
+             != sizeof (PalCacheHeader)
+                    + header->n_events * sizeof (PalCacheEvent)
+                    + header->strings_len
+      || header->strings_len == 0 || data[length - 1] != '\0'
+      || header->type >= header->strings_len
+      || header->file_name >= header->strings_len
+      || header->hash != pal_input_hash (in->data, in->length))
+    {
+      g_mapped_file_unref (map);
+      return FALSE;
+    }
+
+  records = (const PalCacheEvent *)(data + sizeof (PalCacheHeader));
+  strings = (const gchar *)(records + header->n_events);
+
+  /* the hash only covers the .pal file, so a snapshot that is damaged
+   * or from another build must not give an event an unknown type or a
+   * count that can't be divided by */
+  for (i = 0; i < header->n_events; i++)
+    if (records[i].text >= header->strings_len
+        || records[i].date_string >= header->strings_len
+        || PAL_KEY_TYPE (records[i].key) >= (guint32)PAL_NUM_EVENTTYPES
+        || records[i].period_count < 1)
+      {
+        g_mapped_file_unref (map);
+        return FALSE;
+      }
+
+  if (strcmp (strings + header->file_name, in->filename) != 0)
+    {
+      g_mapped_file_unref (map);
+      return FALSE;
+    }
+
+  /* set up the head like pal_input_read_head and pal_input_load_job */
+  event_head = pal_event_init ();
+  event_head->start = header->start;
+  event_head->end = header->end;
+  event_head->cold->type = g_strdup (strings + header->type);
+  event_head->cold->file_name = g_strdup (in->filename);
+  event_head->cold->global = pal_input_file_is_global (in->filename);
+  head = pal_event_copy_to (job->arena, event_head);
+  pal_event_free (event_head);
+  head->color = job->color;
+  head->file_num = job->filecount;
+  head->hide = job->hide;
+
+  /* all the strings are copied to the arena at once */
+  arena_strings = pal_event_alloc (head, header->strings_len);
+  memcpy (arena_strings, strings, header->strings_len);
+
+  for (i = 0; i < header->n_events; i++)
+    {
+      PalEvent *event = pal_event_copy (head);
+
+      event->key = records[i].key;
+      event->start_day = records[i].start_day;
+      event->end_day = records[i].end_day;
+      event->period_count = records[i].period_count;
+      event->start_time = records[i].start_time;
+      event->end_time = records[i].end_time;
+      event->text = arena_strings + records[i].text;
+      event->cold->date_string = arena_strings + records[i].date_string;
+      g_ptr_array_add (job->events, event);
+    }
+
+  g_mapped_file_unref (map);
+  return TRUE;
+}
+
+/* adds s, and its '\0', to the strings of a snapshot and returns its
+ * offset */
+static guint32
+pal_input_cache_string (GString *strings, const gchar *s)
+{
+  guint32 offset = strings->len;
+
+  g_string_append_len (strings, s, strlen (s) + 1);
+  return offset;
+}
+
+/* Writes the snapshot of the events of job, read from a file that
+ * had event_head as its first line, to cache_path.  A snapshot that
+ * can't be written is left out. */
+static void
+pal_input_write_cache (PalLoadJob *job, const PalEvent *event_head,
+                       const gchar *cache_path, gint64 mtime)
+{
+  PalCacheHeader header;
+  GString *records, *strings;
+  gchar *dir;
+  guint i;
+
+  if (mtime < 0)
+    return;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, PAL_CACHE_MAGIC, 8);
+  header.version = PAL_CACHE_VERSION;
+  header.n_events = job->events->len;
+  header.mtime = mtime;
+  header.size = job->in->length;
+  header.hash = pal_input_hash (job->in->data, job->in->length);
+  header.start = event_head->start;
+  header.end = event_head->end;
+
+  strings = g_string_new (NULL);
+  header.type = pal_input_cache_string (strings, event_head->cold->type);
+  header.file_name = pal_input_cache_string (strings, job->in->filename);
+
+  records = g_string_sized_new (sizeof (PalCacheHeader)
+                                + job->events->len * sizeof (PalCacheEvent));
+  g_string_append_len (records, (const gchar *)&header, sizeof (header));
+
+  for (i = 0; i < job->events->len; i++)
+    {
+      const PalEvent *event = g_ptr_array_index (job->events, i);
+      PalCacheEvent record;
+
+      memset (&record, 0, sizeof (record));
+      record.key = event->key;
+      record.start_day = event->start_day;
+      record.end_day = event->end_day;
+      record.period_count = event->period_count;
+      record.start_time = event->start_time;
+      record.end_time = event->end_time;
+      record.text = pal_input_cache_string (strings, event->text);
+      record.date_string
+          = pal_input_cache_string (strings, event->cold->date_string);
+      g_string_append_len (records, (const gchar *)&record, sizeof (record));
+    }
+
+  /* the header was copied before the length of the strings was known */
+  ((PalCacheHeader *)records->str)->strings_len = strings->len;
+  g_string_append_len (records, strings->str, strings->len);
+
+  dir = g_path_get_dirname (cache_path);
+  if (g_mkdir_with_parents (dir, 0755) == 0)
+    g_file_set_contents (cache_path, records->str, records->len, NULL);
+
+  g_free (dir);
+  g_string_free (strings, TRUE);
+  g_string_free (records, TRUE);
+}
+
+/* Returns where load_files keeps the messages printed now: the last
+ * step, unless it has gone to the thread pool */
+static GPtrArray *
+pal_input_conf_messages (void)
+{
+  PalLoadJob *job;
+
+  if (pal_input_jobs == NULL)
+    return NULL;
+
+  job = (pal_input_jobs->len > 0)
+            ? g_ptr_array_index (pal_input_jobs, pal_input_jobs->len - 1)
+            : NULL;
+  if (job == NULL || job->in != NULL)
+    {
+      job = g_malloc0 (sizeof (PalLoadJob));
+      job->messages = g_ptr_array_new_with_free_func (g_free);
+      g_ptr_array_add (pal_input_jobs, job);
+    }
+
+  return job->messages;
+}
+
+/* an error from load_files, printed in order with the errors from
+ * the files loaded before it */
+static void
+pal_input_conf_error (const gchar *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  pal_input_vmessage (pal_input_conf_messages (), 'E', format, args);
+  va_end (args);
+}
+
+/* a message for -v from load_files */
+static void
+pal_input_conf_note (const gchar *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  pal_input_vmessage (pal_input_conf_messages (), 'N', format, args);
+  va_end (args);
+}
+
+/* a range of bytes in a file: from start up to, not including, end */
+typedef struct _PalInputSpan
+{
+  gsize start;
+  gsize end;
+  gint year; /* of the archive the events in it go to */
+} PalInputSpan;
+
+/* Returns the archive -x --archive puts the events of filename that
+ * end in year in: archive/name.yyyy.pal next to it, where name.pal
+ * is the name of filename.  It should be freed. */
+static gchar *
+pal_input_archive_path (const gchar *filename, gint year)
+{
+  gchar *dir = g_path_get_dirname (filename);
+  gchar *name = g_path_get_basename (filename);
+  gchar *path;
+
+  if (g_str_has_suffix (name, ".pal"))
+    name[strlen (name) - 4] = '\0';
+
+  path = g_strdup_printf ("%s/archive/%s.%04d.pal", dir, name, year);
+  g_free (dir);
+  g_free (name);
+  return path;
+}
+
+/* Returns the year of the last day an expunged event occurred on */
+static gint
+pal_input_archive_year (const PalEvent *event)
+{
+  guint32 day = pal_event_once_day (event);
+
+  if (day == PAL_NO_DAY)
+    day = event->end_day;
+  return pal_date_from_julian (day).year;
+}
+
+/* writes the bytes of span in in to out_file, ending with a newline */
+static void
+pal_input_write_span (FILE *out_file, const PalInputFile *in,
+                      gsize start, gsize end)
+{
+  fwrite (in->data + start, 1, end - start, out_file);
+  if (end > start && in->data[end - 1] != '\n')
+    fputc ('\n', out_file);
+}
+
+/* an archive as it was before pal_input_archive added to it */
+typedef struct _PalInputArchived
+{
+  gchar *path;
+  gboolean is_new; /* it didn't exist */
+  off_t size;      /* its size if it did */
+} PalInputArchived;
+
+/* frees what pal_input_archive returned, keeping what it wrote */
+static void
+pal_input_archived_free (GArray *archived)
+{
+  guint i;
+
+  if (archived == NULL)
+    return;
+
+  for (i = 0; i < archived->len; i++)
+    g_free (g_array_index (archived, PalInputArchived, i).path);
+  g_array_free (archived, TRUE);
+}
+
+/* Puts the archives in archived back the way they were before
+ * pal_input_archive added to them, and frees archived */
+static void
+pal_input_unarchive (PalInputFile *in, GArray *archived)
+{
+  guint i;
+
+  for (i = 0; i < archived->len; i++)
+    {
+      PalInputArchived *a = &g_array_index (archived, PalInputArchived, i);
+
+      if (a->is_new ? remove (a->path) != 0 && errno != ENOENT
+                    : truncate (a->path, a->size) != 0)
+        pal_input_error (in, "ERROR: Can't restore file: %s\n", a->path);
+    }
+
+  pal_input_archived_free (archived);
+}
+
+/* Adds the lines in spans to the end of the archives of their years.
+ * An archive starts with the first line of in, from head_start to
+ * head_end, so it is read like in.  Returns the archives as they were
+ * before, to put them back with pal_input_unarchive if in can't be
+ * expunged, or to free with pal_input_archived_free once it is.  If
+ * an archive couldn't be written, the ones before it are put back and
+ * NULL is returned, and then in shouldn't be expunged. */
+static GArray *
+pal_input_archive (PalInputFile *in, gsize head_start, gsize head_end,
+                   GArray *spans)
+{
+  GArray *archived = g_array_new (FALSE, FALSE, sizeof (PalInputArchived));
+  guint i, j;
+
+  for (i = 0; i < spans->len; i++)
+    {
+      gint year = g_array_index (spans, PalInputSpan, i).year;
+      PalInputArchived before = { NULL, TRUE, 0 };
+      gchar *dir;
+      FILE *out_file = NULL;
+      gboolean opened, ok;
+      struct stat st;
+
+      /* the spans of a year go in when its first one is reached */
+      for (j = 0; j < i; j++)
+        if (g_array_index (spans, PalInputSpan, j).year == year)
+          break;
+      if (j < i)
+        continue;
+
+      before.path = pal_input_archive_path (in->filename, year);
+      dir = g_path_get_dirname (before.path);
+      if (g_mkdir_with_parents (dir, 0755) == 0)
+        {
+          if (stat (before.path, &st) == 0)
+            {
+              before.is_new = FALSE;
+              before.size = st.st_size;
+              out_file = fopen (before.path, "a");
+            }
+          else if (errno == ENOENT)
+            out_file = fopen (before.path, "a");
+        }
+      g_free (dir);
+
+      opened = ok = (out_file != NULL);
+      if (opened)
+        {
+          /* noted first, so a failed write is taken back too */
+          g_array_append_val (archived, before);
+
+          if (before.is_new)
+            pal_input_write_span (out_file, in, head_start, head_end);
+
+          for (j = i; j < spans->len; j++)
+            {
+              const PalInputSpan *span
+                  = &g_array_index (spans, PalInputSpan, j);
+              if (span->year == year)
+                pal_input_write_span (out_file, in, span->start, span->end);
+            }
+
+          ok = !ferror (out_file);
+          if (fclose (out_file) != 0)
+            ok = FALSE;
+        }
+
+      if (!ok)
+        {
+          pal_input_error (in, "ERROR: Can't write file: %s\n",
+                           before.path);
+          pal_input_error (in, "       File will not be expunged: %s\n",
+                           in->filename);
+          /* archived has the path if the file was opened */
+          if (!opened)
+            g_free (before.path);
+          pal_input_unarchive (in, archived);
+          return NULL;
+        }
+    }
+
+  return archived;
+}
+
+/* Writes the file of in again without the bytes in spans, which are
+ * in order and don't overlap, by way of a .paltmp file.  Returns
+ * FALSE if it couldn't. */
+static gboolean
+pal_input_expunge (PalInputFile *in, GArray *spans)
+{
+  gchar *out_filename = g_strconcat (in->filename, ".paltmp", NULL);
+  FILE *out_file = fopen (out_filename, "w");
+  gboolean ok = TRUE;
+  gsize pos = 0;
+  guint i;
+
+  if (out_file == NULL)
+    {
+      pal_input_error (in, "ERROR: Can't write file: %s\n", out_filename);
+      pal_input_error (in, "       File will not be expunged: %s\n",
+                       in->filename);
+      g_free (out_filename);
+      return FALSE;
+    }
+
+  /* copy everything between the expunged lines */
+  for (i = 0; i < spans->len; i++)
+    {
+      const PalInputSpan *span = &g_array_index (spans, PalInputSpan, i);
+      fwrite (in->data + pos, 1, span->start - pos, out_file);
+      pos = span->end;
+    }
+  fwrite (in->data + pos, 1, in->length - pos, out_file);
+
+  if (fclose (out_file) != 0)
+    {
+      pal_input_error (in, "ERROR: Can't write file: %s\n", out_filename);
+      remove (out_filename);
+      ok = FALSE;
+    }
+  else if (rename (out_filename, in->filename) != 0)
+    {
+      pal_input_error (in, "ERROR: Can't rename %s to %s\n", out_filename,
+                       in->filename);
+      ok = FALSE;
+    }
+
+  g_free (out_filename);
+  return ok;
+}
+
+/* removes the events to expunge from events */
+static void
+pal_input_remove_expunged (const PalQuery *query, GPtrArray *events)
+{
+  guint i, n = 0;
+
+  for (i = 0; i < events->len; i++)
+    {
+      PalEvent *event = g_ptr_array_index (events, i);
+      if (!should_be_expunged (query, event))
+        events->pdata[n++] = event;
+    }
+
+  g_ptr_array_set_size (events, n);
+}
+
+/* TRUE if event can occur in the days load_files was asked for.
+ * Only one-time events and events with a date range can't.  This runs
+ * on the load threads, so the day of a one-time event comes from its
+ * key by way of pal_date_from_dmy and never from the year facts. */
+static gboolean
+pal_input_in_window (const PalEvent *event)
+{
+  guint32 day;
+
+  if (!pal_input_windowed)
+    return TRUE;
+
+  if (event->start_day != PAL_NO_DAY && event->end_day != PAL_NO_DAY)
+    return event->end_day >= pal_input_first
+           && event->start_day <= pal_input_last;
+
+  day = pal_event_once_day (event); /* doesn't look up year facts */
+  return day == PAL_NO_DAY
+         || (day >= pal_input_first && day <= pal_input_last);
+}
+
+/* Skips the next line of in if it is a one-time event or an event
+ * with a date range that can't occur in the days load_files was asked
+ * for.  Only its date string is parsed, and the line is only checked
+ * enough to know that pal_input_read_event wouldn't find an error in
+ * it.  Returns TRUE if it was skipped. */
+static gboolean
+pal_input_skip_event (PalInputFile *in)
+{
+  gchar date_string[128];
+  const gchar *line, *end, *word, *text;
+  gsize len, text_len, i;
+  PalEvent probe;
+
+  if (!pal_input_peek_line (in, &line, &len))
+    return FALSE;
+
+  end = line + len;
+  word = line;
+  while (word < end && g_ascii_isspace (*word))
+    word++;
+  text = word;
+  while (text < end && !g_ascii_isspace (*text))
+    text++;
+
+  /* yyyymmdd, or anything with a start and end date */
+  if ((gsize)(text - word) >= sizeof (date_string)
+      || ((text - word != 8 || !g_ascii_isdigit (*word))
+          && memchr (word, ':', text - word) == NULL))
+    return FALSE;
+
+  for (i = 0; word + i < text; i++)
+    date_string[i] = g_ascii_toupper (word[i]);
+  date_string[i] = '\0';
+
+  probe.start_day = PAL_NO_DAY;
+  probe.end_day = PAL_NO_DAY;
+  if (!parse_event (&probe, date_string)
+      || (probe.period_count != 1 && probe.start_day == PAL_NO_DAY)
+      || pal_input_in_window (&probe))
+    return FALSE;
+
+  text_len = end - text;
+  pal_input_strip (&text, &text_len);
+  if (text_len == 0 || !g_utf8_validate (text, text_len, NULL))
+    return FALSE;
+
+  in->pos += len;
+  return TRUE;
+}
+
+/* removes the events that can't occur in the days load_files was
+ * asked for from events */
+static void
+pal_input_remove_outside (GPtrArray *events)
+{
+  guint i, n = 0;
+
+  for (i = 0; i < events->len; i++)
+    {
+      PalEvent *event = g_ptr_array_index (events, i);
+      if (pal_input_in_window (event))
+        events->pdata[n++] = event;
+    }
+
+  g_ptr_array_set_size (events, n);
+}
+
+/* Parses the file of a job into its arena and events.  Runs on the
+ * load thread pool, so it doesn't touch ht, its messages are kept in
+ * the job, and it only calls the functions of event.c that don't look
+ * up year facts (see pal_year_facts_cache).  The events come from the
+ * file's snapshot when it has one, and a file that parses without
+ * errors gets a new snapshot.
+ *
+ * If -x is used and the file isn't a global calendar or an archive,
+ * the lines of the events to expunge are noted while it is parsed,
+ * and the file is written again without them if there are any.  With
+ * --archive they are added to the archives of their years first.
+ *
+ * If load_files was asked for some days only, the events that can't
+ * occur in them are left out, and the file gets no snapshot if that
+ * left anything out. */
+static void
+pal_input_load_job (gpointer data, gpointer user_data)
+{
+  PalLoadJob *job = data;
+  const PalQuery *query = user_data;
+  PalInputFile *in = job->in;
+  gchar *filename = in->filename;
+  PalEvent *event_head;
+  GArray *expunged = NULL;
+  gboolean skipped = FALSE;
+  gchar *cache_path;
+  gint64 size;
+  gsize head_start, head_end;
+
+  g_strstrip (filename);
+  pal_input_stat (filename, &job->mtime, &size);
+
+  if (settings->expunge > 0 && !job->archive
+      && !pal_input_file_is_global (filename))
+    expunged = g_array_new (FALSE, FALSE, sizeof (PalInputSpan));
+
+  cache_path = pal_input_cache_path (filename);
+  if (pal_input_read_cache (job, cache_path, job->mtime))
+    {
+      guint old_len = job->events->len;
+
+      /* it only needs to be parsed if there is something to expunge */
+      if (expunged != NULL)
+        pal_input_remove_expunged (query, job->events);
+
+      if (job->events->len == old_len)
+        {
+          if (expunged != NULL)
+            g_array_free (expunged, TRUE);
+          if (pal_input_windowed)
+            pal_input_remove_outside (job->events);
+          g_free (cache_path);
+          return;
+        }
+
+      pal_event_arena_free (job->arena);
+      job->arena = pal_event_arena_new ();
+      g_ptr_array_set_size (job->events, 0);
+    }
+
+  pal_input_skip_comments (in, NULL);
+  head_start = in->pos;
+  event_head = pal_input_read_head (in, NULL);
+  head_end = in->pos;
+
+  /* the events are copied from the head, so they go in its arena */
+  if (event_head != NULL)
+    {
+      PalEvent *head = pal_event_copy_to (job->arena, event_head);
+      pal_event_free (event_head);
+      event_head = head;
+    }
+
+  if (event_head != NULL)
+    {
+      event_head->color = job->color;
+      event_head->file_num = job->filecount;
+      event_head->hide = job->hide;
+
+      while (1)
+        {
+          PalEvent *pal_event = NULL;
+          gsize start;
+
+          pal_input_skip_comments (in, NULL);
+          start = in->pos;
+
+          if (pal_input_windowed && pal_input_skip_event (in))
+            {
+              skipped = TRUE;
+              continue;
+            }
+
+          pal_event = pal_input_read_event (query, in, NULL, event_head,
+                                            NULL);
+
+          if (pal_event == NULL && pal_input_eof (in))
+            break;
+
+          if (pal_event == NULL)
+            continue;
+
+          if (expunged != NULL && should_be_expunged (query, pal_event))
+            {
+              PalInputSpan span = { start, in->pos, 0 };
+              PalInputSpan *last = NULL;
+
+              if (settings->archive)
+                span.year = pal_input_archive_year (pal_event);
+
+              if (settings->verbose)
+                pal_input_note (in, "%s: %.*s",
+                                settings->archive ? "Archived" : "Expunged",
+                                (int)(span.end - span.start),
+                                in->data + span.start);
+
+              /* lines next to each other are left out as one span */
+              if (expunged->len > 0)
+                last = &g_array_index (expunged, PalInputSpan,
+                                       expunged->len - 1);
+              if (last != NULL && last->end == span.start
+                  && last->year == span.year)
+                last->end = span.end;
+              else
+                g_array_append_val (expunged, span);
+            }
 
-      g_free (text_string);
-      pal_event_free (pal_event);
-      return NULL;
+          g_ptr_array_add (job->events, pal_event);
+        }
     }
 
-  /* check if text if UTF-8 */
-  if (!g_utf8_validate (text_string, -1, NULL))
-    pal_output_error (
-        "ERROR: Event text '%s' is not ASCII or UTF-8 in file %s.\n",         text_string, filename);
-
-  /* Sanity checks */
-  if (pal_event->period_count != 1 && !pal_event->start_date)
+  /* the expunged events stay if the files couldn't be written */
+  if (expunged != NULL && expunged->len > 0)
     {
-      gchar *file = g_path_get_basename (filename);
-      pal_event->start_date = g_date_new ();
-      g_date_set_time_t (pal_event->start_date, time (NULL));
-      pal_event->end_date = g_date_new_dmy (1, 1, 3000);
+      GArray *archived = NULL;
 
-      pal_output_error ("ERROR: Event with count has no start date\n");
-      pal_output_error ("       %s: %s\n", "FILE", file);
-      pal_output_error ("       %s: %s\n", "LINE", s);
-    }
-  pal_event->text = g_strdup (text_string);
-  pal_event->start_time = pal_input_get_time (text_string, 1);
-  pal_event->end_time = pal_input_get_time (text_string, 2);
-  pal_event->date_string = g_strdup (date_string);
+      if (settings->archive)
+        archived = pal_input_archive (in, head_start, head_end, expunged);
 
-  if (out_file != NULL)
-    {
-      /* don't print to out_file if event should be expunged */
-      if (should_be_expunged (pal_event))
+      if ((!settings->archive || archived != NULL)
+          && pal_input_expunge (in, expunged))
         {
-          if (settings->verbose)
-            g_printerr ("%s: %s", "Expunged", s);
-
-          pal_event_free (pal_event);
-          g_free (text_string);
-          return NULL;
+          pal_input_remove_expunged (query, job->events);
+          pal_input_archived_free (archived);
         }
-
-      /* don't print to out_file if event should be deleted */
-      else if (del_event != NULL
-               && strcmp (pal_event->date_string, del_event->date_string) == 0
-               && strcmp (pal_event->text, del_event->text) == 0)
+      else if (archived != NULL)
         {
-          pal_event_free (pal_event);
-          g_free (text_string);
-          return del_event;
+          /* the events are still in in, so they come out of the
+           * archives again */
+          pal_input_unarchive (in, archived);
         }
-      else /* otherwise, print to out_file */
-        fputs (s, out_file);
     }
+  else if (event_head != NULL && job->messages->len == 0 && !skipped)
+    pal_input_write_cache (job, event_head, cache_path, job->mtime);
 
-  g_free (text_string);
-  return pal_event;
+  if (expunged != NULL)
+    g_array_free (expunged, TRUE);
+  g_free (cache_path);
 }
 
-/* checks if file is a global */
-static gboolean
-pal_input_file_is_global (const gchar *filename)
+/* Queues the pal calendar file in to be loaded with the given
+ * file_num, hide and color, as an archive of the file with that
+ * file_num if archive is TRUE.  It is parsed once
+ * pal_input_finish_loading is called, and closed when it's done. */
+static void
+pal_input_add_job (PalInputFile *in, gint filecount, gboolean hide,
+                   int color, gboolean archive)
 {
-  if (strncmp (filename, PREFIX "/share/pal", strlen (PREFIX "/share/pal"))
-      == 0)
-    return TRUE;
-  return FALSE;
+  PalLoadJob *job = g_malloc0 (sizeof (PalLoadJob));
+
+  job->in = in;
+  job->filecount = filecount;
+  job->hide = hide;
+  job->color = color;
+  job->archive = archive;
+  job->arena = pal_event_arena_new ();
+  job->events = g_ptr_array_new ();
+  job->messages = g_ptr_array_new_with_free_func (g_free);
+  in->messages = job->messages;
+  g_ptr_array_add (pal_input_jobs, job);
 }
 
-/* loads a pal calendar file, returns the number of events loaded into
- * hashtable */
-static gint
-load_file (gchar *filename, FILE *file, gint filecount, gboolean hide,
-           int color)
+/* Starts the load thread pool for load_files */
+static void
+pal_input_start_loading (const PalQuery *query)
 {
-  gint eventcount = 0;
-  PalEvent *event_head;
-  FILE *out_file = NULL;
-  gchar *out_filename = NULL;
+  pal_input_jobs = g_ptr_array_new ();
+  pal_input_pool = g_thread_pool_new (pal_input_load_job, (gpointer)query,
+                                      g_get_num_processors (), FALSE, NULL);
+}
 
-  g_strstrip (filename);
-  out_filename = g_strconcat (filename, ".paltmp", NULL);
+static void
+pal_input_loaded_free (PalLoadedFile *loaded)
+{
+  if (loaded->hidden != NULL)
+    pal_input_close (loaded->hidden);
+  g_free (loaded->filename);
+  g_free (loaded);
+}
 
-  /* if -x is used and the file isn't a global calendar, expunge */
-  if (settings->expunge > 0 && !pal_input_file_is_global (out_filename))
+/* Returns the loaded file with file_num, or NULL if there isn't one */
+static PalLoadedFile *
+pal_input_get_loaded (gint file_num)
+{
+  guint i;
+
+  for (i = 0; i < pal_input_loaded->len; i++)
     {
-      out_file = fopen (out_filename, "w");
-      if (out_file == NULL)
-        {
-          pal_output_error ("ERROR: Can't write file: %s\n", out_filename);
-          pal_output_error ("       %s\n", "File will not be expunged: %s",                             filename);
-        }
+      PalLoadedFile *loaded = g_ptr_array_index (pal_input_loaded, i);
+      if (loaded->file_num == file_num)
+        return loaded;
     }
 
-  pal_input_skip_comments (file, out_file);
-  event_head = pal_input_read_head (file, out_file, filename);
+  return NULL;
+}
 
-  if (event_head != NULL)
-    {
-      event_head->color = color;
-      event_head->file_num = filecount;
-      event_head->hide = hide;
+/* remembers the file of a job that was added to ht */
+static void
+pal_input_add_loaded (const PalLoadJob *job)
+{
+  PalLoadedFile *loaded = NULL;
 
-      while (1)
-        {
-          GList *days_events = NULL;
-          PalEvent *pal_event = NULL;
+  if (!job->archive)
+    loaded = pal_input_get_loaded (job->filecount);
+
+  if (loaded == NULL)
+    {
+      loaded = g_malloc (sizeof (PalLoadedFile));
+      loaded->filename = g_strdup (job->in->filename);
+      loaded->file_num = job->filecount;
+      loaded->hide = job->hide;
+      loaded->color = job->color;
+      loaded->hidden = NULL;
+      g_ptr_array_add (job->archive ? pal_input_archives : pal_input_loaded,
+                       loaded);
+    }
 
-          pal_input_skip_comments (file, out_file);
-          pal_event = pal_input_read_event (file, out_file, filename,
-                                            event_head, NULL);
+  loaded->arena = job->arena;
+  loaded->mtime = job->mtime;
+  loaded->size = (job->mtime < 0) ? -1 : (gint64)job->in->length;
+  loaded->written = FALSE;
+}
 
-          if (pal_event == NULL && pal_input_eof (file))
-            break;
+/* Parses the queued files on the load thread pool, then adds the
+ * events of each file to ht and prints the messages, in order.
+ * Returns the number of events loaded. */
+static gint
+pal_input_finish_loading (void)
+{
+  gint eventcount = 0;
+  guint i, e;
 
-          if (pal_event != NULL)
-            {
-              gchar *key = pal_event->key;
-              eventcount++;
+  if (pal_input_jobs == NULL)
+    return 0;
 
-              /* if no list exists for that key, make new list */
-              if (g_hash_table_lookup (ht, key) == NULL)
-                {
-                  days_events = NULL;
-                  days_events = g_list_append (days_events, pal_event);
-                  g_hash_table_insert (ht, g_strdup (key), days_events);
-                }
-              else /* else, append to current list */
-                {
-                  days_events = g_hash_table_lookup (ht, key);
-                  days_events = g_list_append (days_events, pal_event);
-                }
-            }
-        }
+  for (i = 0; i < pal_input_jobs->len; i++)
+    {
+      PalLoadJob *job = g_ptr_array_index (pal_input_jobs, i);
+      if (job->in != NULL)
+        g_thread_pool_push (pal_input_pool, job, NULL);
     }
 
-  if (out_file != NULL)
+  g_thread_pool_free (pal_input_pool, FALSE, TRUE);
+  pal_input_pool = NULL;
+
+  for (i = 0; i < pal_input_jobs->len; i++)
     {
-      fclose (out_file);
-      if (rename (out_filename, filename) != 0)
-        pal_output_error ("ERROR: Can't rename %s to %s\n", out_filename,
-                          filename);
+      PalLoadJob *job = g_ptr_array_index (pal_input_jobs, i);
+
+      pal_input_print_messages (job->messages);
+
+      if (job->in != NULL)
+        {
+          for (e = 0; e < job->events->len; e++)
+            pal_event_table_add (ht, g_ptr_array_index (job->events, e));
+          eventcount += job->events->len;
+          pal_event_table_add_arena (ht, job->arena);
+          pal_input_add_loaded (job);
+          g_ptr_array_free (job->events, TRUE);
+          pal_input_close (job->in);
+        }
+
+      g_ptr_array_free (job->messages, TRUE);
+      g_free (job);
     }
 
-  g_free (out_filename);
-  pal_event_free (event_head);
+  g_ptr_array_free (pal_input_jobs, TRUE);
+  pal_input_jobs = NULL;
   return eventcount;
 }
 
@@ -456,7 +1668,7 @@ get_file_to_load (gchar *file, gchar *pal_file, gboolean show_error)
           || g_file_test (file, G_FILE_TEST_IS_DIR))
         {
           if (show_error)
-            pal_output_error ("ERROR: File doesn't exist: %s\n", file);
+            pal_input_conf_error ("ERROR: File doesn't exist: %s\n", file);
           return FALSE;
         }
       else
@@ -483,8 +1695,10 @@ get_file_to_load (gchar *file, gchar *pal_file, gboolean show_error)
           sprintf (other_file, "%s/%s", dirname, file);
           if (show_error)
             {
-              pal_output_error (
-                  "ERROR: Can't find file.  I tried %s and %s.\n",                   other_file, pal_file);
+              pal_input_conf_error (
+                  "ERROR: Can't find file.  I tried %s and %s.\n",
+                  other_file, pal_file);
+              pal_input_finish_loading ();
               exit (1); /* if we don't exit, this error gets buried
                          * when -m is used. */
             }
@@ -517,6 +1731,23 @@ get_file_handle (gchar *filename, gboolean show_error)
   return file;
 }
 
+/* opens a .pal file for reading like get_file_handle.  Returns NULL
+ * if can't read.  pal_input_close() should be called on the result
+ * when done reading the file. */
+static PalInputFile *
+get_input_file (gchar *filename, gboolean show_error)
+{
+  PalInputFile *in = pal_input_open (filename);
+
+  if (settings->verbose)
+    pal_input_conf_note ("Reading: %s\n", filename);
+
+  if (in == NULL && show_error)
+    pal_input_conf_error ("ERROR: Can't read file: %s\n", filename);
+
+  return in;
+}
+
 /* Parse a "file" or "file_hide" line from pal.conf
  * Handles both quoted paths (with spaces) and unquoted paths
  * Returns TRUE if line was parsed successfully
@@ -611,16 +1842,217 @@ parse_file_directive (const gchar *line, gchar *path, gchar *color,
   return TRUE;
 }
 
+/* TRUE if name is the name of an archive of the file named base
+ * (base.yyyy.pal, or name.yyyy.pal if base is name.pal), and then
+ * puts its year in year */
+static gboolean
+pal_input_archive_name (const gchar *name, const gchar *base, gint *year)
+{
+  gsize n = strlen (base);
+  gint i;
+
+  if (g_str_has_suffix (base, ".pal"))
+    n -= 4;
+
+  if (strlen (name) != n + 9 || strncmp (name, base, n) != 0
+      || name[n] != '.' || strcmp (name + n + 5, ".pal") != 0)
+    return FALSE;
+
+  for (i = 1; i <= 4; i++)
+    if (!g_ascii_isdigit (name[n + i]))
+      return FALSE;
+
+  *year = atoi (name + n + 1);
+  return TRUE;
+}
+
+/* Queues the archives of loaded for year and the years after it that
+ * aren't loaded yet, starting the load thread pool first if loading
+ * is FALSE */
+static void
+pal_input_add_archive_jobs (const PalQuery *query, PalLoadedFile *loaded,
+                            gint year, gboolean *loading)
+{
+  gchar *dir = g_path_get_dirname (loaded->filename);
+  gchar *base = g_path_get_basename (loaded->filename);
+  gchar *archive_dir = g_build_filename (dir, "archive", NULL);
+  GDir *archives = g_dir_open (archive_dir, 0, NULL);
+  const gchar *name;
+  guint i;
+
+  while (archives != NULL && (name = g_dir_read_name (archives)) != NULL)
+    {
+      gchar *path;
+      gint archive_year;
+      PalInputFile *in;
+
+      if (!pal_input_archive_name (name, base, &archive_year)
+          || archive_year < year)
+        continue;
+
+      path = g_build_filename (archive_dir, name, NULL);
+      for (i = 0; i < pal_input_archives->len; i++)
+        {
+          PalLoadedFile *archive = g_ptr_array_index (pal_input_archives, i);
+          if (strcmp (archive->filename, path) == 0)
+            break;
+        }
+
+      in = NULL;
+      if (i == pal_input_archives->len)
+        in = get_input_file (path, TRUE);
+      if (in != NULL)
+        {
+          if (!*loading)
+            pal_input_start_loading (query);
+          *loading = TRUE;
+          pal_input_add_job (in, loaded->file_num, loaded->hide,
+                             loaded->color, TRUE);
+        }
+      g_free (path);
+    }
+
+  if (archives != NULL)
+    g_dir_close (archives);
+  g_free (archive_dir);
+  g_free (base);
+  g_free (dir);
+}
+
+/* Loads the archives of the loaded files for year and the years after
+ * it that aren't loaded yet.  It's ht->reach_year, so the archives
+ * are only read once something looks back that far.  The archives of
+ * hidden files that aren't loaded yet wait for them. */
+static void
+pal_input_reach_year (const PalQuery *query, gint year)
+{
+  gboolean loading = FALSE;
+  guint i;
+
+  for (i = 0; pal_input_loaded != NULL && i < pal_input_loaded->len; i++)
+    {
+      PalLoadedFile *loaded = g_ptr_array_index (pal_input_loaded, i);
+      if (loaded->hidden == NULL)
+        pal_input_add_archive_jobs (query, loaded, year, &loading);
+    }
+
+  /* the archives go in front of the events of the files after theirs */
+  if (loading)
+    {
+      pal_input_finish_loading ();
+      pal_event_table_renumber (ht);
+    }
+}
+
+/* Loads the hidden files that load_files left for later, and their
+ * archives for the years reached so far.  It's ht->load_hidden, so
+ * showing just a calendar, which doesn't show hidden events, doesn't
+ * read them. */
+static void
+pal_input_load_hidden (const PalQuery *query)
+{
+  gboolean loading = FALSE;
+  gint64 mtime, size;
+  guint i;
+
+  for (i = 0; pal_input_loaded != NULL && i < pal_input_loaded->len; i++)
+    {
+      PalLoadedFile *loaded = g_ptr_array_index (pal_input_loaded, i);
+      PalInputFile *in = loaded->hidden;
+
+      if (in == NULL)
+        continue;
+      loaded->hidden = NULL;
+
+      /* it is read as it is now */
+      if (loaded->written || !pal_input_stat (loaded->filename, &mtime, &size)
+          || mtime != loaded->mtime || size != loaded->size)
+        {
+          pal_input_close (in);
+          in = get_input_file (loaded->filename, TRUE);
+        }
+
+      if (!loading)
+        pal_input_start_loading (query);
+      loading = TRUE;
+
+      if (in != NULL)
+        pal_input_add_job (in, loaded->file_num, loaded->hide, loaded->color,
+                           FALSE);
+      if (ht->reached_year != G_MAXINT)
+        pal_input_add_archive_jobs (query, loaded, ht->reached_year,
+                                    &loading);
+    }
+
+  if (loading)
+    {
+      pal_input_finish_loading ();
+      pal_event_table_renumber (ht);
+    }
+}
+
+/* Keeps the hidden file in, with the given file_num and color, to be
+ * loaded by pal_input_load_hidden when it's needed */
+static void
+pal_input_add_hidden (PalInputFile *in, gint filecount, gint color)
+{
+  PalLoadedFile *loaded = g_malloc (sizeof (PalLoadedFile));
+
+  loaded->filename = g_strdup (g_strstrip (in->filename));
+  loaded->file_num = filecount;
+  loaded->hide = TRUE;
+  loaded->color = color;
+  loaded->arena = NULL;
+  pal_input_stat (loaded->filename, &loaded->mtime, &loaded->size);
+  loaded->written = FALSE;
+  loaded->hidden = in;
+  g_ptr_array_add (pal_input_loaded, loaded);
+
+  ht->load_hidden = pal_input_load_hidden;
+}
+
+/* Takes the archives that were loaded out of ht, so they are read
+ * again when a year they are for is reached */
+static void
+pal_input_drop_archives (void)
+{
+  guint i;
+
+  for (i = 0; i < pal_input_archives->len; i++)
+    {
+      PalLoadedFile *archive = g_ptr_array_index (pal_input_archives, i);
+      if (archive->arena != NULL)
+        pal_event_table_remove_arena (ht, archive->arena);
+    }
+
+  g_ptr_array_set_size (pal_input_archives, 0);
+  ht->reached_year = G_MAXINT;
+}
+
 /* loads calendar files and settings from a pal.conf file */
-GHashTable *
-load_files (void)
+PalEventTable *
+load_files (const PalQuery *query)
 {
   gchar s[2048];
   gchar text[2048];
   FILE *file = NULL;
-  guint filecount = 0, eventcount = 0;
+  guint filecount = 0, eventcount = 0, named = 0;
+
+  ht = pal_event_table_new ();
+  ht->reach_year = pal_input_reach_year;
 
-  ht = g_hash_table_new (g_str_hash, g_str_equal);
+  /* whatever the watched files did so far is in what is read now */
+  pal_input_watch_drain ();
+
+  if (pal_input_loaded != NULL)
+    g_ptr_array_free (pal_input_loaded, TRUE);
+  pal_input_loaded
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)pal_input_loaded_free);
+  if (pal_input_archives != NULL)
+    g_ptr_array_free (pal_input_archives, TRUE);
+  pal_input_archives
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)pal_input_loaded_free);
+  pal_input_all_loaded = FALSE;
 
   if (settings->verbose)
     {
@@ -702,21 +2134,28 @@ load_files (void)
 
     } /* done opening/creating file */
 
+  pal_input_stat (settings->conf_file, &pal_input_conf_mtime,
+                  &pal_input_conf_size);
+
+  /* the files are queued while pal.conf is read, and parsed on a
+   * thread pool once all of it is, since it can change the days
+   * the events are needed for */
+  pal_input_start_loading (query);
+
   /* if using -p, load that .pal file now. */
   if (settings->pal_file != NULL)
     {
       gchar pal_file[16384];
-      FILE *pal_file_handle = NULL;
+      PalInputFile *in = NULL;
 
+      named++;
       if (!get_file_to_load (settings->pal_file, pal_file, FALSE))
         sprintf (pal_file, "%s", settings->pal_file);
 
-      pal_file_handle = get_file_handle (pal_file, TRUE);
-      if (pal_file_handle != NULL)
+      in = get_input_file (pal_file, TRUE);
+      if (in != NULL)
         {
-          eventcount
-              += load_file (pal_file, pal_file_handle, filecount, FALSE, -1);
-          fclose (pal_file_handle);
+          pal_input_add_job (in, filecount, FALSE, -1, FALSE);
           filecount++;
         }
     }
@@ -733,12 +2172,14 @@ load_files (void)
       gboolean hide = FALSE;
       if (parse_file_directive (s, text, color, &hide))
         {
-          FILE *pal_file_handle = NULL;
+          PalInputFile *in = NULL;
 
           /* skip this line if we're using -p */
           if (settings->pal_file != NULL)
             continue;
 
+          named++;
+
           if (color[0] != '\0')
             {
               if (int_color_of (color) != -1)
@@ -746,26 +2187,31 @@ load_files (void)
 
               if (int_color == -1)
                 {
-                  pal_output_error (
+                  pal_input_conf_error (
                       "ERROR: Invalid color '%s' in file %s.", color,
                       settings->conf_file);
-                  pal_output_error (
-                      "\n       %s %s\n", "Valid colors:",                       "black, red, green, yellow, blue, magenta, cyan, white");
+                  pal_input_conf_error (
+                      "\n       %s %s\n", "Valid colors:",
+                      "black, red, green, yellow, blue, magenta, cyan, white");
                 }
             }
 
           if (get_file_to_load (text, pal_file, TRUE))
             {
-              pal_file_handle = get_file_handle (pal_file, TRUE);
-              if (pal_file_handle != NULL)
+              in = get_input_file (pal_file, TRUE);
+              if (in != NULL)
                 {
                   /* assign events that are the "default" color to
                    * have a color of -1 the output code will apply
                    * the default color to events (since we might not
-                   * have read in what the default color is yet. */
-                  eventcount += load_file (pal_file, pal_file_handle,
-                                           filecount, hide, int_color);
-                  fclose (pal_file_handle);
+                   * have read in what the default color is yet.
+                   * Hidden files wait until something shows their
+                   * events, unless they are to be expunged. */
+                  if (hide && settings->expunge < 1)
+                    pal_input_add_hidden (in, filecount, int_color);
+                  else
+                    pal_input_add_job (in, filecount, hide, int_color,
+                                       FALSE);
                   filecount++;
                 }
             }
@@ -800,10 +2246,11 @@ load_files (void)
           int ec = int_color_of (text);
           if (ec == -1)
             {
-              pal_output_error ("%s\n",
-                                "ERROR: Invalid color '%s' in file %s.",                                 color, settings->conf_file);
-              pal_output_error (
-                  "       %s %s\n", "Valid colors:",                   "black, red, green, yellow, blue, magenta, cyan, white");
+              pal_input_conf_error ("ERROR: Invalid color '%s' in file %s.\n",
+                                    text, settings->conf_file);
+              pal_input_conf_error (
+                  "       %s %s\n", "Valid colors:",
+                  "black, red, green, yellow, blue, magenta, cyan, white");
             }
           else
             settings->event_color = ec;
@@ -826,13 +2273,309 @@ load_files (void)
       /* ignore empty lines or comments */
       else if (*s != '#' && *s != '\0')
         {
-          pal_output_error (
-              "ERROR: Invalid line (File: %s, Line text: %s)\n",               settings->conf_file, s);
+          pal_input_conf_error (
+              "ERROR: Invalid line (File: %s, Line text: %s)\n",
+              settings->conf_file, s);
         }
     }
   fclose (file);
+  pal_input_windowed = pal_main_window (query, &pal_input_first,
+                                        &pal_input_last);
+  eventcount = pal_input_finish_loading ();
+  pal_input_all_loaded = (filecount == named);
+  pal_input_watch_files ();
   if (settings->verbose)
     g_printerr ("Done reading data (%d events, %d files).\n\n", eventcount,
                 filecount);
   return ht;
 }
+
+/* Reads the files loaded by load_files again if they changed, or pal
+ * wrote to them, since they were read, and replaces their events in
+ * ht.  Returns FALSE, without changing ht, if pal.conf changed too or
+ * the files it names aren't the ones that were loaded, so load_files
+ * has to load everything again. */
+gboolean
+pal_input_reload (const PalQuery *query)
+{
+  gint64 mtime, size;
+  gboolean changed = FALSE;
+  guint i;
+
+  if (ht == NULL || pal_input_loaded == NULL
+      || !pal_input_stat (settings->conf_file, &mtime, &size)
+      || mtime != pal_input_conf_mtime || size != pal_input_conf_size
+      || !pal_input_all_loaded)
+    return FALSE;
+
+  pal_input_watch_drain ();
+
+  /* a file that went away changes the file_num of the ones after it */
+  for (i = 0; i < pal_input_loaded->len; i++)
+    {
+      PalLoadedFile *loaded = g_ptr_array_index (pal_input_loaded, i);
+      if (!pal_input_stat (loaded->filename, &mtime, &size))
+        return FALSE;
+    }
+
+  pal_input_start_loading (query);
+
+  for (i = 0; i < pal_input_loaded->len; i++)
+    {
+      PalLoadedFile *loaded = g_ptr_array_index (pal_input_loaded, i);
+      PalInputFile *in;
+
+      /* a hidden file that wasn't needed yet is read when it is */
+      pal_input_stat (loaded->filename, &mtime, &size);
+      if (loaded->hidden != NULL
+          || (!loaded->written && mtime == loaded->mtime
+              && size == loaded->size))
+        continue;
+
+      if (loaded->arena != NULL)
+        pal_event_table_remove_arena (ht, loaded->arena);
+      loaded->arena = NULL;
+      loaded->mtime = mtime;
+      loaded->size = size;
+      loaded->written = FALSE;
+      changed = TRUE;
+
+      in = get_input_file (loaded->filename, TRUE);
+      if (in != NULL)
+        pal_input_add_job (in, loaded->file_num, loaded->hide,
+                           loaded->color, FALSE);
+    }
+
+  pal_input_finish_loading ();
+
+  /* archives are read again, when they are reached, if anything
+   * changed: expunging a file can add to them */
+  for (i = 0; !changed && i < pal_input_archives->len; i++)
+    {
+      PalLoadedFile *archive = g_ptr_array_index (pal_input_archives, i);
+      if (!pal_input_stat (archive->filename, &mtime, &size)
+          || archive->written || mtime != archive->mtime
+          || size != archive->size)
+        changed = TRUE;
+    }
+
+  if (changed)
+    {
+      pal_input_drop_archives ();
+      pal_event_index_clear ();
+      pal_event_table_renumber (ht);
+    }
+
+  return TRUE;
+}
+
+/* tells pal_input_reload that pal wrote to filename */
+void
+pal_input_file_written (const gchar *filename)
+{
+  guint i;
+
+  if (pal_input_loaded == NULL)
+    return;
+
+  for (i = 0; i < pal_input_loaded->len; i++)
+    {
+      PalLoadedFile *loaded = g_ptr_array_index (pal_input_loaded, i);
+      if (strcmp (loaded->filename, filename) == 0)
+        loaded->written = TRUE;
+    }
+
+  for (i = 0; i < pal_input_archives->len; i++)
+    {
+      PalLoadedFile *archive = g_ptr_array_index (pal_input_archives, i);
+      if (strcmp (archive->filename, filename) == 0)
+        archive->written = TRUE;
+    }
+}
+
+#ifdef __linux__
+
+static gint pal_input_watch_fd = -1;
+static GHashTable *pal_input_watch_dirs = NULL;  /* watch -> directory */
+static GHashTable *pal_input_watch_names = NULL; /* the watched files */
+
+/* Adds the directory of filename to the watch, and filename to the
+ * files it looks for in there.  The directory is watched instead of
+ * the file, since editors and pal itself replace a file by renaming
+ * a new one over it. */
+static void
+pal_input_watch_file (const gchar *filename)
+{
+  gchar *dir = g_path_get_dirname (filename);
+  gchar *base = g_path_get_basename (filename);
+  gint wd = inotify_add_watch (pal_input_watch_fd, dir,
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+                                   | IN_DELETE | IN_ATTRIB);
+
+  if (wd >= 0)
+    {
+      gchar *name = g_build_filename (dir, base, NULL);
+      g_hash_table_replace (pal_input_watch_names, name, name);
+      g_hash_table_replace (pal_input_watch_dirs, GINT_TO_POINTER (wd),
+                            g_strdup (dir));
+    }
+
+  g_free (base);
+  g_free (dir);
+}
+
+/* watches pal.conf and the files loaded into ht, if watching */
+static void
+pal_input_watch_files (void)
+{
+  guint i;
+
+  if (pal_input_watch_fd < 0)
+    return;
+
+  g_hash_table_remove_all (pal_input_watch_names);
+  pal_input_watch_file (settings->conf_file);
+  for (i = 0; pal_input_loaded != NULL && i < pal_input_loaded->len; i++)
+    {
+      PalLoadedFile *loaded = g_ptr_array_index (pal_input_loaded, i);
+      pal_input_watch_file (loaded->filename);
+    }
+}
+
+/* Reads the changes that are waiting.  Returns TRUE if one was to a
+ * watched file. */
+static gboolean
+pal_input_watch_read (void)
+{
+  union
+  {
+    struct inotify_event event; /* for the alignment */
+    gchar buf[4096];
+  } events;
+  gboolean changed = FALSE;
+  gssize len;
+
+  while ((len = read (pal_input_watch_fd, events.buf, sizeof (events.buf)))
+         > 0)
+    {
+      gchar *p = events.buf;
+
+      while (p < events.buf + len)
+        {
+          const struct inotify_event *event = (struct inotify_event *)p;
+          const gchar *dir = g_hash_table_lookup (pal_input_watch_dirs,
+                                                  GINT_TO_POINTER (event->wd));
+
+          /* if changes were lost, any of them could have been ours */
+          if (event->mask & IN_Q_OVERFLOW)
+            changed = TRUE;
+          else if (dir != NULL && event->len > 0)
+            {
+              gchar *name = g_build_filename (dir, event->name, NULL);
+              if (g_hash_table_contains (pal_input_watch_names, name))
+                changed = TRUE;
+              g_free (name);
+            }
+
+          p += sizeof (struct inotify_event) + event->len;
+        }
+    }
+
+  return changed;
+}
+
+/* forgets the changes that are waiting */
+static void
+pal_input_watch_drain (void)
+{
+  if (pal_input_watch_fd >= 0)
+    pal_input_watch_read ();
+}
+
+/* Starts watching pal.conf and the calendar files loaded from it for
+ * changes, see pal_input_watch_wait.  The files are watched again
+ * each time they are loaded.  Returns FALSE if files can't be watched
+ * here. */
+gboolean
+pal_input_watch_start (void)
+{
+  if (pal_input_watch_fd >= 0)
+    return TRUE;
+
+  pal_input_watch_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (pal_input_watch_fd < 0)
+    return FALSE;
+
+  pal_input_watch_dirs
+      = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  pal_input_watch_names
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  pal_input_watch_files ();
+  return TRUE;
+}
+
+/* Waits up to timeout milliseconds, or for ever if it is negative,
+ * for one of the watched files to change.  Returns TRUE if one did,
+ * once the files have been quiet for a moment. */
+gboolean
+pal_input_watch_wait (gint timeout)
+{
+  gint64 end = g_get_monotonic_time () + (gint64)timeout * 1000;
+  struct pollfd fd;
+
+  if (pal_input_watch_fd < 0)
+    return FALSE;
+
+  fd.fd = pal_input_watch_fd;
+  fd.events = POLLIN;
+
+  while (poll (&fd, 1, timeout) > 0)
+    {
+      if (pal_input_watch_read ())
+        {
+          /* a sync or an editor can write a few files in a row: wait
+           * until it's done, so they are reloaded together */
+          while (poll (&fd, 1, 100) > 0)
+            pal_input_watch_read ();
+          return TRUE;
+        }
+
+      /* only files that aren't watched changed: wait for the rest of
+       * the timeout */
+      if (timeout > 0)
+        {
+          timeout = (end - g_get_monotonic_time ()) / 1000;
+          if (timeout <= 0)
+            return FALSE;
+        }
+    }
+
+  return FALSE;
+}
+
+#else /* no inotify */
+
+static void
+pal_input_watch_files (void)
+{
+}
+
+static void
+pal_input_watch_drain (void)
+{
+}
+
+gboolean
+pal_input_watch_start (void)
+{
+  return FALSE;
+}
+
+gboolean
+pal_input_watch_wait (gint timeout)
+{
+  (void)timeout; /* Avoid unused warning */
+  return FALSE;
+}
+
+#endif
@@ -21,11 +21,29 @@
  *
  */
 
-GHashTable *load_files (void);
-void pal_input_skip_comments (FILE *file, FILE *out_file);
-PalEvent *pal_input_read_head (FILE *file, FILE *out_file, gchar *filename);
-PalEvent *pal_input_read_event (FILE *file, FILE *out_file, gchar *filename,
-                                PalEvent *event_head, PalEvent *del_event);
-gboolean pal_input_eof (FILE *file);
-void pal_input_skip_comments (FILE *file, FILE *out_file);
+/* a .pal file mapped into memory, read one line at a time */
+typedef struct _PalInputFile
+{
+  gchar *filename;
+  GMappedFile *map;
+  const gchar *data; /* the bytes of the file */
+  gsize length;
+  gsize pos; /* offset of the next line to read */
+  GPtrArray *messages; /* if not NULL, errors are kept here instead of
+                          printed, see pal_input_print_messages */
+} PalInputFile;
+
+PalEventTable *load_files (const PalQuery *query);
+gboolean pal_input_reload (const PalQuery *query);
+void pal_input_file_written (const gchar *filename);
+gboolean pal_input_watch_start (void);
+gboolean pal_input_watch_wait (gint timeout);
+PalInputFile *pal_input_open (const gchar *filename);
+void pal_input_close (PalInputFile *in);
+void pal_input_skip_comments (PalInputFile *in, FILE *out_file);
+PalEvent *pal_input_read_head (PalInputFile *in, FILE *out_file);
+PalEvent *pal_input_read_event (const PalQuery *query, PalInputFile *in,
+                                FILE *out_file, PalEvent *event_head,
+                                PalEvent *del_event);
+gboolean pal_input_eof (PalInputFile *in);
 #endif
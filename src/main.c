@@ -25,6 +25,7 @@
 #include <sys/ioctl.h> /* get # columns for terminal */
 #include <sys/types.h> /* FreeBSD, regex.h needs this */
 #include <time.h>
+#include <unistd.h> /* isatty */
 
 #include <ncurses.h>
 
@@ -40,28 +41,57 @@
 #include "manage.h"
 
 Settings *settings;
-GHashTable *ht; /* ht holds the loaded events */
+PalEventTable *ht; /* ht holds the loaded events */
 FILE *debug_fp = NULL; /* debug log file pointer */
 
 /* prints the events on the dates from the starting_date to
  * starting_date+window */
 static void
-view_range (GDate *starting_date, gint window)
+view_range (PalQuery *query, GDate *starting_date, gint window)
 {
+  PalDate date, end_date;
+  GArray *occurrences;
+  PalOccurrence *items;
+  guint first, after;
   gint i;
 
-  if (settings->reverse_order && window > 0)
-    g_date_add_days (starting_date, window - 1);
+  if (window <= 0)
+    return;
+
+  date = pal_date_from_gdate (starting_date);
+  end_date = pal_date_add_days (date, window - 1);
+  occurrences = get_events_range (query, date, end_date);
+  items = (PalOccurrence *)occurrences->data;
+
+  /* [first, after) are the occurrences on date */
+  first = after = query->settings->reverse_order ? occurrences->len : 0;
+
+  if (query->settings->reverse_order)
+    date = end_date;
 
   for (i = 0; i < window; i++)
     {
-      pal_output_date (starting_date, FALSE, -1);
-
-      if (settings->reverse_order)
-        g_date_subtract_days (starting_date, 1);
+      if (query->settings->reverse_order)
+        {
+          after = first;
+          while (first > 0 && items[first - 1].date.julian == date.julian)
+            first--;
+        }
       else
-        g_date_add_days (starting_date, 1);
+        {
+          first = after;
+          while (after < occurrences->len
+                 && items[after].date.julian == date.julian)
+            after++;
+        }
+
+      pal_output_date_events (query, date, items + first, after - first,
+                              FALSE, -1);
+
+      date = pal_date_add_days (date, query->settings->reverse_order ? -1 : 1);
     }
+
+  g_array_free (occurrences, TRUE);
 }
 
 /* Returns a GDate object for the given key (in_string) */
@@ -387,9 +417,50 @@ get_query_date (gchar *in_string, gboolean show_error)
   return NULL;
 }
 
+/* prints the next n events on or after starting_date, however far
+ * away they are */
+static void
+view_next (PalQuery *query, GDate *starting_date, gint n)
+{
+  PalDate date = pal_date_from_gdate (starting_date);
+  GArray *occurrences = pal_get_next_events (query, date.julian - 1, n);
+  PalOccurrence *items = (PalOccurrence *)occurrences->data;
+  guint first, after;
+
+  /* [first, after) are the occurrences on one date */
+  first = after = query->settings->reverse_order ? occurrences->len : 0;
+
+  for (;;)
+    {
+      if (query->settings->reverse_order)
+        {
+          if (first == 0)
+            break;
+          after = first--;
+          while (first > 0
+                 && items[first - 1].date.julian == items[first].date.julian)
+            first--;
+        }
+      else
+        {
+          if (after == occurrences->len)
+            break;
+          first = after++;
+          while (after < occurrences->len
+                 && items[after].date.julian == items[first].date.julian)
+            after++;
+        }
+
+      pal_output_date_events (query, items[first].date, items + first,
+                              after - first, FALSE, -1);
+    }
+
+  g_array_free (occurrences, TRUE);
+}
+
 /* determines what should be dispalyed if -r, -s, -d are used */
 static void
-view_details (void)
+view_details (PalQuery *query)
 {
   GDate *to_show = settings->query_date;
 
@@ -404,13 +475,27 @@ view_details (void)
       settings->range_days = 365;
     }
 
+  /* if --next is used, show the next events from today or -d */
+  if (settings->next_count > 0 && settings->search_string == NULL)
+    {
+      GDate *starting_date = g_date_new ();
+
+      if (to_show == NULL)
+        pal_date_to_gdate (query->today, starting_date);
+      else
+        *starting_date = *to_show;
+
+      view_next (query, starting_date, settings->next_count);
+      g_date_free (starting_date);
+    }
+
   /* if -r and -s isn't used */
-  if (settings->range_days == 0 && settings->range_neg_days == 0
-      && settings->search_string == NULL)
+  else if (settings->range_days == 0 && settings->range_neg_days == 0
+           && settings->search_string == NULL)
     {
       /* if -d is used, show that day.  Otherwise, show nothing */
       if (to_show != NULL)
-        pal_output_date (to_show, TRUE, -1);
+        pal_output_date (query, to_show, TRUE, -1);
     }
 
   /* if -r or -s is used, show range of dates relative to -d */
@@ -421,7 +506,7 @@ view_details (void)
       if (to_show == NULL) /* if -d isn't used, start from current date */
         {
           starting_date = g_date_new ();
-          g_date_set_time_t (starting_date, time (NULL));
+          pal_date_to_gdate (query->today, starting_date);
         }
       else /* otherwise, start from date specified */
         starting_date = g_memdup2 (to_show, sizeof (GDate));
@@ -429,10 +514,10 @@ view_details (void)
       g_date_subtract_days (starting_date, settings->range_neg_days);
 
       if (settings->search_string == NULL)
-        view_range (starting_date,
+        view_range (query, starting_date,
                     settings->range_neg_days + settings->range_days);
       else
-        pal_search_view (settings->search_string, starting_date,
+        pal_search_view (query, settings->search_string, starting_date,
                          settings->range_neg_days + settings->range_days,
                          FALSE);
 
@@ -440,6 +525,47 @@ view_details (void)
     }
 }
 
+/* Finds the days view_output can show events on, from first to last,
+ * so that load_files can leave out the one-time events and date
+ * ranges that are outside them.  It has to be called once pal.conf
+ * is read, since default_range counts.  Returns FALSE if any event
+ * can be needed, as it can be with -m, -x, -s or --watch. */
+gboolean
+pal_main_window (const PalQuery *query, guint32 *first, guint32 *last)
+{
+  guint32 today = query->today.julian;
+  guint32 date = today;
+
+  if (settings->manage_events || settings->expunge >= 0
+      || settings->search_string != NULL || settings->watch
+      || settings->range_days < 0 || settings->range_neg_days < 0)
+    return FALSE;
+
+  if (settings->query_date != NULL)
+    date = g_date_get_julian (settings->query_date);
+
+  /* -d and -r, or --next */
+  *first = date - settings->range_neg_days;
+  *last = (settings->next_count > 0) ? G_MAXUINT32
+                                     : date + settings->range_days + 1;
+
+  /* the calendar starts up to two weeks before today and shows two
+   * columns of cal_lines weeks, the html one shows cal_lines months
+   * from the start of the month of -d */
+  if (settings->html_out)
+    {
+      *first = MIN (*first, date - 31);
+      *last = MAX (*last, date + 31 * (settings->cal_lines + 1));
+    }
+  else if (settings->cal_lines > 0)
+    {
+      *first = MIN (*first, today - 14);
+      *last = MAX (*last, today + 14 * (settings->cal_lines + 1));
+    }
+
+  return TRUE;
+}
+
 static gint
 parse_arg (gchar **args, gint on_arg, gint total_args)
 {
@@ -465,12 +591,19 @@ parse_arg (gchar **args, gint on_arg, gint total_args)
              "date used with -d. (default: n=0, show nothing)",           0, 16);
       pal_output_wrap (" -r p-n       Display events within p days before "
                           "and n days after today or a date used with -d.",                        0, 16);
+      pal_output_wrap (
+          " --next n     Display the next n events on or after today or a "
+             "date used with -d, however far away they are.",           0, 16);
       pal_output_wrap (
           " -s regex     Search for events matching the regular "
              "expression. Use -r to select range of days to search.",           0, 16);
       pal_output_wrap (
           " -x n         Expunge events that are n or more days old.", 0,
           16);
+      pal_output_wrap (" --archive    With -x, move the events to archive "
+                       "files that are read when a date in their year is "
+                       "shown.",
+                       0, 16);
 
       pal_output_wrap (
           " -c n         Display calendar with n lines. (default: 5)", 0,
@@ -482,6 +615,9 @@ parse_arg (gchar **args, gint on_arg, gint total_args)
                           "files loaded from pal.conf)",                        0, 16);
       pal_output_wrap (
           " -m           Add/Modify/Delete events interactively.", 0, 16);
+      pal_output_wrap (" --watch      Print the output again whenever the "
+                       "calendar files change.",
+                       0, 16);
       pal_output_wrap (
           " --color      Force colors, regardless of terminal type.", 0,
           16);
@@ -539,6 +675,24 @@ parse_arg (gchar **args, gint on_arg, gint total_args)
       return on_arg;
     }
 
+  if (strcmp (*args, "--next") == 0)
+    {
+      args++;
+      on_arg++;
+      if (on_arg > total_args
+          || sscanf (*args, "%d", &(settings->next_count)) != 1
+          || settings->next_count < 1)
+        {
+          settings->next_count = 0;
+          pal_output_error ("%s\n",
+                            "ERROR: Number required after --next argument.");
+          pal_output_error ("       %s\n",
+                            "Use --help for more information.");
+          on_arg--;
+        }
+      return on_arg;
+    }
+
   if (strcmp (*args, "-c") == 0)
     {
       args++;
@@ -598,6 +752,18 @@ parse_arg (gchar **args, gint on_arg, gint total_args)
       return on_arg;
     }
 
+  if (strcmp (*args, "--watch") == 0)
+    {
+      settings->watch = TRUE;
+      return on_arg;
+    }
+
+  if (strcmp (*args, "--archive") == 0)
+    {
+      settings->archive = TRUE;
+      return on_arg;
+    }
+
   if (strcmp (*args, "--color") == 0)
     {
       set_colorize (1);
@@ -731,47 +897,91 @@ parse_arg (gchar **args, gint on_arg, gint total_args)
   return on_arg + 1;
 }
 
-/* used when the pal is finished running and the hashtable entries
- * need to be properly freed */
+/* free the hashtable */
 static void
-hash_table_free_item (gpointer key, gpointer value, gpointer user_data)
+pal_main_ht_free (void)
 {
-  GList *list = (GList *)value;
-  GList *prev = list;
+  pal_event_index_clear ();
 
-  g_free (key);
+  pal_event_table_free (ht);
+  ht = NULL;
+}
 
-  /* free the list for this hashtable key */
-  while (g_list_length (list) != 0)
+/* reload the calendar files that changed into the hashtable, or free
+ * and reload the hashtable and settings from pal.conf and calendar
+ * files if pal.conf changed */
+void
+pal_main_reload (void)
+{
+  PalQuery *query = pal_query_new (pal_date_today ());
+
+  if (settings->verbose)
+    g_printerr ("Reloading events and settings.\n");
+
+  /* only the files that changed are read again, unless pal.conf
+   * changed */
+  if (!pal_input_reload (query))
     {
-      pal_event_free ((PalEvent *)list->data);
-      list = g_list_next (list);
+      pal_main_ht_free ();
+      ht = load_files (query);
     }
-  g_list_free (prev);
+
+  pal_query_free (query);
 }
 
-/* free the hashtable */
+/* prints the calendar and the events asked for, or the html
+ * calendar with --html */
 static void
-pal_main_ht_free (void)
+view_output (PalQuery *query, GDate *today)
 {
-  if (ht != NULL)
+  if (settings->html_out)
     {
-      g_hash_table_foreach (ht, (GHFunc)hash_table_free_item, NULL);
-      g_hash_table_destroy (ht);
-      ht = NULL;
+      pal_html_out (query);
+      fflush (stdout);
+      return;
     }
+
+  if (!settings->cal_on_bottom)
+    {
+      pal_output_cal (query, settings->cal_lines, today);
+      /* print a newline under calendar if we're printing other stuff */
+      if (settings->cal_lines > 0
+          && (settings->range_days > 0 || settings->range_neg_days > 0
+              || settings->next_count > 0
+              || settings->query_date != NULL))
+
+        g_print ("\n");
+    }
+
+  view_details (query); /* prints results of -d,-r,-s */
+
+  if (settings->cal_on_bottom)
+    {
+      /* print a new line over calendar if we've printed other stuff */
+      if (settings->cal_lines > 0
+          && (settings->range_days > 0 || settings->range_neg_days > 0
+              || settings->next_count > 0
+              || settings->query_date != NULL))
+        g_print ("\n");
+
+      pal_output_cal (query, settings->cal_lines, today);
+    }
+
+  fflush (stdout);
 }
 
-/* free, and reload the hashtable and settings from pal.conf and
- * calendar files */
-void
-pal_main_reload (void)
+/* How long --watch waits for the files to change before it checks
+ * if the day changed, in milliseconds: until midnight, but at most
+ * an hour, in case the clock changes in between. */
+static gint
+view_watch_timeout (void)
 {
-  if (settings->verbose)
-    g_printerr ("Reloading events and settings.\n");
+  time_t now = time (NULL);
+  struct tm *tm = localtime (&now);
+  gint seconds = 24 * 3600 - (tm->tm_hour * 3600 + tm->tm_min * 60
+                              + tm->tm_sec);
 
-  pal_main_ht_free ();
-  ht = load_files ();
+  return MIN (seconds, 3600) * 1000;
 }
 
 int
@@ -780,6 +990,7 @@ main (gint argc, gchar **argv)
   const gchar *charset = NULL;
   gint on_arg = 1;
   GDate *today = g_date_new ();
+  PalQuery *query;
 
   g_date_set_time_t (today, time (NULL));
 
@@ -788,6 +999,7 @@ main (gint argc, gchar **argv)
   settings->range_days = 0;
   settings->range_neg_days = 0;
   settings->range_arg = FALSE;
+  settings->next_count = 0;
   settings->search_string = NULL;
   settings->verbose = FALSE;
   settings->mail = FALSE;
@@ -812,6 +1024,8 @@ main (gint argc, gchar **argv)
   settings->conf_file
       = g_strconcat (g_get_home_dir (), "/.pal/pal.conf", NULL);
   settings->show_weeknum = FALSE;
+  settings->watch = FALSE;
+  settings->archive = FALSE;
 
   g_set_print_handler (pal_output_handler);
   g_set_printerr_handler (pal_output_handler);
@@ -840,7 +1054,8 @@ main (gint argc, gchar **argv)
   if (settings->verbose)
     g_printerr ("Character set: %s\n", charset);
 
-  ht = load_files ();
+  query = pal_query_new (pal_date_from_gdate (today));
+  ht = load_files (query);
 
   /* adjust settings if --mail is used */
   if (settings->mail)
@@ -874,39 +1089,40 @@ main (gint argc, gchar **argv)
         }
     }
 
-  if (settings->html_out)
+  if (settings->watch && !pal_input_watch_start ())
     {
-      pal_html_out ();
+      pal_output_error (
+          "ERROR: --watch can't watch files for changes on this system.\n");
+      return 1;
     }
-  else
-    {
 
-      if (!settings->cal_on_bottom)
-        {
-          pal_output_cal (settings->cal_lines, today);
-          /* print a newline under calendar if we're printing other stuff */
-          if (settings->cal_lines > 0
-              && (settings->range_days > 0 || settings->range_neg_days > 0
-                  || settings->query_date != NULL))
+  view_output (query, today);
 
-            g_print ("\n");
-        }
+  /* with --watch, print everything again when the files change or
+   * the day does */
+  while (settings->watch)
+    {
+      gboolean changed = pal_input_watch_wait (view_watch_timeout ());
+      guint32 day = g_date_get_julian (today);
 
-      view_details (); /* prints results of -d,-r,-s */
+      g_date_set_time_t (today, time (NULL));
+      if (!changed && g_date_get_julian (today) == day)
+        continue;
 
-      if (settings->cal_on_bottom)
-        {
-          /* print a new line over calendar if we've printed other stuff */
-          if (settings->cal_lines > 0
-              && (settings->range_days > 0 || settings->range_neg_days > 0
-                  || settings->query_date != NULL))
-            g_print ("\n");
+      pal_query_free (query);
+      query = pal_query_new (pal_date_from_gdate (today));
+      pal_main_reload ();
 
-          pal_output_cal (settings->cal_lines, today);
-        }
+      /* start from the top of a terminal */
+      if (isatty (STDOUT_FILENO))
+        g_print ("\033[H\033[2J");
+      else
+        g_print ("\n");
+      view_output (query, today);
     }
 
   g_date_free (today);
+  pal_query_free (query);
 
   pal_main_ht_free ();
 
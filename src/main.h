@@ -36,6 +36,7 @@ typedef struct _Settings
   gint range_days;      /* print events in the next 'range_days' days */
   gint range_neg_days;  /* print events within 'range_neg_days' days old */
   gboolean range_arg;   /* user started pal with -r */
+  gint next_count;      /* print the next 'next_count' events */
   gchar *search_string; /* regex to search for */
   gboolean verbose;     /* verbose output */
   GDate *query_date;    /* from argument used after -d */
@@ -60,6 +61,8 @@ typedef struct _Settings
   gchar *compact_date_fmt; /* comapct list date format */
   gchar *pal_file;         /* specified one pal file to load instead
                             * of those in pal.conf */
+  gboolean watch;          /* print again when the files change */
+  gboolean archive;        /* -x moves events to archive files */
 } Settings;
 
 typedef struct _PalTime
@@ -68,6 +71,30 @@ typedef struct _PalTime
   gint min;
 } PalTime;
 
+/* A date passed around by value: the julian day (as in GDate, day 1
+ * is January 1st of year 1) with its civil date and weekday filled
+ * in.  See pal_date_from_julian in event.c.  GDate is only needed
+ * for strftime and the like. */
+typedef struct _PalDate
+{
+  guint32 julian;
+  guint16 year;
+  guint8 month;   /* 1 - 12 */
+  guint8 day;     /* 1 - 31 */
+  guint8 weekday; /* 1(mon) -> 7(sun), like GDateWeekday */
+} PalDate;
+
+/* What a query is answered against.  Make one with pal_query_new
+ * once per command or per screen redraw, so that every day it looks
+ * at sees the same "today" (for TODO events and expunging) even if
+ * midnight passes while it runs. */
+typedef struct _PalQuery
+{
+  PalDate today;            /* fixed when the query is made */
+  const Settings *settings; /* settings in effect */
+  GArray *scratch;          /* reused while building year indexes */
+} PalQuery;
+
 typedef enum _PalPeriodic
 {
   PAL_ONCEONLY,
@@ -87,39 +114,144 @@ typedef struct _PalEventType
   gboolean (*valid_string) (const gchar *); /* Returns true if this string is
                                                valid for this event type */
   gboolean (*get_key) (
-      const GDate *,
+      const PalQuery *, PalDate,
       gchar *); /* For the given date, return the key for this event type */
   gchar *(*get_descr) (
-      const GDate *); /* For the given date, return a textual representation */
+      PalDate); /* For the given date, return a textual representation */
+  guint32 (*pack_key) (const gchar *); /* For a valid key string, return
+                                          the date part of its packed key */
+  gint (*get_days) (const PalQuery *, guint32, gint,
+                    guint32 *); /* For the date part of a packed key and a
+                                   year, fill in the julian days with that
+                                   key.  Returns the number of days (at most
+                                   366) */
+  guint32 (*step_day) (const PalQuery *, guint32, guint32,
+                       gint); /* For the date part of a packed key, return
+                                 the nearest julian day with that key after
+                                 the given one (or before it if the last
+                                 argument is negative), or PAL_NO_DAY */
 } PalEventType;
 
 /* See event.c for definition of PalEventTypes */
 extern PalEventType PalEventTypes[];
 extern const gint PAL_NUM_EVENTTYPES; /* number of items in PalEventTypes */
 
+/* Memory for the events of one calendar file, see event.c */
+typedef struct _PalEventArena PalEventArena;
+
+/* The text of an event split at the !yyyy!s in it, which
+ * pal_event_escape replaces with the number of years since yyyy.  The
+ * text between them is copied as it is. */
+typedef struct _PalEventTemplate
+{
+  gsize len;    /* length of the text */
+  guint n_ages; /* number of !yyyy!s in the text */
+  struct
+  {
+    gsize offset; /* where the !yyyy! starts in the text */
+    gint year;    /* yyyy */
+  } ages[];
+} PalEventTemplate;
+
+/* Parts of an event that are only needed to show its details, edit
+ * it or write it back to its file */
+typedef struct _PalEventCold
+{
+  gchar *type;          /* type of event it is (from top of calendar file) */
+  gchar *file_name;     /* name of the file containing this event */
+  gchar *date_string;   /* date string used in the file for this event */
+  gboolean global;      /* TRUE if event is in a global file */
+  PalEventArena *arena; /* the event and its data live in this arena,
+                           NULL if they were allocated with g_malloc */
+  PalEventTemplate *text_template; /* made from the text the first time
+                                      it is escaped, NULL until then */
+} PalEventCold;
+
+#define PAL_NO_DAY 0     /* start_day/end_day of events without a range */
+#define PAL_NO_TIME (-1) /* start_time/end_time of events without one */
+
+/* Everything needed to find, order and mark events on a calendar is
+ * kept inline, so this fits in one 64 byte cache line */
 typedef struct _PalEvent
 {
-  gchar *text;         /* description of event */
-  gunichar start;      /* character used before the day in calendar */
-  gunichar end;        /* character used after the day in calendar */
-  gboolean hide;       /* should the event be hidden on the calendar? */
-  gchar *type;         /* type of event it is (from top of calendar file) */
-  gint file_num;       /* this event was in the file_num-th file loaded */
-  gchar *file_name;    /* name of the file containing this event */
-  gint color;          /* color to be used with this event */
-  GDate *start_date;   /* for recurring events, date event starts on */
-  GDate *end_date;     /* for recurring events, date event ends on */
-  PalTime *start_time; /* 1st time listed in event description */
-  PalTime *end_time;   /* 2nd time listed in event description */
-  gchar *date_string;  /* date string used in the file for this event */
-  gboolean global;     /* TRUE if event is in a global file */
-  gint period_count;   /* How often repeat (default=1) */
-  gchar *key;          /* Key in hash table */
-  PalEventType *eventtype; /* Pointer to eventtype struct */
+  guint32 key;        /* packed key in the hash table, its top byte is the
+                         index of its type in PalEventTypes (see PAL_KEY) */
+  guint32 start_day;  /* for recurring events, julian day event starts on,
+                         PAL_NO_DAY if none */
+  guint32 end_day;    /* for recurring events, julian day event ends on,
+                         PAL_NO_DAY if none */
+  gint period_count;  /* How often repeat (default=1) */
+  gint16 start_time;  /* 1st time listed in event description, minutes
+                         since midnight or PAL_NO_TIME */
+  gint16 end_time;    /* 2nd time listed in event description, minutes
+                         since midnight or PAL_NO_TIME */
+  gint16 color;       /* color to be used with this event */
+  gint16 hide;        /* should the event be hidden on the calendar? */
+  gunichar start;     /* character used before the day in calendar */
+  gunichar end;       /* character used after the day in calendar */
+  gint file_num;      /* this event was in the file_num-th file loaded */
+  gint phase;         /* for events with a range and a period count, the
+                         period number of the periods the event occurs
+                         in, modulo period_count.  Set when added to ht */
+  guint64 sort_key;   /* order on a day, set when added to ht */
+  gchar *text;        /* description of event */
+  PalEventCold *cold; /* the rest of the event */
 } PalEvent;
 
+/* Keys are packed into 32 bits: the index of the event type in
+ * PalEventTypes in the top 8 bits and the date part, from the type's
+ * pack_key function, in the other 24. */
+#define PAL_KEY(type, data) (((guint32)(type) << 24) | (data))
+#define PAL_KEY_TYPE(key) ((key) >> 24)
+#define PAL_KEY_DATA(key) ((key)&0xFFFFFF)
+#define PAL_KEY_NONE G_MAXUINT32 /* marks an unused bucket */
+/* the PalEventType of an event with a valid key */
+#define PAL_EVENT_TYPE(event) (&PalEventTypes[PAL_KEY_TYPE ((event)->key)])
+
+/* The events with the same key and no start and end date, in the
+ * order they were loaded until they are sorted by sort_key */
+typedef struct _PalEventBucket
+{
+  guint32 key;
+  guint n_events;
+  guint size;      /* number of allocated items in events */
+  gboolean sorted; /* FALSE if events isn't in sort_key order yet */
+  PalEvent **events;
+} PalEventBucket;
+
+/* Open addressing hashtable from packed keys to the loaded events */
+typedef struct _PalEventTable
+{
+  PalEventBucket *buckets; /* n_buckets is always a power of two */
+  guint n_buckets;
+  guint n_keys;
+  guint32 type_mask; /* bit i is set if PalEventTypes[i] has events */
+  GPtrArray *arenas; /* arenas of the loaded files, freed with the table */
+  guint n_loose;     /* number of events not in an arena */
+  guint n_events;    /* number of events added, numbers them in sort_key */
+  /* the events with a start and end date, sorted by end_day when
+   * ranged_sorted is TRUE, so the ones that ended can be skipped */
+  PalEvent **ranged;
+  guint n_ranged;
+  guint ranged_size;
+  gboolean ranged_sorted;
+  /* if not NULL, called before events are looked for in a year or the
+   * years after it, so the events kept out of the table until then
+   * (see pal_input_reach_year) can be added.  reached_year is the
+   * earliest year it was called with. */
+  void (*reach_year) (const PalQuery *query, gint year);
+  gint reached_year;
+  /* if not NULL, called once before anything but a calendar marker
+   * looks at the events, to add the hidden ones that were kept out
+   * until then (see pal_input_load_hidden) */
+  void (*load_hidden) (const PalQuery *query);
+} PalEventTable;
+
 extern Settings *settings;
-extern GHashTable *ht; /* ht holds the loaded events */
+extern PalEventTable *ht; /* ht holds the loaded events */
+
+gboolean pal_main_window (const PalQuery *query, guint32 *first,
+                          guint32 *last);
 
 /* Debug logging support */
 extern FILE *debug_fp;
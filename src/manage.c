@@ -35,6 +35,7 @@
 #include "del.h"
 #include "edit.h"
 #include "event.h"
+#include "input.h"
 #include "output.h"
 #include "rl.h"
 #include "search.h"
@@ -48,6 +49,23 @@ static GDate *today = NULL;
 /* Currently active window for g_print to output to */
 WINDOW *pal_curwin = NULL;
 
+/* writes the julian day in the date format to buf (of 128 bytes), or
+ * "None" if there is no day */
+static void
+pal_manage_day_text (guint32 day, gchar *buf)
+{
+  GDate date;
+
+  if (day == PAL_NO_DAY)
+    {
+      sprintf (buf, "None");
+      return;
+    }
+
+  pal_date_to_gdate (pal_date_from_julian (day), &date);
+  g_date_strftime (buf, 128, settings->date_fmt, &date);
+}
+
 /* Redisplays the main calendar + event list screen.  This function
  * does not clear the first two lines of the screen before
  * drawing---so it will not clear any prompts if they exist.
@@ -60,8 +78,10 @@ pal_manage_refresh_at (void)
 {
   gchar date_text[128];
   gint linecount = 0;
-  GDate *date = g_date_new ();
+  PalDate selected = pal_date_from_gdate (selected_day);
+  PalDate date = selected;
   gint saved_cols;
+  PalQuery *query = pal_query_new (pal_date_today ());
 
   gboolean finished_printing = FALSE;
 
@@ -69,11 +89,9 @@ pal_manage_refresh_at (void)
    * prompts! */
   move (2, 0);
 
-  pal_output_cal (settings->cal_lines, selected_day);
+  pal_output_cal (query, settings->cal_lines, selected_day);
   g_print ("\n");
 
-  memcpy (date, selected_day, sizeof (GDate));
-
   /* If we are viewing a event, screen is split in two to display
    * details. Set this so pal_output_wrap works properly */
   saved_cols = settings->term_cols;
@@ -86,11 +104,34 @@ pal_manage_refresh_at (void)
   gint days_without_events = 0;
   gboolean passed_selected_day = FALSE;
 
+  /* events are fetched 60 days at a time, the most that can be
+   * shown after a day with events */
+  GArray *occurrences = NULL;
+  PalDate chunk_end;
+  guint next = 0;
+
   while (!finished_printing)
     {
       gint thisdaycount = 0;
-      bool isselectedday = (g_date_compare (date, selected_day) == 0);
-      thisdaycount = pal_get_event_count (date);
+      bool isselectedday = (date.julian == selected.julian);
+      guint first;
+
+      if (occurrences == NULL || date.julian > chunk_end.julian)
+        {
+          if (occurrences != NULL)
+            g_array_free (occurrences, TRUE);
+
+          chunk_end = pal_date_add_days (date, 59);
+          occurrences = get_events_range (query, date, chunk_end);
+          next = 0;
+        }
+
+      first = next;
+      while (next < occurrences->len
+             && g_array_index (occurrences, PalOccurrence, next).date.julian
+                    == date.julian)
+        next++;
+      thisdaycount = next - first;
 
       if (linecount > 6)
         settings->term_cols = saved_cols;
@@ -109,8 +150,9 @@ pal_manage_refresh_at (void)
           gint x, y;
           getyx (stdscr, y, x);
 
-          linecount += pal_output_date (date, TRUE,
-                                        isselectedday ? selected_event : -1);
+          linecount += pal_output_date_events (
+              query, date, (PalOccurrence *)occurrences->data + first,
+              thisdaycount, TRUE, isselectedday ? selected_event : -1);
 
           /* if the last thing we printed fell off the screen, erase it */
           if (linecount + settings->cal_lines + 3 > settings->term_rows - 1)
@@ -130,18 +172,17 @@ pal_manage_refresh_at (void)
           days_without_events++;
         }
 
-      g_date_add_days (date, 1);
+      date = pal_date_add_days (date, 1);
 
       /* If we've passed the selected day and gone 60 days without events, stop */
       if (passed_selected_day && days_without_events >= 60)
         finished_printing = TRUE;
     }
-  g_date_free (date);
+  g_array_free (occurrences, TRUE);
 
   /* Draw the event information box if an event is selected */
   if (selected_event >= 0 && events_on_day > 0)
     {
-      GList *events = get_events (selected_day);
       char *ptr = NULL;
       PalEvent *curevent = NULL;
 
@@ -153,13 +194,13 @@ pal_manage_refresh_at (void)
       pal_curwin = subwin (stdscr, 5, saved_cols / 2, settings->cal_lines + 4,
                            saved_cols / 2);
 
-      curevent = g_list_nth_data (events,
-                                  (selected_event >= 0) ? selected_event : 0);
-      g_list_free (events);
+      pal_get_day_events (query, selected,
+                          (selected_event >= 0) ? selected_event : 0,
+                          &curevent, 1);
 
       wmove (pal_curwin, 0, 0);
       pal_output_fg (BRIGHT, GREEN, "Event Type: ");
-      ptr = curevent->eventtype->get_descr (selected_day);
+      ptr = PAL_EVENT_TYPE (curevent)->get_descr (selected);
       pal_output_wrap (ptr, 12, 5);
       g_free (ptr);
 
@@ -167,29 +208,24 @@ pal_manage_refresh_at (void)
       g_print ("%d\n", curevent->period_count);
 
       pal_output_fg (BRIGHT, GREEN, "Start date: ");
-      if (curevent->start_date)
-        g_date_strftime (date_text, 128, settings->date_fmt,
-                         curevent->start_date);
-      else
-        sprintf (date_text, "None");
+      pal_manage_day_text (curevent->start_day, date_text);
       g_print ("%s\n", date_text);
 
       pal_output_fg (BRIGHT, GREEN, "End date:   ");
-      if (curevent->end_date)
-        g_date_strftime (date_text, 128, settings->date_fmt,
-                         curevent->end_date);
-      else
-        sprintf (date_text, "None");
+      pal_manage_day_text (curevent->end_day, date_text);
       g_print ("%s\n", date_text);
 
       pal_output_fg (BRIGHT, GREEN, "Key:        ");
-      g_print ("%s\n", curevent->key);
+      ptr = pal_event_key_string (curevent);
+      g_print ("%s\n", ptr);
+      g_free (ptr);
 
       delwin (pal_curwin);
       pal_curwin = stdscr;
     }
 
   settings->term_cols = saved_cols;
+  pal_query_free (query);
 
   refresh ();
 }
@@ -261,6 +297,7 @@ pal_manage_resize (int sig)
 }
 
 static gboolean isearch_direction;
+static PalQuery *isearch_query;
 
 /* Refresh function for the isearch */
 static void
@@ -283,8 +320,8 @@ pal_manage_isearch_refresh (void)
 
   /* Only search if there is text to search for */
   if (*rl_line_buffer
-      && !pal_search_isearch_event (&searchdate, &searchselect, rl_line_buffer,
-                                    isearch_direction))
+      && !pal_search_isearch_event (isearch_query, &searchdate, &searchselect,
+                                    rl_line_buffer, isearch_direction))
     {
       pal_output_fg (BRIGHT, RED, "No matches found!");
       rl_ding ();
@@ -303,7 +340,7 @@ pal_manage_isearch_refresh (void)
 /* Does a basic interactive search in the given direction. This is different
  * from the full search handled in search.c */
 static void
-pal_manage_isearch (gboolean forward)
+pal_manage_isearch (PalQuery *query, gboolean forward)
 {
   gchar *searchstring = NULL;
   GDate *searchdate = g_date_new ();
@@ -312,6 +349,7 @@ pal_manage_isearch (gboolean forward)
   memcpy (searchdate, selected_day, sizeof (GDate));
 
   isearch_direction = forward;
+  isearch_query = query;
 
   /* Clear the first two lines */
   move (0, 0);
@@ -328,8 +366,8 @@ pal_manage_isearch (gboolean forward)
   /* If the user typed something and we can find event, set selected event */
   if (*searchstring)
     {
-      if (pal_search_isearch_event (&searchdate, &searchselect, rl_line_buffer,
-                                    isearch_direction))
+      if (pal_search_isearch_event (query, &searchdate, &searchselect,
+                                    rl_line_buffer, isearch_direction))
         {
           memcpy (selected_day, searchdate, sizeof (GDate));
           selected_event = searchselect;
@@ -342,58 +380,42 @@ pal_manage_isearch (gboolean forward)
 
 /* Scans for the next event in the given direction */
 static void
-pal_manage_scan_for_event (GDate **date, int *eventnum, int dir)
+pal_manage_scan_for_event (PalQuery *query, GDate **date, int *eventnum,
+                           int dir)
 {
+  guint32 day;
+
   /* Note, the way this code is written handles the case where eventnum is
    * -1. In that case it places on the first event following this date */
   if (dir > 0)
     {
-      int thisdaycount;
-      int count = 0;
-
       (*eventnum)++;
       if (*eventnum < events_on_day)
         return;
-
-      *eventnum = 0;
-      while (count < 60) /* No more than two months */
-        {
-          g_date_add_days (*date, 1);
-          thisdaycount = pal_get_event_count (*date);
-
-          if (thisdaycount > 0)
-            return;
-
-          count++;
-        }
-      rl_ding ();
-      return;
     }
   else
     {
-      int thisdaycount;
-      int count = 0;
-
       (*eventnum)--;
       if (*eventnum >= 0)
         return;
+    }
 
-      while (count < 60) /* No more than two months */
-        {
-          g_date_subtract_days (*date, 1);
-          thisdaycount = pal_get_event_count (*date);
-
-          if (thisdaycount > 0)
-            {
-              *eventnum = thisdaycount - 1;
-              return;
-            }
+  day = pal_get_next_day (query, pal_date_from_gdate (*date).julian, dir,
+                          NULL, NULL);
 
-          count++;
-        }
+  /* no more events that way: stay on the last one seen */
+  if (day == PAL_NO_DAY)
+    {
+      *eventnum = (dir > 0 || events_on_day == 0) ? events_on_day - 1 : 0;
       rl_ding ();
       return;
     }
+
+  pal_date_to_gdate (pal_date_from_julian (day), *date);
+  if (dir > 0)
+    *eventnum = 0;
+  else
+    *eventnum = pal_get_day_count (query, pal_date_from_julian (day)) - 1;
 }
 
 void
@@ -450,6 +472,7 @@ pal_manage (void)
     set_colorize (-2);
 
   pal_manage_refresh ();
+  pal_input_watch_start (); /* redraw when the calendar files change */
 
   move (0, 0);
   pal_output_fg (BRIGHT, GREEN, "pal %s", PAL_VERSION);
@@ -458,9 +481,17 @@ pal_manage (void)
 
   for (;;)
     {
+      PalQuery *query;
       int c;
       while ((c = getch ()) == ERR)
-        ;
+        if (pal_input_watch_wait (0))
+          {
+            pal_main_reload ();
+            pal_manage_refresh ();
+          }
+
+      /* each key press is answered as of the time it was pressed */
+      query = pal_query_new (pal_date_today ());
 
       switch (c)
         {
@@ -488,7 +519,8 @@ pal_manage (void)
           if (selected_event == -1)
             g_date_subtract_days (selected_day, 7);
           else
-            pal_manage_scan_for_event (&selected_day, &selected_event, -1);
+            pal_manage_scan_for_event (query, &selected_day, &selected_event,
+                                       -1);
           pal_manage_refresh ();
           break;
         case KEY_DOWN:
@@ -496,7 +528,8 @@ pal_manage (void)
           if (selected_event == -1)
             g_date_add_days (selected_day, 7);
           else
-            pal_manage_scan_for_event (&selected_day, &selected_event, 1);
+            pal_manage_scan_for_event (query, &selected_day, &selected_event,
+                                       1);
           pal_manage_refresh ();
           break;
 
@@ -512,14 +545,15 @@ pal_manage (void)
 
           else /* If no event on current day, scan till we find one
                 */
-            pal_manage_scan_for_event (&selected_day, &selected_event, 1);
+            pal_manage_scan_for_event (query, &selected_day, &selected_event,
+                                       1);
 
           pal_manage_refresh ();
           break;
 
         case 't': /* today */
         case 'T':
-          g_date_set_time_t (selected_day, time (NULL));
+          pal_date_to_gdate (query->today, selected_day);
           pal_manage_refresh ();
           break;
 
@@ -564,11 +598,11 @@ pal_manage (void)
             selected_event = 0;
           if (selected_event != -1)
             {
-              PalEvent *e
-                  = pal_output_event_num (selected_day, selected_event + 1);
+              PalEvent *e = pal_output_event_num (query, selected_day,
+                                                  selected_event + 1);
               if (e != NULL)
                 {
-                  if (e->global)
+                  if (e->cold->global)
                     {
                       move (0, 0);
                       clrtoeol ();
@@ -583,8 +617,8 @@ pal_manage (void)
                           "New description: ", 0, 0, e->text);
 
                       pal_del_write_file (e);
-                      pal_add_write_file (e->file_name, e->date_string,
-                                          new_text);
+                      pal_add_write_file (e->cold->file_name,
+                                          e->cold->date_string, new_text);
                       /* need to check for error here! */
 
                       g_free (new_text);
@@ -606,9 +640,9 @@ pal_manage (void)
         case 'V':
           if (selected_event != -1)
             {
-              pal_edit_event (
-                  pal_output_event_num (selected_day, selected_event + 1),
-                  selected_day);
+              pal_edit_event (pal_output_event_num (query, selected_day,
+                                                    selected_event + 1),
+                              selected_day);
               pal_manage_refresh ();
             }
           break;
@@ -620,19 +654,19 @@ pal_manage (void)
         case 'a': /* add event */
         case 'A':
 
-          pal_add_event (selected_day);
+          pal_add_event (query, selected_day);
           break;
 
         case KEY_DC: /* delete key - kill event */
         case KEY_BACKSPACE:
           if (selected_event != -1)
             {
-              PalEvent *e
-                  = pal_output_event_num (selected_day, selected_event + 1);
+              PalEvent *e = pal_output_event_num (query, selected_day,
+                                                  selected_event + 1);
               if (e != NULL)
                 {
                   move (0, 0);
-                  if (e->global)
+                  if (e->cold->global)
                     pal_output_fg (BRIGHT, RED,
                                    "Can't delete global event!");
                   else
@@ -660,10 +694,10 @@ pal_manage (void)
           break;
 
         case '/': /* forward i-search */
-          pal_manage_isearch (TRUE);
+          pal_manage_isearch (query, TRUE);
           break;
         case '?': /* backward i-search */
-          pal_manage_isearch (FALSE);
+          pal_manage_isearch (query, FALSE);
           break;
 
         case 'H':
@@ -734,5 +768,7 @@ pal_manage (void)
 
           break;
         }
+
+      pal_query_free (query);
     }
 }
@@ -103,40 +103,32 @@ pal_output_error (char *formatString, ...)
   va_end (argptr);
 }
 
-/* finishes with date on the sunday of the next week */
-static void
-pal_output_text_week (GDate *date, gboolean force_month_label,
-                      const GDate *today)
+/* prints the week that date is in.  Returns the first day of the
+ * next week. */
+static PalDate
+pal_output_text_week (PalQuery *query, PalDate date,
+                      gboolean force_month_label, PalDate today)
 {
   gint i = 0;
+  PalDate week_end;
+  PalDate week_start;
 
-  if (settings->week_start_monday)
-    /* go to last day in week (sun) */
-    while (g_date_get_weekday (date) != 7)
-      g_date_add_days (date, 1);
-  else
-    /* go to last day in week (sat) */
-    while (g_date_get_weekday (date) != 6)
-      g_date_add_days (date, 1);
-
-  for (i = 0; i < 7; i++)
-    {
-      if (g_date_get_day (date) == 1)
-        force_month_label = TRUE;
-
-      g_date_subtract_days (date, 1);
-    }
+  /* go to last day in week (sun or sat) */
+  week_end = pal_date_add_days (
+      date, ((settings->week_start_monday ? 7 : 6) - date.weekday + 7) % 7);
+  week_start = pal_date_add_days (week_end, -6);
 
-  g_date_add_days (date, 1);
-  /* date is now at beginning of week */
+  /* the week has the 1st of a month in it */
+  if (week_end.day <= 7)
+    force_month_label = TRUE;
 
   if (force_month_label)
     {
       gchar buf[1024];
+      GDate gdate;
 
-      g_date_add_days (date, 6);
-      g_date_strftime (buf, 128, "%b", date);
-      g_date_subtract_days (date, 6);
+      pal_date_to_gdate (week_end, &gdate);
+      g_date_strftime (buf, 128, "%b", &gdate);
 
       /* make sure we're only showing 3 characters */
       if (g_utf8_strlen (buf, -1) != 3)
@@ -153,84 +145,36 @@ pal_output_text_week (GDate *date, gboolean force_month_label,
     }
   else if (settings->show_weeknum)
     {
-      gint weeknum = settings->week_start_monday
-                         ? g_date_get_monday_week_of_year (date)
-                         : g_date_get_sunday_week_of_year (date);
+      GDate gdate;
+      gint weeknum;
+
+      pal_date_to_gdate (week_start, &gdate);
+      weeknum = settings->week_start_monday
+                    ? g_date_get_monday_week_of_year (&gdate)
+                    : g_date_get_sunday_week_of_year (&gdate);
       pal_output_fg (BRIGHT, GREEN, " %2d ", weeknum);
     }
 
   else
     g_print ("    ");
 
+  date = week_start;
+
   for (i = 0; i < 7; i++)
     {
-      GList *events = NULL;
       gunichar start = ' ', end = ' ';
       gchar utf8_buf[8];
       gint color = settings->event_color;
-      events = get_events (date);
+      PalMarker marker;
 
-      if (g_date_compare (date, today) == 0)
+      if (date.julian == today.julian)
         start = end = '@';
 
-      else if (events != NULL)
+      else if (pal_get_day_marker (query, date, &marker))
         {
-          GList *item = g_list_first (events);
-          PalEvent *event = (PalEvent *)item->data;
-
-          gboolean same_char = TRUE;
-          gboolean same_color = TRUE;
-
-          /* skip to a event that isn't hidden or to the end of the list */
-          while (g_list_length (item) > 1 && event->hide)
-            {
-              item = g_list_next (item);
-              event = (PalEvent *)item->data;
-            }
-
-          /* save the markers for the event */
-          if (event->hide)
-            start = ' ', end = ' ';
-          else
-            {
-              start = event->start;
-              end = event->end;
-              color = event->color;
-            }
-
-          /* if multiple events left */
-          while (g_list_length (item) > 1)
-            {
-              item = g_list_next (item);
-              event = (PalEvent *)item->data;
-
-              /* find next non-hidden event */
-              while (g_list_length (item) > 1 && event->hide)
-                {
-                  item = g_list_next (item);
-                  event = (PalEvent *)item->data;
-                }
-
-              /* if this event is hidden, there aren't any more non-hidden
-               * events left */
-              /* if this event isn't hidden, then determine if it has different
-               * markers */
-              if (!event->hide)
-                {
-                  gunichar new_start = event->start;
-                  gunichar new_end = event->end;
-                  gint new_color = event->color;
-
-                  if (new_start != start || new_end != end)
-                    same_char = FALSE;
-                  if (new_color != color)
-                    same_color = FALSE;
-                }
-              if (same_char == FALSE)
-                start = '*', end = '*';
-              if (same_color == FALSE)
-                color = -1;
-            }
+          start = marker.start;
+          end = marker.end;
+          color = marker.color;
         }
 
       utf8_buf[g_unichar_to_utf8 (start, utf8_buf)] = '\0';
@@ -246,10 +190,10 @@ pal_output_text_week (GDate *date, gboolean force_month_label,
       else
         g_print ("%s", utf8_buf);
 
-      if (g_date_compare (date, today) == 0) /* make today bright */
-        pal_output_attr (BRIGHT, "%02d", g_date_get_day (date));
+      if (date.julian == today.julian) /* make today bright */
+        pal_output_attr (BRIGHT, "%02d", date.day);
       else
-        g_print ("%02d", g_date_get_day (date));
+        g_print ("%02d", date.day);
 
       utf8_buf[g_unichar_to_utf8 (end, utf8_buf)] = '\0';
 
@@ -268,47 +212,48 @@ pal_output_text_week (GDate *date, gboolean force_month_label,
       if (i != 6)
         g_print (" ");
 
-      g_date_add_days (date, 1);
-      g_list_free (events);
+      date = pal_date_add_days (date, 1);
     }
+
+  return date;
 }
 
-static void
-pal_output_week (GDate *date, gboolean force_month_label, const GDate *today)
+/* prints the week that date is in, and the one cal_lines weeks later
+ * in the second column.  Returns the first day of the next week. */
+static PalDate
+pal_output_week (PalQuery *query, PalDate date, gboolean force_month_label,
+                 PalDate today)
 {
-
-  pal_output_text_week (date, force_month_label, today);
+  PalDate next
+      = pal_output_text_week (query, date, force_month_label, today);
 
   if (!settings->no_columns && settings->term_cols >= 77)
     {
       pal_output_fg (DIM, YELLOW, "%s", "|");
 
       /* skip ahead to next column */
-      g_date_subtract_days (date, 6);
-      g_date_add_days (date, settings->cal_lines * 7);
-      pal_output_text_week (date, force_month_label, today);
-
-      /* skip back to where we were */
-      g_date_subtract_days (date, settings->cal_lines * 7);
+      pal_output_text_week (
+          query, pal_date_add_days (next, settings->cal_lines * 7 - 6),
+          force_month_label, today);
     }
 
   if (settings->term_cols != 77)
     g_print ("\n");
+
+  return next;
 }
 
 void
-pal_output_cal (gint num_lines, const GDate *today)
+pal_output_cal (PalQuery *query, gint num_lines, const GDate *today)
 {
   gint on_week = 0;
   gchar *week_hdr = NULL;
-  GDate *date = NULL;
+  PalDate day = pal_date_from_gdate (today);
+  PalDate date = day;
 
   if (num_lines <= 0)
     return;
 
-  date = g_date_new ();
-  memcpy (date, today, sizeof (GDate));
-
   if (settings->week_start_monday)
     week_hdr = g_strdup ("Mo   Tu   We   Th   Fr   Sa   Su");
   else
@@ -316,7 +261,7 @@ pal_output_cal (gint num_lines, const GDate *today)
 
   /* if showing enough lines, show previous week. */
   if (num_lines > 3)
-    g_date_subtract_days (date, 7);
+    date = pal_date_add_days (date, -7);
 
   if (settings->no_columns || settings->term_cols < 77)
     pal_output_fg (BRIGHT, GREEN, "     %s\n", week_hdr);
@@ -332,14 +277,9 @@ pal_output_cal (gint num_lines, const GDate *today)
 
   while (on_week < num_lines)
     {
-      if (on_week == 0)
-        pal_output_week (date, TRUE, today);
-      else
-        pal_output_week (date, FALSE, today);
-
+      date = pal_output_week (query, date, on_week == 0, day);
       on_week++;
     }
-  g_date_free (date);
 }
 
 /* replaces tabs with spaces */
@@ -467,17 +407,19 @@ pal_output_wrap (gchar *string, gint chars_used, gint indent)
   return numlines;
 }
 
+/* the line pal_output_event builds, reused for every event */
+static GString *pal_output_line = NULL;
+
 /* If event_number is -1, don't number the events.
    Returns the number of lines printed.
 */
 int
-pal_output_event (const PalEvent *event, const GDate *date,
+pal_output_event (const PalEvent *event, PalDate date,
                   const gboolean selected)
 {
   gint numlines = 0;
   gchar date_text[128];
   const gint indent = 2;
-  gchar *event_text = NULL;
   date_text[0] = '\0';
 
   if (selected)
@@ -488,56 +430,50 @@ pal_output_event (const PalEvent *event, const GDate *date,
     pal_output_fg (BRIGHT, event->color, "%s ", "*");
 
   pal_output_strip_tabs (event->text);
-  pal_output_strip_tabs (event->type);
+  pal_output_strip_tabs (event->cold->type);
 
-  event_text = pal_event_escape (event, date);
+  if (pal_output_line == NULL)
+    pal_output_line = g_string_new (NULL);
+  g_string_truncate (pal_output_line, 0);
+  if (!settings->hide_event_type)
+    {
+      g_string_append (pal_output_line, event->cold->type);
+      g_string_append (pal_output_line, ": ");
+    }
+  pal_event_escape_to (pal_output_line, event, date);
 
   if (settings->compact_list)
     {
-      gchar *s = NULL;
-      g_date_strftime (date_text, 128, settings->compact_date_fmt, date);
-      pal_output_attr (BRIGHT, "%s ", date_text);
+      GDate gdate;
 
-      if (settings->hide_event_type)
-        s = g_strconcat (event_text, NULL);
-      else
-        s = g_strconcat (event->type, ": ", event_text, NULL);
+      pal_date_to_gdate (date, &gdate);
+      g_date_strftime (date_text, 128, settings->compact_date_fmt, &gdate);
+      pal_output_attr (BRIGHT, "%s ", date_text);
 
       numlines += pal_output_wrap (
-          s, indent + g_utf8_strlen (date_text, -1) + 1, indent);
-      g_free (s);
+          pal_output_line->str, indent + g_utf8_strlen (date_text, -1) + 1,
+          indent);
     }
   else
-    {
-      if (settings->hide_event_type)
-        numlines += pal_output_wrap (event_text, indent, indent);
-      else
-        {
-          gchar *s = g_strconcat (event->type, ": ", event_text, NULL);
-          numlines += pal_output_wrap (s, indent, indent);
-          g_free (s);
-        }
-    }
-  g_free (event_text);
+    numlines += pal_output_wrap (pal_output_line->str, indent, indent);
 
   return numlines;
 }
 
 void
-pal_output_date_line (const GDate *date)
+pal_output_date_line (const PalQuery *query, PalDate date)
 {
   gchar pretty_date[128];
   gint diff = 0;
+  GDate gdate;
 
-  GDate *today = g_date_new ();
-  g_date_set_time_t (today, time (NULL));
-
-  g_date_strftime (pretty_date, 128, settings->date_fmt, date);
+  pal_date_to_gdate (date, &gdate);
+  g_date_strftime (pretty_date, 128, settings->date_fmt, &gdate);
 
   pal_output_attr (BRIGHT, "%s", pretty_date);
   g_print (" - ");
 
-  diff = g_date_days_between (today, date);
+  diff = (gint)date.julian - (gint)query->today.julian;
   if (diff == 0)
     pal_output_fg (BRIGHT, RED, "%s", "Today");
   else if (diff == 1)
@@ -550,48 +486,42 @@ pal_output_date_line (const GDate *date)
     g_print ("%d days ago", -1 * diff);
 
   g_print ("\n");
-
-  g_date_free (today);
 }
 
-/* outputs the events in the order of PalEvent->file_num.
+/* outputs the num_events occurrences given, which must all be on
+   "date", in the order of PalEvent->file_num.
    Returns the number of lines printed. */
 int
-pal_output_date (GDate *date, gboolean show_empty_days, int selected_event)
+pal_output_date_events (const PalQuery *query, PalDate date,
+                        const PalOccurrence *occurrences, gint num_events,
+                        gboolean show_empty_days, int selected_event)
 {
   gint numlines = 0;
-  GList *events = get_events (date);
-  gint num_events = g_list_length (events);
 
-  if (events != NULL || show_empty_days)
+  if (num_events > 0 || show_empty_days)
     {
-      GList *item = NULL;
       int i;
 
       if (!settings->compact_list)
         {
-          pal_output_date_line (date);
+          pal_output_date_line (query, date);
           numlines++;
         }
 
-      item = g_list_first (events);
-
       for (i = 0; i < num_events; i++)
-        {
-          numlines += pal_output_event ((PalEvent *)(item->data), date,
-                                        i == selected_event);
-
-          item = g_list_next (item);
-        }
+        numlines += pal_output_event (occurrences[i].event, date,
+                                      i == selected_event);
 
       if (num_events == 0)
         {
           if (settings->compact_list)
             {
               gchar pretty_date[128];
+              GDate gdate;
 
+              pal_date_to_gdate (date, &gdate);
               g_date_strftime (pretty_date, 128, settings->compact_date_fmt,
-                               date);
+                               &gdate);
               pal_output_attr (BRIGHT, "  %s ", pretty_date);
               g_print ("%s\n", "No events.");
 
@@ -614,15 +544,32 @@ pal_output_date (GDate *date, gboolean show_empty_days, int selected_event)
   return numlines;
 }
 
+/* same as pal_output_date_events, but looks up the events itself.
+   Returns the number of lines printed. */
+int
+pal_output_date (PalQuery *query, GDate *date, gboolean show_empty_days,
+                 int selected_event)
+{
+  PalDate day = pal_date_from_gdate (date);
+  GArray *occurrences = get_events_range (query, day, day);
+  gint numlines = pal_output_date_events (
+      query, day, (PalOccurrence *)occurrences->data, occurrences->len,
+      show_empty_days, selected_event);
+
+  g_array_free (occurrences, TRUE);
+  return numlines;
+}
+
 /* returns the PalEvent for the given event_number */
 PalEvent *
-pal_output_event_num (const GDate *date, gint event_number)
+pal_output_event_num (PalQuery *query, const GDate *date, gint event_number)
 {
-  GList *events = get_events (date);
-  gint num_events = g_list_length (events);
+  PalEvent *event = NULL;
 
-  if (events == NULL || event_number < 1 || event_number > num_events)
+  if (event_number < 1)
     return NULL;
 
-  return (PalEvent *)g_list_nth_data (events, event_number - 1);
+  pal_get_day_events (query, pal_date_from_gdate (date), event_number - 1,
+                      &event, 1);
+  return event;
 }
@@ -24,6 +24,7 @@
 #include "main.h"
 
 #include "colorize.h"
+#include "event.h"
 
 void pal_output_handler (const gchar *instr);
 
@@ -31,10 +32,16 @@ void pal_output_attr (gint attr, gchar *formatString, ...);
 void pal_output_fg (gint attr, gint color, gchar *formatString, ...);
 void pal_output_error (char *formatString, ...);
 
-void pal_output_cal (gint num_weeks, const GDate *today);
-int pal_output_date (GDate *date, gboolean show_empty_days, gint select_event);
-void pal_output_date_line (const GDate *date);
-int pal_output_event (const PalEvent *event, const GDate *date, const gboolean selected);
+void pal_output_cal (PalQuery *query, gint num_weeks, const GDate *today);
+int pal_output_date (PalQuery *query, GDate *date, gboolean show_empty_days,
+                     gint select_event);
+int pal_output_date_events (const PalQuery *query, PalDate date,
+                            const PalOccurrence *occurrences,
+                            gint num_events, gboolean show_empty_days,
+                            gint select_event);
+void pal_output_date_line (const PalQuery *query, PalDate date);
+int pal_output_event (const PalEvent *event, PalDate date, const gboolean selected);
 int pal_output_wrap (gchar *string, gint chars_used, gint indent);
-PalEvent *pal_output_event_num (const GDate *date, gint event_number);
+PalEvent *pal_output_event_num (PalQuery *query, const GDate *date,
+                                gint event_number);
 #endif
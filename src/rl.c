@@ -239,7 +239,7 @@ pal_rl_get_y_n (const char *prompt)
 
 /* d gets filled in with GDate entered by the user to find the PalEvent. */
 PalEvent *
-pal_rl_get_event (GDate **d, gboolean allow_global)
+pal_rl_get_event (PalQuery *query, GDate **d, gboolean allow_global)
 {
   gchar *s = NULL;
   PalEvent *event = NULL;
@@ -262,15 +262,12 @@ pal_rl_get_event (GDate **d, gboolean allow_global)
           gint event_num = -1;
 
           g_print ("\n");
-          pal_output_date (*d, TRUE, -1);
+          pal_output_date (query, *d, TRUE, -1);
           g_print ("\n");
 
-          { /* Don't allow user select a day without events on it */
-            GList *events = get_events (*d);
-            gint num_events = g_list_length (events);
-            if (num_events == 0)
-              continue;
-          }
+          /* Don't allow user select a day without events on it */
+          if (pal_get_event_count (query, *d) == 0)
+            continue;
 
           while (1)
             {
@@ -281,15 +278,15 @@ pal_rl_get_event (GDate **d, gboolean allow_global)
 
               s = pal_rl_get_line ("Select event number: ",                                    settings->term_rows - 2, 0);
               if (strcmp (s, "0") == 0)
-                return pal_rl_get_event (d, allow_global);
+                return pal_rl_get_event (query, d, allow_global);
 
               if (sscanf (s, "%i", &event_num) != 1)
                 continue;
 
-              event = pal_output_event_num (*d, event_num);
+              event = pal_output_event_num (query, *d, event_num);
               if (event != NULL)
                 {
-                  if (!event->global || allow_global)
+                  if (!event->cold->global || allow_global)
                     return event;
 
                   pal_output_fg (BRIGHT, RED, "> ");
@@ -307,9 +304,9 @@ pal_rl_get_event (GDate **d, gboolean allow_global)
           gchar *search_string = g_strdup (s);
           gint event_num = -1;
           GDate *date = g_date_new ();
-          g_date_set_time_t (date, time (NULL));
+          pal_date_to_gdate (query->today, date);
 
-          if (pal_search_view (search_string, date, 365, TRUE) == 0)
+          if (pal_search_view (query, search_string, date, 365, TRUE) == 0)
             continue;
 
           while (1)
@@ -321,16 +318,16 @@ pal_rl_get_event (GDate **d, gboolean allow_global)
 
               s = pal_rl_get_line ("Select event number: ",                                    settings->term_rows - 2, 0);
               if (strcmp (s, "0") == 0)
-                return pal_rl_get_event (d, allow_global);
+                return pal_rl_get_event (query, d, allow_global);
 
               if (sscanf (s, "%i", &event_num) != 1)
                 continue;
 
-              event = pal_search_event_num (event_num, d, search_string, date,
-                                            365);
+              event = pal_search_event_num (query, event_num, d,
+                                            search_string, date, 365);
               if (event != NULL)
                 {
-                  if (!event->global || allow_global)
+                  if (!event->cold->global || allow_global)
                     return event;
 
                   pal_output_fg (BRIGHT, RED, "> ");
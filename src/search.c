@@ -27,80 +27,79 @@
 #include "output.h"
 #include "search.h"
 
-/* returns a list of the events matching the 'search' string.  'date'
- * is the starting date.  'window' is the number of days from the
- * starting date to search.
- *
- * The returned list alternates between GDate and PalEvent pointers.
- * The GDate pointer allows the caller to determine the date the event
- * was found on (because the event could be recurring and happen
- * multiple times).  The GDate pointers in the list should be freed.
- * The PalEvent pointers should not be freed.
+/* returns an array of PalOccurrence for the events matching the
+ * 'search' string.  'date' is the starting date.  'window' is the
+ * number of days from the starting date to search.  The date of each
+ * occurrence is the date the event was found on (because the event
+ * could be recurring and happen multiple times).  The array should be
+ * freed with g_array_free (array, TRUE), but not the events in it.
  */
 
-static GList *
-pal_search_get_results (const gchar *search, const GDate *date,
-                        const gint window)
+static GArray *
+pal_search_get_results (PalQuery *query, const gchar *search,
+                        const GDate *date, const gint window)
 {
   regex_t preg;
-  gint i, j;
-  GList *hit_list = NULL;
-  GDate *searchdate = g_date_new ();
+  GArray *hits = g_array_new (FALSE, FALSE, sizeof (PalOccurrence));
+  PalDate start;
+  GArray *occurrences;
+  PalOccurrence *items;
+  guint after;
 
-  memcpy (searchdate, date, sizeof (GDate));
+  if (window <= 0)
+    return hits;
 
-  if (settings->reverse_order && window > 0)
-    g_date_add_days (searchdate, window - 1);
+  start = pal_date_from_gdate (date);
+  occurrences
+      = get_events_range (query, start, pal_date_add_days (start, window - 1));
+  items = (PalOccurrence *)occurrences->data;
 
   regcomp (&preg, search, REG_ICASE | REG_NOSUB);
 
-  for (i = 0; i < window; i++)
+  /* With reverse_order the days are listed backwards, so then the
+   * days are visited from the last one, each on its own. */
+  after = occurrences->len;
+  while (after > 0)
     {
-      GList *events = get_events (searchdate);
+      guint first = 0;
+      guint i;
+
+      if (query->settings->reverse_order)
+        for (first = after - 1;
+             first > 0
+             && items[first - 1].date.julian == items[after - 1].date.julian;
+             first--)
+          ;
 
-      if (events != NULL)
+      for (i = first; i < after; i++)
         {
-          GList *item = g_list_first (events);
-          for (j = 0; j < g_list_length (events); j++)
-            {
+          PalEvent *event = items[i].event;
 
-              if (regexec (&preg, ((PalEvent *)(item->data))->text, 0, NULL, 0)
-                      == 0
-                  || regexec (&preg, ((PalEvent *)(item->data))->type, 0, NULL,
-                              0)
-                         == 0)
-                {
-                  GDate *tmp = g_malloc (sizeof (GDate));
-                  memcpy (tmp, searchdate, sizeof (GDate));
-                  hit_list = g_list_append (hit_list, tmp);
-                  hit_list = g_list_append (hit_list, item->data);
-                }
-
-              item = g_list_next (item);
-            }
+          if (regexec (&preg, event->text, 0, NULL, 0) == 0
+              || regexec (&preg, event->cold->type, 0, NULL, 0) == 0)
+            g_array_append_val (hits, items[i]);
         }
 
-      if (settings->reverse_order)
-        g_date_subtract_days (searchdate, 1);
-      else
-        g_date_add_days (searchdate, 1);
+      after = first;
     }
 
   regfree (&preg);
-  return hit_list;
+  g_array_free (occurrences, TRUE);
+  return hits;
 }
 
 /* returns the number of events found */
 int
-pal_search_view (const gchar *search_string, GDate *date, const gint window,
-                 const gboolean number_events)
+pal_search_view (PalQuery *query, const gchar *search_string, GDate *date,
+                 const gint window, const gboolean number_events)
 {
-  GList *hit_list = pal_search_get_results (search_string, date, window);
-  GList *item = NULL;
-  int hit_count = g_list_length (hit_list) / 2;
+  GArray *hits = pal_search_get_results (query, search_string, date, window);
+  PalOccurrence *items = (PalOccurrence *)hits->data;
+  int hit_count = hits->len;
   int event_count = 1;
   gchar start_date[128];
   gchar end_date[128];
+  guint i;
 
   g_date_strftime (start_date, 128, settings->date_fmt, date);
   g_date_add_days (date, (window > 0) ? window - 1 : window);
@@ -111,56 +110,28 @@ pal_search_view (const gchar *search_string, GDate *date, const gint window,
       BRIGHT,
       "[ Begin search results: %s ]\n[ From %s to %s inclusive ]\n\n",       search_string, start_date, end_date);
 
-  item = g_list_first (hit_list);
-
-  while (g_list_length (item) != 0)
+  for (i = 0; i < hits->len; i++)
     {
-      PalEvent *event_tmp = NULL;
-      GDate *date_tmp = NULL;
-      GDate *next_date = NULL;
+      /* the hits on one date are listed under one date line */
+      gboolean first_on_date
+          = (i == 0 || items[i].date.julian != items[i - 1].date.julian);
+      gboolean last_on_date
+          = (i + 1 == hits->len
+             || items[i].date.julian != items[i + 1].date.julian);
 
-      date_tmp = (GDate *)(item->data);
-      item = g_list_next (item);
-      event_tmp = (PalEvent *)(item->data);
-      item = g_list_next (item);
-
-      if (!settings->compact_list)
-        pal_output_date_line (date_tmp);
+      if (first_on_date && !settings->compact_list)
+        pal_output_date_line (query, items[i].date);
 
       if (number_events)
-        pal_output_event (event_tmp, date_tmp, event_count++);
+        pal_output_event (items[i].event, items[i].date, event_count++);
       else
-        pal_output_event (event_tmp, date_tmp, -1);
-
-      if (g_list_length (item) != 0)
-        next_date = (GDate *)item->data;
-
-      while (g_list_length (item) != 0
-             && g_date_compare (next_date, date_tmp) == 0)
-        {
-          g_date_free (date_tmp);
-
-          date_tmp = (GDate *)(item->data);
-          item = g_list_next (item);
-          event_tmp = (PalEvent *)(item->data);
-          item = g_list_next (item);
-
-          if (number_events)
-            pal_output_event (event_tmp, date_tmp, event_count++);
-          else
-            pal_output_event (event_tmp, date_tmp, -1);
-
-          if (g_list_length (item) != 0)
-            next_date = (GDate *)item->data;
-        }
-
-      g_date_free (date_tmp);
+        pal_output_event (items[i].event, items[i].date, -1);
 
-      if (!settings->compact_list)
+      if (last_on_date && !settings->compact_list)
         g_print ("\n");
     }
 
-  g_list_free (hit_list);
+  g_array_free (hits, TRUE);
 
   /* no extra newlines when using compact list, so add one here */
   if (settings->compact_list)
@@ -176,84 +147,83 @@ pal_search_view (const gchar *search_string, GDate *date, const gint window,
 }
 
 /* Returns the event 'event_number' from the search.  Stores the date
- * the event occurs on in store_date */
+ * the event occurs on in store_date, which should be freed */
 PalEvent *
-pal_search_event_num (gint event_number, GDate **store_date,
+pal_search_event_num (PalQuery *query, gint event_number, GDate **store_date,
                       const gchar *search_string, const GDate *date,
                       const gint window)
 {
   PalEvent *ret_val = NULL;
-  GList *hit_list = pal_search_get_results (search_string, date, window);
-  gint num_events = g_list_length (hit_list) / 2;
-  GList *tmp = NULL;
+  GArray *hits
+      = pal_search_get_results (query, search_string, date, window);
 
-  if (hit_list == NULL || event_number < 1 || event_number > num_events)
-    return NULL;
-
-  *store_date = (GDate *)g_list_nth_data (hit_list, (event_number - 1) * 2);
-  ret_val = (PalEvent *)g_list_nth_data (hit_list, (event_number - 1) * 2 + 1);
-
-  tmp = g_list_first (hit_list);
-  while (tmp != NULL)
+  if (event_number >= 1 && event_number <= (gint)hits->len)
     {
-      if (*store_date != (GDate *)(tmp->data))
-        g_date_free ((GDate *)(tmp->data));
-      tmp = g_list_next (tmp);
-      tmp = g_list_next (tmp);
+      PalOccurrence *hit
+          = &g_array_index (hits, PalOccurrence, event_number - 1);
+
+      *store_date = g_date_new ();
+      pal_date_to_gdate (hit->date, *store_date);
+      ret_val = hit->event;
     }
 
-  g_list_free (hit_list);
+  g_array_free (hits, TRUE);
 
   return ret_val;
 }
 
+/* TRUE if the casefolded "type: text" of event contains the
+ * casefolded string in data */
+static gboolean
+pal_search_isearch_match (const PalEvent *event, gpointer data)
+{
+  gchar *string = g_strconcat (event->cold->type, ": ", event->text, NULL);
+  gchar *string2 = g_utf8_casefold (string, -1);
+  gboolean match = (strstr (string2, (const gchar *)data) != NULL);
+
+  g_free (string);
+  g_free (string2);
+  return match;
+}
+
 /* A simpler search, just searches for the first event which contains this
  * string. Used by the interactive search in the manage interface. Attempts
  * a semblance of case-insensetivity */
 gboolean
-pal_search_isearch_event (GDate **date, gint *selected, gchar *string,
-                          gboolean forward)
+pal_search_isearch_event (PalQuery *query, GDate **date, gint *selected,
+                          gchar *string, gboolean forward)
 {
-  int i, j;
-  gboolean found = FALSE;
   gchar *searchstring = g_utf8_casefold (string, -1);
+  PalDate start = pal_date_from_gdate (*date);
+  gint dir = forward ? 1 : -1;
+  guint32 day;
+  gboolean found = FALSE;
 
-  /* Search upto a year */
-  for (i = 0; i < 366; i++)
+  /* the first day with a match, the starting day included */
+  day = pal_get_next_day (query, start.julian - dir, dir,
+                          pal_search_isearch_match, searchstring);
+
+  if (day != PAL_NO_DAY)
     {
-      GList *events = get_events (*date);
+      PalDate found_date = pal_date_from_julian (day);
+      gint count = pal_get_day_count (query, found_date);
+      gint i;
 
-      if (events != NULL)
+      for (i = 0; i < count && !found; i++)
         {
-          GList *item = g_list_first (events);
-          for (j = 0; j < g_list_length (events) && !found; j++)
+          PalEvent *event = NULL;
+
+          pal_get_day_events (query, found_date, i, &event, 1);
+          if (pal_search_isearch_match (event, searchstring))
             {
-              gchar *string
-                  = g_strconcat (((PalEvent *)(item->data))->type, ": ",
-                                 ((PalEvent *)(item->data))->text, NULL);
-              gchar *string2 = g_utf8_casefold (string, -1);
-
-              if (strstr (string2, searchstring))
-                {
-                  *selected = j;
-                  found = TRUE;
-                }
-
-              g_free (string);
-              g_free (string2);
-              item = g_list_next (item);
+              *selected = i;
+              found = TRUE;
             }
-          g_list_free (events);
         }
 
-      if (found)
-        break;
-
-      if (forward)
-        g_date_add_days (*date, 1);
-      else
-        g_date_subtract_days (*date, 1);
+      pal_date_to_gdate (found_date, *date);
     }
+
   g_free (searchstring);
   return found;
 }
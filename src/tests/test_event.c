@@ -37,7 +37,8 @@ static bool current_test_passed = true;
 
 // Global variables (normally defined in main.c)
 Settings *settings = NULL;
-GHashTable *ht = NULL;
+static PalQuery *query = NULL;
+PalEventTable *ht = NULL;
 
 // Helper function (normally defined in add.c)
 // Converts numbers to ordinal suffixes: 1→"1st", 2→"2nd", 3→"3rd", etc.
@@ -67,9 +68,9 @@ pal_add_suffix (gint number, gchar *suffix, gint buf_size)
 static void
 setup_test_hashtable (void)
 {
-  if (ht != NULL)
-    g_hash_table_destroy (ht);
-  ht = g_hash_table_new (g_str_hash, g_str_equal);
+  pal_event_table_free (ht);
+  ht = pal_event_table_new ();
+  pal_event_index_clear ();
 }
 
 // Helper to add an event to the hashtable
@@ -78,11 +79,63 @@ add_test_event (const gchar *key, const gchar *text)
 {
   PalEvent *event = pal_event_init ();
   event->text = g_strdup (text);
-  event->key = g_strdup (key);
+  event->key = pal_event_key_pack (key);
 
-  GList *events = g_hash_table_lookup (ht, key);
-  events = g_list_append (events, event);
-  g_hash_table_insert (ht, g_strdup (key), events);
+  pal_event_table_add (ht, event);
+}
+
+// Helper to get the julian day of a date
+static guint32
+test_julian (gint day, gint month, gint year)
+{
+  GDate date;
+  g_date_clear (&date, 1);
+  g_date_set_dmy (&date, day, month, year);
+  return g_date_get_julian (&date);
+}
+
+// Helper to compare pal_event_next_occurrence and
+// pal_event_prev_occurrence with the days get_events puts an event on,
+// for every day of 2023 to 2026.  Returns the number of mismatches.
+static gint
+count_step_mismatches (const gchar *date_string)
+{
+  guint32 first = test_julian (1, 1, 2023);
+  guint32 last = test_julian (31, 12, 2026);
+  PalEvent *event = pal_event_init ();
+  guint32 day, expected;
+  gint mismatches = 0;
+
+  setup_test_hashtable ();
+  event->text = g_strdup ("Step");
+  if (!parse_event (event, date_string))
+    {
+      pal_event_free (event);
+      return -1;
+    }
+  pal_event_table_add (ht, event);
+
+  expected = PAL_NO_DAY;
+  for (day = last; day >= first; day--)
+    {
+      if (expected != PAL_NO_DAY
+          && pal_event_next_occurrence (query, event, day) != expected)
+        mismatches++;
+      if (pal_get_day_count (query, pal_date_from_julian (day)) > 0)
+        expected = day;
+    }
+
+  expected = PAL_NO_DAY;
+  for (day = first; day <= last; day++)
+    {
+      if (expected != PAL_NO_DAY
+          && pal_event_prev_occurrence (query, event, day) != expected)
+        mismatches++;
+      if (pal_get_day_count (query, pal_date_from_julian (day)) > 0)
+        expected = day;
+    }
+
+  return mismatches;
 }
 
 // ============================================================================
@@ -95,15 +148,15 @@ TEST (test_pal_event_init_creates_zeroed_struct)
 
   ASSERT_NOT_NULL (event);
   ASSERT_NULL (event->text);
-  ASSERT_NULL (event->type);
-  ASSERT_NULL (event->start_date);
-  ASSERT_NULL (event->end_date);
-  ASSERT_NULL (event->date_string);
-  ASSERT_NULL (event->start_time);
-  ASSERT_NULL (event->end_time);
-  ASSERT_NULL (event->file_name);
-  ASSERT_NULL (event->key);
-  ASSERT_NULL (event->eventtype);
+  ASSERT_NOT_NULL (event->cold);
+  ASSERT_NULL (event->cold->type);
+  ASSERT_EQ (event->start_day, PAL_NO_DAY);
+  ASSERT_EQ (event->end_day, PAL_NO_DAY);
+  ASSERT_NULL (event->cold->date_string);
+  ASSERT_EQ (event->start_time, PAL_NO_TIME);
+  ASSERT_EQ (event->end_time, PAL_NO_TIME);
+  ASSERT_NULL (event->cold->file_name);
+  ASSERT_EQ (event->key, PAL_KEY_NONE);
   ASSERT_EQ (event->period_count, 1);
 
   pal_event_free (event);
@@ -243,9 +296,8 @@ TEST (test_parse_event_simple_daily)
   PalEvent *event = pal_event_init ();
 
   ASSERT_TRUE (parse_event (event, "DAILY"));
-  ASSERT_NOT_NULL (event->key);
-  ASSERT_STR_EQ (event->key, "DAILY");
-  ASSERT_NOT_NULL (event->eventtype);
+  ASSERT_EQ (event->key, pal_event_key_pack ("DAILY"));
+  ASSERT_TRUE (PAL_EVENT_TYPE (event)->period == PAL_DAILY);
   ASSERT_EQ (event->period_count, 1);
 
   pal_event_free (event);
@@ -256,8 +308,8 @@ TEST (test_parse_event_one_time_date)
   PalEvent *event = pal_event_init ();
 
   ASSERT_TRUE (parse_event (event, "20241225"));
-  ASSERT_STR_EQ (event->key, "20241225");
-  ASSERT_NOT_NULL (event->eventtype);
+  ASSERT_EQ (event->key, pal_event_key_pack ("20241225"));
+  ASSERT_TRUE (PAL_EVENT_TYPE (event)->period == PAL_ONCEONLY);
 
   pal_event_free (event);
 }
@@ -267,13 +319,13 @@ TEST (test_parse_event_weekly)
   PalEvent *event = pal_event_init ();
 
   ASSERT_TRUE (parse_event (event, "MON"));
-  ASSERT_STR_EQ (event->key, "MON");
+  ASSERT_EQ (event->key, pal_event_key_pack ("MON"));
 
   pal_event_free (event);
 
   event = pal_event_init ();
   ASSERT_TRUE (parse_event (event, "FRI"));
-  ASSERT_STR_EQ (event->key, "FRI");
+  ASSERT_EQ (event->key, pal_event_key_pack ("FRI"));
 
   pal_event_free (event);
 }
@@ -284,18 +336,13 @@ TEST (test_parse_event_with_date_range)
 
   // Format: KEY:STARTDATE:ENDDATE
   ASSERT_TRUE (parse_event (event, "DAILY:20240101:20241231"));
-  ASSERT_STR_EQ (event->key, "DAILY");
-  ASSERT_NOT_NULL (event->start_date);
-  ASSERT_NOT_NULL (event->end_date);
+  ASSERT_EQ (event->key, pal_event_key_pack ("DAILY"));
+  ASSERT_TRUE (event->start_day != PAL_NO_DAY);
+  ASSERT_TRUE (event->end_day != PAL_NO_DAY);
 
   // Verify dates parsed correctly
-  ASSERT_EQ (g_date_get_year (event->start_date), 2024);
-  ASSERT_EQ (g_date_get_month (event->start_date), 1);
-  ASSERT_EQ (g_date_get_day (event->start_date), 1);
-
-  ASSERT_EQ (g_date_get_year (event->end_date), 2024);
-  ASSERT_EQ (g_date_get_month (event->end_date), 12);
-  ASSERT_EQ (g_date_get_day (event->end_date), 31);
+  ASSERT_EQ (event->start_day, test_julian (1, 1, 2024));
+  ASSERT_EQ (event->end_day, test_julian (31, 12, 2024));
 
   pal_event_free (event);
 }
@@ -305,10 +352,9 @@ TEST (test_parse_event_with_start_date_only)
   PalEvent *event = pal_event_init ();
 
   ASSERT_TRUE (parse_event (event, "MON:20240101"));
-  ASSERT_NOT_NULL (event->start_date);
-  ASSERT_NOT_NULL (event->end_date); // Should default to year 3000
-
-  ASSERT_EQ (g_date_get_year (event->end_date), 3000);
+  ASSERT_EQ (event->start_day, test_julian (1, 1, 2024));
+  // Should default to year 3000
+  ASSERT_EQ (event->end_day, test_julian (1, 1, 3000));
 
   pal_event_free (event);
 }
@@ -320,7 +366,7 @@ TEST (test_parse_event_with_period_count)
   // Every 3rd day
   ASSERT_TRUE (parse_event (event, "DAILY/3:20240101:20241231"));
   ASSERT_EQ (event->period_count, 3);
-  ASSERT_STR_EQ (event->key, "DAILY");
+  ASSERT_EQ (event->key, pal_event_key_pack ("DAILY"));
 
   pal_event_free (event);
 
@@ -369,31 +415,31 @@ TEST (test_parse_event_various_types)
   // TODO events
   event = pal_event_init ();
   ASSERT_TRUE (parse_event (event, "TODO"));
-  ASSERT_STR_EQ (event->key, "TODO");
+  ASSERT_EQ (event->key, pal_event_key_pack ("TODO"));
   pal_event_free (event);
 
   // Monthly (day of month)
   event = pal_event_init ();
   ASSERT_TRUE (parse_event (event, "00000015"));
-  ASSERT_STR_EQ (event->key, "00000015");
+  ASSERT_EQ (event->key, pal_event_key_pack ("00000015"));
   pal_event_free (event);
 
   // Yearly (month and day)
   event = pal_event_init ();
   ASSERT_TRUE (parse_event (event, "00001225"));
-  ASSERT_STR_EQ (event->key, "00001225");
+  ASSERT_EQ (event->key, pal_event_key_pack ("00001225"));
   pal_event_free (event);
 
   // Easter
   event = pal_event_init ();
   ASSERT_TRUE (parse_event (event, "EASTER"));
-  ASSERT_STR_EQ (event->key, "EASTER");
+  ASSERT_EQ (event->key, pal_event_key_pack ("EASTER"));
   pal_event_free (event);
 
   // Easter with offset
   event = pal_event_init ();
   ASSERT_TRUE (parse_event (event, "EASTER+001"));
-  ASSERT_STR_EQ (event->key, "EASTER+001");
+  ASSERT_EQ (event->key, pal_event_key_pack ("EASTER+001"));
   pal_event_free (event);
 }
 
@@ -405,8 +451,8 @@ TEST (test_pal_event_copy_basic)
 {
   PalEvent *original = pal_event_init ();
   original->text = g_strdup ("Test event");
-  original->type = g_strdup ("Birthday");
-  original->file_name = g_strdup ("/tmp/test.pal");
+  original->cold->type = g_strdup ("Birthday");
+  original->cold->file_name = g_strdup ("/tmp/test.pal");
   original->color = 3;
   original->file_num = 5;
   original->hide = TRUE;
@@ -414,8 +460,9 @@ TEST (test_pal_event_copy_basic)
   PalEvent *copy = pal_event_copy (original);
 
   ASSERT_STR_EQ (copy->text, "Test event");
-  ASSERT_STR_EQ (copy->type, "Birthday");
-  ASSERT_STR_EQ (copy->file_name, "/tmp/test.pal");
+  ASSERT_STR_EQ (copy->cold->type, "Birthday");
+  ASSERT_STR_EQ (copy->cold->file_name, "/tmp/test.pal");
+  ASSERT_TRUE (copy->cold != original->cold);
   ASSERT_EQ (copy->color, 3);
   ASSERT_EQ (copy->file_num, 5);
   ASSERT_EQ (copy->hide, TRUE);
@@ -447,19 +494,13 @@ TEST (test_pal_event_copy_is_deep_copy)
 TEST (test_pal_event_copy_with_dates)
 {
   PalEvent *original = pal_event_init ();
-  original->start_date = g_date_new_dmy (1, 1, 2024);
-  original->end_date = g_date_new_dmy (31, 12, 2024);
+  original->start_day = test_julian (1, 1, 2024);
+  original->end_day = test_julian (31, 12, 2024);
 
   PalEvent *copy = pal_event_copy (original);
 
-  ASSERT_NOT_NULL (copy->start_date);
-  ASSERT_NOT_NULL (copy->end_date);
-  ASSERT_GDATE_EQ (copy->start_date, original->start_date);
-  ASSERT_GDATE_EQ (copy->end_date, original->end_date);
-
-  // Verify deep copy
-  ASSERT_TRUE (copy->start_date != original->start_date);
-  ASSERT_TRUE (copy->end_date != original->end_date);
+  ASSERT_EQ (copy->start_day, test_julian (1, 1, 2024));
+  ASSERT_EQ (copy->end_day, test_julian (31, 12, 2024));
 
   pal_event_free (original);
   pal_event_free (copy);
@@ -468,25 +509,13 @@ TEST (test_pal_event_copy_with_dates)
 TEST (test_pal_event_copy_with_times)
 {
   PalEvent *original = pal_event_init ();
-  original->start_time = g_malloc (sizeof (PalTime));
-  original->start_time->hour = 14;
-  original->start_time->min = 30;
-  original->end_time = g_malloc (sizeof (PalTime));
-  original->end_time->hour = 16;
-  original->end_time->min = 45;
+  original->start_time = 14 * 60 + 30;
+  original->end_time = 16 * 60 + 45;
 
   PalEvent *copy = pal_event_copy (original);
 
-  ASSERT_NOT_NULL (copy->start_time);
-  ASSERT_NOT_NULL (copy->end_time);
-  ASSERT_EQ (copy->start_time->hour, 14);
-  ASSERT_EQ (copy->start_time->min, 30);
-  ASSERT_EQ (copy->end_time->hour, 16);
-  ASSERT_EQ (copy->end_time->min, 45);
-
-  // Verify deep copy
-  ASSERT_TRUE (copy->start_time != original->start_time);
-  ASSERT_TRUE (copy->end_time != original->end_time);
+  ASSERT_EQ (copy->start_time, 14 * 60 + 30);
+  ASSERT_EQ (copy->end_time, 16 * 60 + 45);
 
   pal_event_free (original);
   pal_event_free (copy);
@@ -498,7 +527,7 @@ TEST (test_pal_event_copy_with_times)
 
 TEST (test_pal_event_escape_simple_text)
 {
-  GDate *today = g_date_new_dmy (1, 1, 2024);
+  PalDate today = pal_date_from_dmy (1, 1, 2024);
   PalEvent *event = pal_event_init ();
   event->text = g_strdup ("Simple event text");
 
@@ -508,12 +537,11 @@ TEST (test_pal_event_escape_simple_text)
 
   g_free (result);
   pal_event_free (event);
-  g_date_free (today);
 }
 
 TEST (test_pal_event_escape_age_calculation)
 {
-  GDate *today = g_date_new_dmy (1, 1, 2024);
+  PalDate today = pal_date_from_dmy (1, 1, 2024);
   PalEvent *event = pal_event_init ();
   event->text = g_strdup ("Birthday !2000! years old");
 
@@ -525,12 +553,11 @@ TEST (test_pal_event_escape_age_calculation)
 
   g_free (result);
   pal_event_free (event);
-  g_date_free (today);
 }
 
 TEST (test_pal_event_escape_multiple_ages)
 {
-  GDate *today = g_date_new_dmy (15, 6, 2024);
+  PalDate today = pal_date_from_dmy (15, 6, 2024);
   PalEvent *event = pal_event_init ();
   event->text = g_strdup ("Born !2000!, married !2020!");
 
@@ -544,12 +571,11 @@ TEST (test_pal_event_escape_multiple_ages)
 
   g_free (result);
   pal_event_free (event);
-  g_date_free (today);
 }
 
 TEST (test_pal_event_escape_no_special_markers)
 {
-  GDate *today = g_date_new_dmy (1, 1, 2024);
+  PalDate today = pal_date_from_dmy (1, 1, 2024);
   PalEvent *event = pal_event_init ();
   event->text = g_strdup ("Regular text with !incomplete");
 
@@ -560,11 +586,10 @@ TEST (test_pal_event_escape_no_special_markers)
 
   g_free (result);
   pal_event_free (event);
-  g_date_free (today);
 }
 
 // ============================================================================
-// TEST: get_events (requires hashtable setup)
+// TEST: get_events (query, requires hashtable setup)
 // ============================================================================
 
 TEST (test_get_events_empty_hashtable)
@@ -572,7 +597,7 @@ TEST (test_get_events_empty_hashtable)
   setup_test_hashtable ();
 
   GDate *date = g_date_new_dmy (1, 1, 2024);
-  GList *events = get_events (date);
+  GList *events = get_events (query, date);
 
   ASSERT_NULL (events);
 
@@ -585,7 +610,7 @@ TEST (test_get_events_finds_daily_event)
   add_test_event ("DAILY", "Daily standup");
 
   GDate *date = g_date_new_dmy (15, 6, 2024);
-  GList *events = get_events (date);
+  GList *events = get_events (query, date);
 
   ASSERT_NOT_NULL (events);
   ASSERT_EQ (g_list_length (events), 1);
@@ -604,7 +629,7 @@ TEST (test_get_events_finds_specific_date)
 
   // Should find on Christmas
   GDate *christmas = g_date_new_dmy (25, 12, 2024);
-  GList *events = get_events (christmas);
+  GList *events = get_events (query, christmas);
   ASSERT_NOT_NULL (events);
   ASSERT_EQ (g_list_length (events), 1);
   g_list_free (events);
@@ -612,7 +637,7 @@ TEST (test_get_events_finds_specific_date)
 
   // Should NOT find on other day
   GDate *other = g_date_new_dmy (26, 12, 2024);
-  events = get_events (other);
+  events = get_events (query, other);
   ASSERT_NULL (events);
   g_date_free (other);
 }
@@ -624,19 +649,842 @@ TEST (test_pal_get_event_count)
   add_test_event ("DAILY", "Event 2");
 
   GDate *date = g_date_new_dmy (1, 1, 2024);
-  gint count = pal_get_event_count (date);
+  gint count = pal_get_event_count (query, date);
 
   ASSERT_EQ (count, 2);
 
   g_date_free (date);
 }
 
+TEST (test_get_events_across_year_boundary)
+{
+  setup_test_hashtable ();
+  add_test_event ("20241231", "Old year");
+  add_test_event ("20250101", "New year");
+
+  GDate *date = g_date_new_dmy (31, 12, 2024);
+  GList *events = get_events (query, date);
+  ASSERT_EQ (g_list_length (events), 1);
+  ASSERT_STR_EQ (((PalEvent *)events->data)->text, "Old year");
+  g_list_free (events);
+
+  g_date_add_days (date, 1);
+  events = get_events (query, date);
+  ASSERT_EQ (g_list_length (events), 1);
+  ASSERT_STR_EQ (((PalEvent *)events->data)->text, "New year");
+  g_list_free (events);
+
+  g_date_free (date);
+}
+
+TEST (test_pal_event_index_clear_sees_new_events)
+{
+  setup_test_hashtable ();
+  add_test_event ("DAILY", "Event 1");
+
+  GDate *date = g_date_new_dmy (1, 3, 2024);
+  ASSERT_EQ (pal_get_event_count (query, date), 1);
+
+  add_test_event ("20240301", "Event 2");
+  pal_event_index_clear ();
+  ASSERT_EQ (pal_get_event_count (query, date), 2);
+
+  g_date_free (date);
+}
+
+TEST (test_get_events_range_across_year_boundary)
+{
+  setup_test_hashtable ();
+  add_test_event ("20241230", "Old year");
+  add_test_event ("00000101", "Yearly");
+  add_test_event ("20250101", "New year");
+
+  PalDate start = pal_date_from_dmy (29, 12, 2024);
+  PalDate end = pal_date_from_dmy (2, 1, 2025);
+  GArray *occurrences = get_events_range (query, start, end);
+
+  ASSERT_EQ (occurrences->len, 3);
+  ASSERT_STR_EQ (g_array_index (occurrences, PalOccurrence, 0).event->text,
+                 "Old year");
+  ASSERT_EQ (g_array_index (occurrences, PalOccurrence, 0).date.day, 30);
+  ASSERT_EQ (g_array_index (occurrences, PalOccurrence, 1).date.year, 2025);
+  ASSERT_EQ (g_array_index (occurrences, PalOccurrence, 1).date.julian,
+             g_array_index (occurrences, PalOccurrence, 2).date.julian);
+
+  g_array_free (occurrences, TRUE);
+}
+
+TEST (test_get_events_range_empty)
+{
+  setup_test_hashtable ();
+  add_test_event ("20240301", "Event");
+
+  PalDate start = pal_date_from_dmy (2, 3, 2024);
+  PalDate end = pal_date_from_dmy (1, 3, 2024);
+  GArray *occurrences = get_events_range (query, start, end);
+  ASSERT_EQ (occurrences->len, 0);
+  g_array_free (occurrences, TRUE);
+
+  occurrences = get_events_range (query, end, start);
+  ASSERT_EQ (occurrences->len, 1);
+  g_array_free (occurrences, TRUE);
+
+}
+
+TEST (test_pal_event_key_pack)
+{
+  ASSERT_EQ (pal_event_key_pack ("NOT A KEY"), PAL_KEY_NONE);
+  ASSERT_EQ (PAL_KEY_TYPE (pal_event_key_pack ("TODO")), 0);
+  ASSERT_EQ (PAL_KEY_TYPE (pal_event_key_pack ("EASTER-010")),
+             PAL_NUM_EVENTTYPES - 1);
+  ASSERT_TRUE (pal_event_key_pack ("20250101")
+               != pal_event_key_pack ("20250102"));
+  ASSERT_TRUE (pal_event_key_pack ("*00L3") != pal_event_key_pack ("*01L3"));
+  ASSERT_TRUE (pal_event_key_pack ("EASTER+000")
+               != pal_event_key_pack ("EASTER"));
+  ASSERT_TRUE (pal_event_key_pack ("EASTER+010")
+               != pal_event_key_pack ("EASTER-010"));
+}
+
+TEST (test_pal_event_table_lookup)
+{
+  setup_test_hashtable ();
+  add_test_event ("MON", "Event 1");
+  add_test_event ("MON", "Event 2");
+
+  const PalEventBucket *bucket
+      = pal_event_table_lookup (ht, pal_event_key_pack ("MON"));
+  ASSERT_NOT_NULL (bucket);
+  ASSERT_EQ (bucket->n_events, 2);
+  ASSERT_STR_EQ (bucket->events[1]->text, "Event 2");
+
+  ASSERT_NULL (pal_event_table_lookup (ht, pal_event_key_pack ("TUE")));
+  ASSERT_NULL (pal_event_table_lookup (ht, pal_event_key_pack ("DAILY")));
+}
+
+TEST (test_get_events_easter_in_and_outside_table)
+{
+  setup_test_hashtable ();
+  add_test_event ("EASTER", "Easter");
+  add_test_event ("EASTER-002", "Good Friday");
+
+  GDate *date = g_date_new_dmy (31, 3, 2024);
+  ASSERT_EQ (pal_get_event_count (query, date), 1);
+  g_date_subtract_days (date, 2);
+  ASSERT_EQ (pal_get_event_count (query, date), 1);
+  g_date_free (date);
+
+  /* outside the precomputed table */
+  date = g_date_new_dmy (8, 4, 2300);
+  ASSERT_EQ (pal_get_event_count (query, date), 1);
+  g_date_free (date);
+
+  date = g_date_new_dmy (31, 3, 1850);
+  ASSERT_EQ (pal_get_event_count (query, date), 1);
+  g_date_free (date);
+}
+
+TEST (test_get_events_last_weekday)
+{
+  setup_test_hashtable ();
+  add_test_event ("*00L2", "Last monday");
+
+  /* 2024-02-26 and 2024-09-30 are the last mondays of their months */
+  GDate *date = g_date_new_dmy (26, 2, 2024);
+  ASSERT_EQ (pal_get_event_count (query, date), 1);
+  g_date_set_dmy (date, 19, 2, 2024);
+  ASSERT_EQ (pal_get_event_count (query, date), 0);
+  g_date_set_dmy (date, 30, 9, 2024);
+  ASSERT_EQ (pal_get_event_count (query, date), 1);
+  g_date_free (date);
+}
+
+TEST (test_get_events_sorted_by_time_then_type)
+{
+  const gchar *keys[] = { "DAILY", "DAILY", "20240301", "DAILY", "20240301" };
+  const gint hours[] = { 9, 8, 8, -1, -1 };
+  const gchar *order[] = { "5", "4", "3", "2", "1" };
+  gint i;
+
+  setup_test_hashtable ();
+  for (i = 0; i < 5; i++)
+    {
+      PalEvent *event = pal_event_init ();
+      event->text = g_strdup_printf ("%d", i + 1);
+      event->key = pal_event_key_pack (keys[i]);
+      if (hours[i] >= 0)
+        event->start_time = hours[i] * 60;
+      pal_event_table_add (ht, event);
+    }
+
+  GDate *date = g_date_new_dmy (1, 3, 2024);
+  GList *events = get_events (query, date);
+  GList *item = events;
+  ASSERT_EQ (g_list_length (events), 5);
+  for (i = 0; i < 5 && item != NULL; i++, item = g_list_next (item))
+    ASSERT_STR_EQ (((PalEvent *)item->data)->text, order[i]);
+
+  g_list_free (events);
+  g_date_free (date);
+}
+
+TEST (test_pal_event_copy_to_arena_shares_type)
+{
+  PalEventArena *arena = pal_event_arena_new ();
+  PalEvent *head = pal_event_init ();
+  head->cold->type = g_strdup ("Birthdays");
+  head->cold->file_name = g_strdup ("/tmp/birthdays.pal");
+
+  PalEvent *arena_head = pal_event_copy_to (arena, head);
+  pal_event_free (head);
+
+  PalEvent *a = pal_event_copy (arena_head);
+  PalEvent *b = pal_event_copy (arena_head);
+  ASSERT_TRUE (a->cold->arena == arena);
+  ASSERT_STR_EQ (a->cold->type, "Birthdays");
+  ASSERT_TRUE (a->cold->type == b->cold->type);
+  ASSERT_TRUE (a->cold->file_name == b->cold->file_name);
+
+  /* freeing an event in an arena is left to the arena */
+  pal_event_free (a);
+  ASSERT_STR_EQ (b->cold->type, "Birthdays");
+
+  pal_event_arena_free (arena);
+}
+
+TEST (test_pal_event_table_frees_arena_events)
+{
+  setup_test_hashtable ();
+
+  PalEventArena *arena = pal_event_arena_new ();
+  PalEvent *head = pal_event_init ();
+  PalEvent *event = pal_event_copy_to (arena, head);
+  pal_event_free (head);
+
+  event->text = pal_event_strdup (event, "Arena event");
+  event->key = pal_event_key_pack ("DAILY");
+  pal_event_table_add (ht, event);
+  pal_event_table_add_arena (ht, arena);
+  add_test_event ("DAILY", "Loose event");
+
+  GDate *date = g_date_new_dmy (1, 3, 2024);
+  ASSERT_EQ (pal_get_event_count (query, date), 2);
+  ASSERT_EQ (ht->n_loose, 1);
+  g_date_free (date);
+
+  setup_test_hashtable ();
+}
+
+TEST (test_pal_event_key_string)
+{
+  PalEvent *event = pal_event_init ();
+  gchar *key;
+
+  ASSERT_NULL (pal_event_key_string (event));
+
+  event->cold->date_string = g_strdup ("DAILY/2:20240101:20241231");
+  key = pal_event_key_string (event);
+  ASSERT_STR_EQ (key, "DAILY");
+  g_free (key);
+  g_free (event->cold->date_string);
+
+  event->cold->date_string = g_strdup ("EASTER-002");
+  key = pal_event_key_string (event);
+  ASSERT_STR_EQ (key, "EASTER-002");
+  g_free (key);
+
+  pal_event_free (event);
+}
+
+TEST (test_parse_event_missing_start_date)
+{
+  PalEvent *event = pal_event_init ();
+
+  // Feb 29 is accepted in any year, but there is no such day in 2023
+  ASSERT_TRUE (parse_event (event, "DAILY:20230229:20231231"));
+  ASSERT_EQ (event->start_day, PAL_NO_DAY);
+  ASSERT_EQ (event->end_day, test_julian (31, 12, 2023));
+
+  pal_event_free (event);
+}
+
+TEST (test_pal_date_matches_gdate)
+{
+  GDate gdate;
+  guint32 julian;
+
+  // samples of the early centuries, then every day up to 2500
+  for (julian = 1; julian < 1000000; julian += (julian < 600000) ? 997 : 1)
+    {
+      PalDate date = pal_date_from_julian (julian);
+
+      g_date_clear (&gdate, 1);
+      g_date_set_julian (&gdate, julian);
+      ASSERT_EQ (date.year, g_date_get_year (&gdate));
+      ASSERT_EQ (date.month, g_date_get_month (&gdate));
+      ASSERT_EQ (date.day, g_date_get_day (&gdate));
+      ASSERT_EQ (date.weekday, g_date_get_weekday (&gdate));
+      ASSERT_EQ (pal_date_from_dmy (date.day, date.month, date.year).julian,
+                 julian);
+      if (date.year > 2500)
+        break;
+    }
+}
+
+TEST (test_pal_date_gdate_round_trip)
+{
+  GDate *gdate = g_date_new_dmy (29, 2, 2024);
+  PalDate date = pal_date_from_gdate (gdate);
+  GDate back;
+
+  ASSERT_EQ (date.day, 29);
+  ASSERT_EQ (date.month, 2);
+  ASSERT_EQ (date.year, 2024);
+  ASSERT_EQ (date.weekday, G_DATE_THURSDAY);
+
+  pal_date_to_gdate (pal_date_add_days (date, 1), &back);
+  ASSERT_EQ (g_date_get_day (&back), 1);
+  ASSERT_EQ (g_date_get_month (&back), 3);
+
+  date = pal_date_add_days (date, -60);
+  ASSERT_EQ (date.day, 31);
+  ASSERT_EQ (date.month, 12);
+  ASSERT_EQ (date.year, 2023);
+
+  g_date_free (gdate);
+}
+
+TEST (test_pal_event_once_day)
+{
+  PalEvent *event = pal_event_init ();
+
+  ASSERT_EQ (pal_event_once_day (event), PAL_NO_DAY);
+
+  ASSERT_TRUE (parse_event (event, "20240229"));
+  ASSERT_EQ (pal_event_once_day (event), test_julian (29, 2, 2024));
+
+  ASSERT_TRUE (parse_event (event, "20230229"));
+  ASSERT_EQ (pal_event_once_day (event), PAL_NO_DAY);
+
+  ASSERT_TRUE (parse_event (event, "00000229"));
+  ASSERT_EQ (pal_event_once_day (event), PAL_NO_DAY);
+
+  pal_event_free (event);
+}
+
+TEST (test_todo_events_follow_query_today)
+{
+  PalQuery *first = pal_query_new (pal_date_from_dmy (1, 3, 2024));
+  PalQuery *other = pal_query_new (pal_date_from_dmy (2, 3, 2024));
+  GDate *day1 = g_date_new_dmy (1, 3, 2024);
+  GDate *day2 = g_date_new_dmy (2, 3, 2024);
+
+  setup_test_hashtable ();
+  add_test_event ("TODO", "Todo");
+
+  ASSERT_EQ (pal_get_event_count (first, day1), 1);
+  ASSERT_EQ (pal_get_event_count (first, day2), 0);
+
+  /* a query for another day moves the TODO events */
+  ASSERT_EQ (pal_get_event_count (other, day1), 0);
+  ASSERT_EQ (pal_get_event_count (other, day2), 1);
+
+  pal_query_free (first);
+  pal_query_free (other);
+  g_date_free (day1);
+  g_date_free (day2);
+}
+
+TEST (test_get_key_todo_uses_query_today)
+{
+  PalQuery *q = pal_query_new (pal_date_from_dmy (1, 3, 2024));
+  gchar buf[MAX_KEYLEN] = "";
+
+  ASSERT_TRUE (PalEventTypes[0].get_key (q, q->today, buf));
+  ASSERT_STR_EQ (buf, "TODO");
+  ASSERT_FALSE (
+      PalEventTypes[0].get_key (q, pal_date_add_days (q->today, 1), buf));
+
+  pal_query_free (q);
+}
+
+TEST (test_pal_get_day_count_and_events)
+{
+  PalDate day = pal_date_from_dmy (1, 3, 2024);
+  PalEvent *events[2] = { NULL, NULL };
+
+  setup_test_hashtable ();
+  add_test_event ("DAILY", "Daily");
+  add_test_event ("20240301", "Once");
+  add_test_event ("FRI", "Friday");
+
+  ASSERT_EQ (pal_get_day_count (query, day), 3);
+  ASSERT_EQ (pal_get_day_count (query, pal_date_add_days (day, 1)), 1);
+
+  /* same order as get_events, starting from the given event */
+  ASSERT_EQ (pal_get_day_events (query, day, 1, events, 2), 3);
+  ASSERT_STR_EQ (events[0]->text, "Daily");
+  ASSERT_STR_EQ (events[1]->text, "Friday");
+
+  /* nothing is copied past the last event */
+  events[1] = NULL;
+  ASSERT_EQ (pal_get_day_events (query, day, 2, events, 2), 3);
+  ASSERT_STR_EQ (events[0]->text, "Friday");
+  ASSERT_NULL (events[1]);
+}
+
+TEST (test_pal_get_day_marker)
+{
+  PalDate day = pal_date_from_dmy (1, 3, 2024);
+  PalMarker marker = { 0, 0, 0 };
+  PalEvent *event;
+
+  setup_test_hashtable ();
+  ASSERT_FALSE (pal_get_day_marker (query, day, &marker));
+
+  event = pal_event_init ();
+  event->text = g_strdup ("Hidden");
+  event->key = pal_event_key_pack ("20240301");
+  event->start = '(';
+  event->end = ')';
+  event->hide = TRUE;
+  pal_event_table_add (ht, event);
+  pal_event_index_clear ();
+  ASSERT_FALSE (pal_get_day_marker (query, day, &marker));
+
+  event = pal_event_init ();
+  event->text = g_strdup ("Shown");
+  event->key = pal_event_key_pack ("DAILY");
+  event->start = '<';
+  event->end = '>';
+  event->color = 3;
+  pal_event_table_add (ht, event);
+  pal_event_index_clear ();
+  ASSERT_TRUE (pal_get_day_marker (query, day, &marker));
+  ASSERT_EQ (marker.start, '<');
+  ASSERT_EQ (marker.end, '>');
+  ASSERT_EQ (marker.color, 3);
+
+  /* events with other markers or colors are merged */
+  event = pal_event_init ();
+  event->text = g_strdup ("Other");
+  event->key = pal_event_key_pack ("FRI");
+  event->start = '<';
+  event->end = ']';
+  event->color = 3;
+  pal_event_table_add (ht, event);
+  pal_event_index_clear ();
+  ASSERT_TRUE (pal_get_day_marker (query, day, &marker));
+  ASSERT_EQ (marker.start, '*');
+  ASSERT_EQ (marker.end, '*');
+  ASSERT_EQ (marker.color, 3);
+
+  event->color = 5;
+  ASSERT_TRUE (pal_get_day_marker (query, day, &marker));
+  ASSERT_EQ (marker.color, -1);
+}
+
+TEST (test_pal_event_occurrences_match_get_events)
+{
+  ASSERT_EQ (count_step_mismatches ("TODO"), 0);
+  ASSERT_EQ (count_step_mismatches ("20240229"), 0);
+  ASSERT_EQ (count_step_mismatches ("DAILY"), 0);
+  ASSERT_EQ (count_step_mismatches ("DAILY/3:20240105:20240301"), 0);
+  ASSERT_EQ (count_step_mismatches ("MON"), 0);
+  ASSERT_EQ (count_step_mismatches ("WED/2:20240101:20251231"), 0);
+  ASSERT_EQ (count_step_mismatches ("00000031"), 0);
+  ASSERT_EQ (count_step_mismatches ("00000015/5:20230301:20261231"), 0);
+  ASSERT_EQ (count_step_mismatches ("*0051"), 0);
+  ASSERT_EQ (count_step_mismatches ("00000229"), 0);
+  ASSERT_EQ (count_step_mismatches ("00000704/2:20200101:20300101"), 0);
+  ASSERT_EQ (count_step_mismatches ("*0515"), 0);
+  ASSERT_EQ (count_step_mismatches ("*0254"), 0);
+  ASSERT_EQ (count_step_mismatches ("*00L6"), 0);
+  ASSERT_EQ (count_step_mismatches ("*02L1"), 0);
+  ASSERT_EQ (count_step_mismatches ("EASTER"), 0);
+  ASSERT_EQ (count_step_mismatches ("EASTER+300"), 0);
+  ASSERT_EQ (count_step_mismatches ("EASTER-090"), 0);
+}
+
+TEST (test_pal_get_next_day_has_no_horizon)
+{
+  guint32 start = test_julian (1, 1, 2024);
+  PalEvent *event;
+
+  setup_test_hashtable ();
+  ASSERT_EQ (pal_get_next_day (query, start, 1, NULL, NULL), PAL_NO_DAY);
+
+  add_test_event ("20300615", "Far away");
+  add_test_event ("20190101", "Long ago");
+  event = pal_event_init ();
+  event->text = g_strdup ("Mondays");
+  ASSERT_TRUE (parse_event (event, "MON:20240101:20240201"));
+  pal_event_table_add (ht, event);
+
+  ASSERT_EQ (pal_get_next_day (query, start, 1, NULL, NULL),
+             test_julian (8, 1, 2024));
+  ASSERT_EQ (pal_get_next_day (query, test_julian (29, 1, 2024), 1, NULL,
+                               NULL),
+             test_julian (15, 6, 2030));
+  ASSERT_EQ (pal_get_next_day (query, start, -1, NULL, NULL),
+             test_julian (1, 1, 2019));
+  ASSERT_EQ (pal_get_next_day (query, test_julian (15, 6, 2030), 1, NULL,
+                               NULL),
+             PAL_NO_DAY);
+}
+
+TEST (test_pal_get_next_events_match_get_events_range)
+{
+  PalDate start = pal_date_from_dmy (1, 1, 2024);
+  PalDate end = pal_date_from_dmy (31, 12, 2024);
+  GArray *range, *next;
+  PalEvent *event;
+  guint i;
+
+  setup_test_hashtable ();
+  add_test_event ("DAILY", "Every day");
+  add_test_event ("MON", "Mondays");
+  add_test_event ("00000015", "Mid month");
+  add_test_event ("*0254", "Fourth Thursday in February");
+  add_test_event ("EASTER", "Easter");
+  add_test_event ("20240301", "Once");
+  event = pal_event_init ();
+  event->text = g_strdup ("Early Wednesdays");
+  event->start_time = 7 * 60;
+  ASSERT_TRUE (parse_event (event, "WED/2:20240103:20241231"));
+  pal_event_table_add (ht, event);
+
+  range = get_events_range (query, start, end);
+  next = pal_get_next_events (query, start.julian - 1, 600);
+
+  ASSERT_EQ (next->len, 600);
+  for (i = 0; i < next->len && i < range->len; i++)
+    {
+      PalOccurrence *a = &g_array_index (range, PalOccurrence, i);
+      PalOccurrence *b = &g_array_index (next, PalOccurrence, i);
+
+      ASSERT_EQ (a->date.julian, b->date.julian);
+      ASSERT_TRUE (a->event == b->event);
+    }
+
+  g_array_free (range, TRUE);
+  g_array_free (next, TRUE);
+}
+
+TEST (test_pal_get_next_events_has_no_horizon)
+{
+  guint32 start = test_julian (1, 1, 2024);
+  GArray *next;
+
+  setup_test_hashtable ();
+  add_test_event ("20300615", "Far away");
+  add_test_event ("20190101", "Long ago");
+  add_test_event ("20240101", "Not after start");
+
+  next = pal_get_next_events (query, start, 5);
+  ASSERT_EQ (next->len, 1);
+  ASSERT_EQ (g_array_index (next, PalOccurrence, 0).date.julian,
+             test_julian (15, 6, 2030));
+  g_array_free (next, TRUE);
+
+  next = pal_get_next_events (query, start, 0);
+  ASSERT_EQ (next->len, 0);
+  g_array_free (next, TRUE);
+}
+
+TEST (test_ranged_events_kept_out_of_buckets)
+{
+  const PalEventBucket *bucket;
+  PalEvent *event;
+
+  setup_test_hashtable ();
+  add_test_event ("MON", "Every monday");
+  event = pal_event_init ();
+  event->text = g_strdup ("Mondays in 2020");
+  ASSERT_TRUE (parse_event (event, "MON:20200101:20201231"));
+  pal_event_table_add (ht, event);
+
+  bucket = pal_event_table_lookup (ht, pal_event_key_pack ("MON"));
+  ASSERT_NOT_NULL (bucket);
+  ASSERT_EQ (bucket->n_events, 1);
+  ASSERT_EQ (ht->n_ranged, 1);
+  ASSERT_TRUE (ht->ranged[0] == event);
+
+  ASSERT_EQ (pal_get_day_count (query, pal_date_from_dmy (6, 1, 2020)), 2);
+  ASSERT_EQ (pal_get_day_count (query, pal_date_from_dmy (4, 1, 2021)), 1);
+}
+
+TEST (test_ranged_events_keep_load_order)
+{
+  PalEvent *events[3];
+  PalEvent *event;
+  gint i;
+
+  setup_test_hashtable ();
+  event = pal_event_init ();
+  event->text = g_strdup ("Ranged first");
+  ASSERT_TRUE (parse_event (event, "DAILY:20240101:20241231"));
+  pal_event_table_add (ht, event);
+  add_test_event ("DAILY", "Plain second");
+  event = pal_event_init ();
+  event->text = g_strdup ("Ranged third");
+  ASSERT_TRUE (parse_event (event, "DAILY/2:20240101:20241231"));
+  pal_event_table_add (ht, event);
+
+  ASSERT_EQ (pal_get_day_events (query, pal_date_from_dmy (1, 1, 2024), 0,
+                                 events, 3),
+             3);
+  ASSERT_STR_EQ (events[0]->text, "Ranged first");
+  ASSERT_STR_EQ (events[1]->text, "Plain second");
+  ASSERT_STR_EQ (events[2]->text, "Ranged third");
+  ASSERT_EQ (pal_get_day_events (query, pal_date_from_dmy (2, 1, 2024), 0,
+                                 events, 3),
+             2);
+  for (i = 0; i < 2; i++)
+    ASSERT_TRUE (events[i]->period_count == 1);
+}
+
+// Helper to add an event at 09:00 from file file_num to the table,
+// in arena
+static void
+add_test_arena_event (PalEventArena *arena, gint file_num,
+                      const gchar *key, const gchar *text)
+{
+  PalEvent *head = pal_event_init ();
+  PalEvent *event = pal_event_copy_to (arena, head);
+  pal_event_free (head);
+
+  event->text = pal_event_strdup (event, text);
+  event->file_num = file_num;
+  event->start_time = 9 * 60;
+  ASSERT_TRUE (parse_event (event, key));
+  pal_event_table_add (ht, event);
+}
+
+TEST (test_pal_event_table_replace_arena_keeps_file_order)
+{
+  PalEventArena *first = pal_event_arena_new ();
+  PalEventArena *second = pal_event_arena_new ();
+  PalEvent *events[3];
+
+  setup_test_hashtable ();
+  add_test_arena_event (first, 0, "DAILY", "First file");
+  add_test_arena_event (first, 0, "DAILY:20240101:20241231", "First range");
+  pal_event_table_add_arena (ht, first);
+  add_test_arena_event (second, 1, "DAILY", "Second file");
+  pal_event_table_add_arena (ht, second);
+
+  pal_event_table_remove_arena (ht, first);
+  ASSERT_EQ (ht->n_ranged, 0);
+  ASSERT_EQ (pal_get_day_events (query, pal_date_from_dmy (1, 3, 2024), 0,
+                                 events, 3),
+             1);
+  ASSERT_STR_EQ (events[0]->text, "Second file");
+
+  /* the first file read again goes back in front of the second */
+  pal_event_index_clear ();
+  first = pal_event_arena_new ();
+  add_test_arena_event (first, 0, "DAILY", "First again");
+  add_test_arena_event (first, 0, "DAILY:20240101:20241231", "Range again");
+  pal_event_table_add_arena (ht, first);
+  pal_event_table_renumber (ht);
+
+  ASSERT_EQ (pal_get_day_events (query, pal_date_from_dmy (1, 3, 2024), 0,
+                                 events, 3),
+             3);
+  ASSERT_STR_EQ (events[0]->text, "First again");
+  ASSERT_STR_EQ (events[1]->text, "Range again");
+  ASSERT_STR_EQ (events[2]->text, "Second file");
+}
+
+/* what pal_event_key_pack returned before it had its own parser: the
+ * first type whose valid_string takes the key, packed by its pack_key */
+static guint32
+valid_string_key_pack (const gchar *key)
+{
+  gint i;
+
+  for (i = 0; i < PAL_NUM_EVENTTYPES; i++)
+    if (PalEventTypes[i].valid_string (key))
+      return PAL_KEY (i, PalEventTypes[i].pack_key (key));
+
+  return PAL_KEY_NONE;
+}
+
+TEST (test_pal_event_key_pack_matches_valid_string)
+{
+  static const gchar *words[]
+      = { "TODO",       "DAILY",      "MON",        "TUE",  "WED",
+          "THU",        "FRI",        "SAT",        "SUN",  "EASTER",
+          "EASTER+001", "EASTER-365", "EASTER+000", "EASTER+01",
+          "EASTER*001", "EASTER+0012", "EASTERX",   "TODOX", "MONDAY",
+          "mon",        "DAIL",       "",           "*",    "T",
+          "S",          "2024",       "202401011",  "2024010" };
+  static const gchar *years[]
+      = { "0000", "0001", "0100", "1900", "2000", "2023", "2024", "9999" };
+  static const gchar alphabet[] = "01256789L";
+  gchar key[16];
+  guint i, a, b, c, d;
+  gint month, day;
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    ASSERT_EQ (pal_event_key_pack (words[i]),
+               valid_string_key_pack (words[i]));
+
+  for (a = 0; alphabet[a] != '\0'; a++)
+    for (b = 0; alphabet[b] != '\0'; b++)
+      for (c = 0; alphabet[c] != '\0'; c++)
+        for (d = 0; alphabet[d] != '\0'; d++)
+          {
+            snprintf (key, sizeof (key), "*%c%c%c%c", alphabet[a],
+                      alphabet[b], alphabet[c], alphabet[d]);
+            ASSERT_EQ (pal_event_key_pack (key), valid_string_key_pack (key));
+          }
+
+  for (i = 0; i < G_N_ELEMENTS (years); i++)
+    for (month = 0; month <= 13; month++)
+      for (day = 0; day <= 32; day++)
+        {
+          snprintf (key, sizeof (key), "%s%02d%02d", years[i], month, day);
+          ASSERT_EQ (pal_event_key_pack (key), valid_string_key_pack (key));
+        }
+}
+
+TEST (test_parse_event_count_and_dates)
+{
+  PalEvent *event = pal_event_init ();
+
+  /* like sscanf's %d, the count can have a sign and text after it */
+  ASSERT_TRUE (parse_event (event, "DAILY/+3X:20240101"));
+  ASSERT_EQ (event->period_count, 3);
+  ASSERT_EQ (event->key, pal_event_key_pack ("DAILY"));
+  ASSERT_EQ (event->end_day, pal_date_from_dmy (1, 1, 3000).julian);
+
+  /* only the last '/' starts the count */
+  ASSERT_FALSE (parse_event (event, "DAILY/2/3"));
+  ASSERT_FALSE (parse_event (event, "DAILY/0"));
+  ASSERT_FALSE (parse_event (event, "DAILY/-1"));
+  ASSERT_FALSE (parse_event (event, "DAILY/"));
+  ASSERT_FALSE (parse_event (event, "DAILY/:20240101"));
+
+  /* nothing can follow the end date */
+  ASSERT_FALSE (parse_event (event, "DAILY:20240101:"));
+  ASSERT_FALSE (parse_event (event, "DAILY::20241231"));
+  ASSERT_FALSE (parse_event (event, "DAILY:20240101:20241231:20251231"));
+  ASSERT_FALSE (parse_event (event, ":20240101"));
+
+  /* the 29th of February parses in any year, but is only a day in
+   * leap years */
+  ASSERT_TRUE (parse_event (event, "MON:20230229:20240229"));
+  ASSERT_EQ (event->start_day, PAL_NO_DAY);
+  ASSERT_EQ (event->end_day, pal_date_from_dmy (29, 2, 2024).julian);
+
+  pal_event_free (event);
+}
+
+// Helper standing in for pal_input_load_hidden: adds one hidden event
+static gint test_hidden_loads = 0;
+
+static void
+load_test_hidden (const PalQuery *q)
+{
+  (void)q; /* Avoid unused warning */
+  test_hidden_loads++;
+  add_test_event ("20240301", "Hidden");
+}
+
+TEST (test_pal_event_table_loads_hidden_when_needed)
+{
+  PalDate day = pal_date_from_dmy (1, 3, 2024);
+  PalMarker marker = { 0, 0, 0 };
+
+  setup_test_hashtable ();
+  test_hidden_loads = 0;
+  ht->load_hidden = load_test_hidden;
+  add_test_event ("DAILY", "Shown");
+
+  /* the calendar doesn't need the hidden events */
+  ASSERT_TRUE (pal_get_day_marker (query, day, &marker));
+  ASSERT_EQ (test_hidden_loads, 0);
+
+  /* listing the day does, and the index built for the marker is
+   * built again with them */
+  ASSERT_EQ (pal_get_day_count (query, day), 2);
+  ASSERT_EQ (test_hidden_loads, 1);
+  ASSERT_NULL (ht->load_hidden);
+  ASSERT_EQ (pal_get_day_count (query, day), 2);
+  ASSERT_EQ (test_hidden_loads, 1);
+}
+
+TEST (test_pal_event_escape_reuses_template)
+{
+  PalEvent *event = pal_event_init ();
+  GString *out = g_string_new ("Type: ");
+  gchar *result;
+  event->text = g_strdup ("!2000!2001! wed !1990!, !12! !1999!");
+
+  result = pal_event_escape (event, pal_date_from_dmy (1, 1, 2024));
+  ASSERT_STR_EQ (result, "242001! wed 34, !12! 25");
+  g_free (result);
+
+  // The template made by the first call gives the ages for other years
+  ASSERT_NOT_NULL (event->cold->text_template);
+  ASSERT_EQ (event->cold->text_template->n_ages, 3);
+  pal_event_escape_to (out, event, pal_date_from_dmy (5, 3, 1995));
+  ASSERT_STR_EQ (out->str, "Type: -52001! wed 5, !12! -4");
+
+  g_string_free (out, TRUE);
+  pal_event_free (event);
+}
+
+// The load threads call pal_event_once_day at the same time, for years
+// that share a slot of the year facts cache
+static gpointer
+once_day_thread (gpointer data)
+{
+  gint n = GPOINTER_TO_INT (data);
+  gint wrong = 0;
+  gint i;
+
+  for (i = 0; i < 100000; i++)
+    {
+      gint year = 2000 + 16 * ((i + n) % 8);
+      gint month = 1 + i % 12;
+      gint day = 1 + i % 28;
+      gchar date_string[16];
+      PalEvent event;
+
+      snprintf (date_string, sizeof (date_string), "%04d%02d%02d", year,
+                month, day);
+      event.start_day = PAL_NO_DAY;
+      event.end_day = PAL_NO_DAY;
+      if (!parse_event (&event, date_string)
+          || pal_event_once_day (&event)
+                 != pal_date_from_dmy (day, month, year).julian)
+        wrong++;
+    }
+
+  return GINT_TO_POINTER (wrong);
+}
+
+TEST (test_pal_event_once_day_from_threads)
+{
+  GThread *threads[4];
+  gint i;
+
+  for (i = 0; i < 4; i++)
+    threads[i]
+        = g_thread_new ("once-day", once_day_thread, GINT_TO_POINTER (i));
+  for (i = 0; i < 4; i++)
+    ASSERT_EQ (GPOINTER_TO_INT (g_thread_join (threads[i])), 0);
+}
+
 TEST (test_pal_get_event_count_empty)
 {
   setup_test_hashtable ();
 
   GDate *date = g_date_new_dmy (1, 1, 2024);
-  gint count = pal_get_event_count (date);
+  gint count = pal_get_event_count (query, date);
 
   ASSERT_EQ (count, 0);
 
@@ -654,6 +1502,7 @@ main (void)
   settings = g_malloc (sizeof (Settings));
   settings->date_fmt = g_strdup ("%a %b %d, %Y");
   ht = NULL;
+  query = pal_query_new (pal_date_today ());
 
   printf ("Running event.c public API tests...\n\n");
 
@@ -705,6 +1554,38 @@ main (void)
   RUN_TEST (test_get_events_finds_specific_date);
   RUN_TEST (test_pal_get_event_count);
   RUN_TEST (test_pal_get_event_count_empty);
+  RUN_TEST (test_get_events_across_year_boundary);
+  RUN_TEST (test_pal_event_index_clear_sees_new_events);
+  RUN_TEST (test_get_events_range_across_year_boundary);
+  RUN_TEST (test_get_events_range_empty);
+  RUN_TEST (test_pal_event_key_pack);
+  RUN_TEST (test_pal_event_table_lookup);
+  RUN_TEST (test_get_events_easter_in_and_outside_table);
+  RUN_TEST (test_get_events_last_weekday);
+  RUN_TEST (test_get_events_sorted_by_time_then_type);
+  RUN_TEST (test_pal_event_copy_to_arena_shares_type);
+  RUN_TEST (test_pal_event_table_frees_arena_events);
+  RUN_TEST (test_pal_event_key_string);
+  RUN_TEST (test_parse_event_missing_start_date);
+  RUN_TEST (test_pal_date_matches_gdate);
+  RUN_TEST (test_pal_date_gdate_round_trip);
+  RUN_TEST (test_pal_event_once_day);
+  RUN_TEST (test_todo_events_follow_query_today);
+  RUN_TEST (test_get_key_todo_uses_query_today);
+  RUN_TEST (test_pal_get_day_count_and_events);
+  RUN_TEST (test_pal_get_day_marker);
+  RUN_TEST (test_pal_event_occurrences_match_get_events);
+  RUN_TEST (test_pal_get_next_day_has_no_horizon);
+  RUN_TEST (test_pal_get_next_events_match_get_events_range);
+  RUN_TEST (test_pal_get_next_events_has_no_horizon);
+  RUN_TEST (test_ranged_events_kept_out_of_buckets);
+  RUN_TEST (test_ranged_events_keep_load_order);
+  RUN_TEST (test_pal_event_table_replace_arena_keeps_file_order);
+  RUN_TEST (test_pal_event_key_pack_matches_valid_string);
+  RUN_TEST (test_parse_event_count_and_dates);
+  RUN_TEST (test_pal_event_table_loads_hidden_when_needed);
+  RUN_TEST (test_pal_event_escape_reuses_template);
+  RUN_TEST (test_pal_event_once_day_from_threads);
 
   // Print summary
   printf ("\n");
@@ -716,8 +1597,8 @@ main (void)
   printf ("=================================\n");
 
   // Cleanup
-  if (ht != NULL)
-    g_hash_table_destroy (ht);
+  pal_event_table_free (ht);
+  pal_query_free (query);
   g_free (settings->date_fmt);
   g_free (settings);
 